@@ -0,0 +1,231 @@
+/*
+ * Checks the bytecode engine on a real VM, run it with 'make rewriter_check'.
+ *
+ * The methods ending in Fields touch fields in the shapes the class rewriter
+ * has to get right: long and double writes, which need the longest stack
+ * shuffle, table and lookup switches, whose padding moves with the inserted
+ * code, exception handlers, branches that merge with values on the stack or
+ * land on a getfield, and a method too large for short jumps, which javac
+ * compiles with goto_w only. The VM verifies each rewritten method as the
+ * class loads, and each result is compared with the same computation on
+ * local variables, which the rewriter leaves alone.
+ *
+ * WIDE_JUMP_TABLE is replaced with the numbers 1 to WIDE_JUMP_VALUES before
+ * compiling. Keep REWRITER_CHECK_METHODS in the Makefile at the number of
+ * methods ending in Fields.
+ */
+public class RewriterCheck {
+
+    static class Holder {
+        int i;
+        long l;
+        double d;
+        Holder next;
+    }
+
+    static final int[] KEYS = { 1, 100, 10000, -5, 7 };
+
+    static int failures = 0;
+
+    static void check(String name, long actual, long expected) {
+        if(actual != expected) {
+            System.out.println(name + ": " + actual + ", expected " + expected);
+            failures++;
+        }
+    }
+
+    static long wideFields(Holder h, int n) {
+        for(int k = 0; k < n; ++k) {
+            h.l += k;
+            h.d = h.d + k*0.5;
+            h.i++;
+        }
+        return h.l + (long) h.d + h.i;
+    }
+
+    static long wideLocals(int n) {
+        long l = 0;
+        double d = 0;
+        int i = 0;
+        for(int k = 0; k < n; ++k) {
+            l += k;
+            d = d + k*0.5;
+            i++;
+        }
+        return l + (long) d + i;
+    }
+
+    static long tableSwitchFields(Holder h, int n) {
+        for(int k = 0; k < n; ++k) {
+            switch(k % 5) {
+            case 0: h.i += k; break;
+            case 1: h.l += h.i; break;
+            case 2: h.d += 1.5; break;
+            case 3: h.i = h.i*3 % 1000; break;
+            default: h.l -= 2; break;
+            }
+        }
+        return h.i + h.l + (long) h.d;
+    }
+
+    static long tableSwitchLocals(int n) {
+        int i = 0;
+        long l = 0;
+        double d = 0;
+        for(int k = 0; k < n; ++k) {
+            switch(k % 5) {
+            case 0: i += k; break;
+            case 1: l += i; break;
+            case 2: d += 1.5; break;
+            case 3: i = i*3 % 1000; break;
+            default: l -= 2; break;
+            }
+        }
+        return i + l + (long) d;
+    }
+
+    static long lookupSwitchFields(Holder h, int n) {
+        for(int k = 0; k < n; ++k) {
+            switch(KEYS[k % KEYS.length]) {
+            case -5: h.i -= 3; break;
+            case 1: h.l += k; break;
+            case 100: h.d += k; break;
+            case 10000: h.i += h.i >> 1; break;
+            default: h.l = h.l*3 % 1000003; break;
+            }
+        }
+        return h.i + h.l + (long) h.d;
+    }
+
+    static long lookupSwitchLocals(int n) {
+        int i = 0;
+        long l = 0;
+        double d = 0;
+        for(int k = 0; k < n; ++k) {
+            switch(KEYS[k % KEYS.length]) {
+            case -5: i -= 3; break;
+            case 1: l += k; break;
+            case 100: d += k; break;
+            case 10000: i += i >> 1; break;
+            default: l = l*3 % 1000003; break;
+            }
+        }
+        return i + l + (long) d;
+    }
+
+    /* Touches through a null next throw inside the recorded range. */
+    static long handlerFields(Holder h, int n) {
+        for(int k = 0; k < n; ++k) {
+            try {
+                h.next.i += k;
+                h.l += h.next.i;
+            }
+            catch(NullPointerException e) {
+                h.i += 10;
+                h.next = (k % 3 == 0 ? new Holder() : null);
+            }
+            finally {
+                h.d += 1;
+            }
+        }
+        return h.i + h.l + (long) h.d + (h.next != null ? h.next.i : 0);
+    }
+
+    static long handlerLocals(int n) {
+        int i = 0;
+        long l = 0;
+        double d = 0;
+        boolean has_next = false;
+        int next_i = 0;
+        for(int k = 0; k < n; ++k) {
+            if(has_next) {
+                next_i += k;
+                l += next_i;
+            }
+            else {
+                i += 10;
+                has_next = (k % 3 == 0);
+                next_i = 0;
+            }
+            d += 1;
+        }
+        return i + l + (long) d + (has_next ? next_i : 0);
+    }
+
+    /*
+     * The first two branches merge with a Holder and an int or long on the
+     * stack, the second lands right on a getfield.
+     */
+    static long mergeFields(Holder h, Holder other, int n) {
+        for(int k = 0; k < n; ++k) {
+            h.i = h.i + (k % 2 == 0 ? other.i : k);
+            other.i = (k % 3 == 0 ? h : other).i + 1;
+            h.l = (k % 4 == 0 ? h.l : other.l) + k;
+        }
+        return h.i + 31L*other.i + h.l;
+    }
+
+    static long mergeLocals(int n) {
+        int h_i = 0;
+        int other_i = 0;
+        long h_l = 0;
+        long other_l = 0;
+        for(int k = 0; k < n; ++k) {
+            h_i = h_i + (k % 2 == 0 ? other_i : k);
+            other_i = (k % 3 == 0 ? h_i : other_i) + 1;
+            h_l = (k % 4 == 0 ? h_l : other_l) + k;
+        }
+        return h_i + 31L*other_i + h_l;
+    }
+
+    /* The table makes the loop body larger than a short jump reaches. */
+    static long wideJumpFields(Holder h, int n) {
+        for(int k = 0; k < n; ++k) {
+            int[] table = { WIDE_JUMP_TABLE };
+            if(h.i % 2 == 0)
+                h.l += table[k % table.length];
+            else
+                h.l -= table[(k*7) % table.length];
+            h.i += k;
+        }
+        return h.l + h.i;
+    }
+
+    static long wideJumpLocals(int n) {
+        int i = 0;
+        long l = 0;
+        for(int k = 0; k < n; ++k) {
+            int[] table = { WIDE_JUMP_TABLE };
+            if(i % 2 == 0)
+                l += table[k % table.length];
+            else
+                l -= table[(k*7) % table.length];
+            i += k;
+        }
+        return l + i;
+    }
+
+    public static void main(String[] args) {
+        // Enough rounds for the rewritten methods to be JIT compiled too.
+        for(int round = 0; round < 200 && failures == 0; ++round) {
+            int n = 1000;
+            check("wide values", wideFields(new Holder(), n), wideLocals(n));
+            check("table switch", tableSwitchFields(new Holder(), n),
+                  tableSwitchLocals(n));
+            check("lookup switch", lookupSwitchFields(new Holder(), n),
+                  lookupSwitchLocals(n));
+            check("handlers", handlerFields(new Holder(), n),
+                  handlerLocals(n));
+            check("merges", mergeFields(new Holder(), new Holder(), n),
+                  mergeLocals(n));
+            check("wide jumps", wideJumpFields(new Holder(), 100),
+                  wideJumpLocals(100));
+        }
+
+        if(failures > 0) {
+            System.out.println(failures + " checks failed");
+            System.exit(1);
+        }
+        System.out.println("All checks passed");
+    }
+}
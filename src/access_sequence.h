@@ -0,0 +1,108 @@
+/*
+ * File:   access_sequence.h
+ *
+ * Compact storage for the sequence of threads accessing a shared object.
+ * Entries are 32-bit thread numbers, whose high bits the owner may use as
+ * flags. The first ACCESS_INLINE_CAPACITY entries live inside the sequence
+ * itself, which covers every object at the moment it becomes shared, longer
+ * sequences move to a growable block. The length is kept by the owner of
+ * the sequence, so the sequence fits in 8 bytes.
+ */
+#include <cstdlib>
+#include <string.h>
+
+#include "jvmti.h"
+#ifndef ACCESS_SEQUENCE_H
+#define	ACCESS_SEQUENCE_H
+
+#define ACCESS_INLINE_CAPACITY 2
+
+struct access_sequence {
+    union {
+        jint inline_threads[ACCESS_INLINE_CAPACITY];
+        /* block[0] holds the capacity, entries start at block[1]. */
+        jint* block;
+    };
+};
+
+/* Starts a sequence with its first two entries, its length becomes 2. */
+static inline void sequence_init(access_sequence* seq,
+                                 jint first_thread,
+                                 jint second_thread) {
+    seq->inline_threads[0] = first_thread;
+    seq->inline_threads[1] = second_thread;
+}
+
+static inline const jint* sequence_data(const access_sequence* seq,
+                                        jint length) {
+    return (length <= ACCESS_INLINE_CAPACITY ?
+                seq->inline_threads : seq->block + 1);
+}
+
+static inline jint sequence_back(const access_sequence* seq, jint length) {
+    return sequence_data(seq, length)[length - 1];
+}
+
+/* Sets flag bits on the last entry of a sequence. */
+static inline void sequence_mark_back(access_sequence* seq,
+                                      jint length,
+                                      jint bits) {
+    jint* threads = (length <= ACCESS_INLINE_CAPACITY ?
+                         seq->inline_threads : seq->block + 1);
+    threads[length - 1] |= bits;
+}
+
+/* Bytes held outside of the sequence itself. */
+static inline jlong sequence_bytes(const access_sequence* seq, jint length) {
+    return (length <= ACCESS_INLINE_CAPACITY ?
+                0 : (seq->block[0] + 1)*sizeof(jint));
+}
+
+/*
+ * Appends an entry to a sequence of the given length, the caller then adds
+ * one to the length. Returns the number of bytes the sequence had to
+ * allocate, or -1 if it ran out of memory and the entry was dropped.
+ */
+static inline jlong sequence_append(access_sequence* seq,
+                                    jint length,
+                                    jint thread) {
+    jlong old_bytes = sequence_bytes(seq, length);
+
+    if(length < ACCESS_INLINE_CAPACITY) {
+        seq->inline_threads[length] = thread;
+        return 0;
+    }
+
+    if(length == ACCESS_INLINE_CAPACITY) {
+        jint capacity = 4*ACCESS_INLINE_CAPACITY;
+        jint* block = static_cast<jint*>(
+                malloc((capacity + 1)*sizeof(jint)));
+        if(block == NULL) return -1;
+        block[0] = capacity;
+        memcpy(block + 1, seq->inline_threads,
+               ACCESS_INLINE_CAPACITY*sizeof(jint));
+        seq->block = block;
+    }
+    else if(length == seq->block[0]) {
+        jint capacity = 2*seq->block[0];
+        jint* block = static_cast<jint*>(
+                realloc(seq->block, (capacity + 1)*sizeof(jint)));
+        if(block == NULL) return -1;
+        block[0] = capacity;
+        seq->block = block;
+    }
+
+    seq->block[length + 1] = thread;
+    return sequence_bytes(seq, length + 1) - old_bytes;
+}
+
+/* Releases the block of a sequence, returns the number of bytes freed. */
+static inline jlong sequence_free(access_sequence* seq, jint length) {
+    jlong bytes = sequence_bytes(seq, length);
+    if(length > ACCESS_INLINE_CAPACITY) {
+        free(seq->block);
+    }
+    return bytes;
+}
+
+#endif	/* ACCESS_SEQUENCE_H */
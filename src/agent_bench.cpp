@@ -0,0 +1,365 @@
+/*
+ * agent_bench
+ *
+ * Purpose: A microbenchmark of the agent's event path. The agent is loaded
+ * into a fake JVM (see fake_jvm.h), and native threads post field access,
+ * field modification and object free events to it, so changes to the
+ * agent's locking and allocation can be measured without launching Java.
+ *
+ * Usage: agent_bench [key=value ...], see show_usage().
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <time.h>
+#include "jvmti.h"
+#include "fake_jvm.h"
+#include "info_pool.h"
+
+using namespace std;
+using fake_jvm::fake_object;
+
+/******************************************************************************/
+/* Declerations                                                               */
+/******************************************************************************/
+
+/*
+ * Which objects the threads touch: only their own, only objects of a pool
+ * all threads share, or their own with share_percent of the events going
+ * to the shared pool.
+ */
+enum sharing_pattern { PATTERN_LOCAL, PATTERN_SHARED, PATTERN_MIXED };
+
+static int thread_count = 4;
+static jlong events_per_thread = 1000000;
+static int private_objects = 4096;
+static int shared_objects = 1024;
+static int class_count = 16;
+static int field_count = 4;
+static sharing_pattern pattern = PATTERN_MIXED;
+static int share_percent = 10;
+static int write_percent = 25;
+
+/* Every free_every-th event of a thread frees one of its objects, 0 never. */
+static jlong free_every = 0;
+
+/* The latency of every latency_sample-th event is measured. */
+static jlong latency_sample = 16;
+
+static string agent_options = "BenchObjectInfo,BenchObjectAccesses";
+
+static vector<fake_object*> object_classes;
+static vector<fake_object*> shared_pool;
+
+static pthread_barrier_t start_barrier;
+
+/* Defined by the agent. */
+extern volatile jlong access_lists_memory;
+extern volatile jlong peak_access_lists_memory;
+
+/* What each bench thread works on, and what it measured. */
+struct bench_thread {
+    fake_object* thread;
+    vector<fake_object*> objects;
+    unsigned long long random;
+    vector<jlong> latencies;
+    jlong frees;
+};
+
+
+/******************************************************************************/
+/* Helper functions                                                           */
+/******************************************************************************/
+
+static jlong now_nanos() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (jlong) now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+/* xorshift64*, cheap enough not to show in the measurements. */
+static unsigned long long next_random(bench_thread* bench) {
+    bench->random ^= bench->random >> 12;
+    bench->random ^= bench->random << 25;
+    bench->random ^= bench->random >> 27;
+    return bench->random * 2685821657736338717ULL;
+}
+
+/*
+ * Makes an object of one of the bench classes, of one of a few sizes, and
+ * posts its allocation by the given thread.
+ */
+static fake_object* make_bench_object(int i, fake_object* thread) {
+    fake_object* object = fake_jvm::new_object(object_classes[i % class_count],
+                                               16 + 8*(i % 8));
+    fake_jvm::post_object_alloc(thread, object);
+    return object;
+}
+
+static fake_object* pick_object(bench_thread* bench) {
+    unsigned long long r = next_random(bench);
+
+    if(pattern == PATTERN_SHARED ||
+       (pattern == PATTERN_MIXED && (int) (r % 100) < share_percent))
+        return shared_pool[(r >> 8) % shared_pool.size()];
+    return bench->objects[(r >> 8) % bench->objects.size()];
+}
+
+/* Nearest rank percentile of sorted latencies. */
+static jlong percentile(const vector<jlong>& sorted, double p) {
+    if(sorted.empty()) return 0;
+    size_t rank = (size_t) (p*sorted.size()/100.0 + 0.5);
+    if(rank < 1) rank = 1;
+    if(rank > sorted.size()) rank = sorted.size();
+    return sorted[rank - 1];
+}
+
+/*
+ * Body of a bench thread. Starts its thread, waits for the others, then
+ * posts its events, measuring one in latency_sample of them.
+ */
+static void* run_bench_thread(void* arg) {
+    bench_thread* bench = static_cast<bench_thread*>(arg);
+
+    fake_jvm::attach_thread(bench->thread);
+    fake_jvm::post_thread_start(bench->thread);
+    pthread_barrier_wait(&start_barrier);
+
+    jlong since_free = 0;
+    for(jlong i = 0; i < events_per_thread; ++i) {
+        fake_object* object = pick_object(bench);
+        unsigned long long r = next_random(bench);
+        bool write = ((int) (r % 100) < write_percent);
+        int field = (r >> 8) % field_count;
+
+        if(i % latency_sample == 0) {
+            jlong start = now_nanos();
+            fake_jvm::post_field_event(bench->thread, object, field, write);
+            bench->latencies.push_back(now_nanos() - start);
+        }
+        else {
+            fake_jvm::post_field_event(bench->thread, object, field, write);
+        }
+
+        // Only objects no other thread touches may be collected.
+        if(free_every > 0 && ++since_free == free_every) {
+            since_free = 0;
+            if(!bench->objects.empty() && pattern != PATTERN_SHARED) {
+                // The freed object stands for a new one of the thread.
+                fake_object* freed = bench->objects[
+                        next_random(bench) % bench->objects.size()];
+                fake_jvm::free_object(freed);
+                fake_jvm::post_object_alloc(bench->thread, freed);
+                ++bench->frees;
+            }
+        }
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    fake_jvm::post_thread_end(bench->thread);
+    return NULL;
+}
+
+
+/******************************************************************************/
+/* Options                                                                    */
+/******************************************************************************/
+
+static void show_usage() {
+    cout<<"\nUsage: agent_bench [key=value ...]"<<endl;
+    cout<<"  threads=<n>        bench threads (4)"<<endl;
+    cout<<"  events=<n>         field events per thread (1000000)"<<endl;
+    cout<<"  objects=<n>        objects of each thread (4096)"<<endl;
+    cout<<"  shared=<n>         objects of the shared pool (1024)"<<endl;
+    cout<<"  classes=<n>        classes the objects belong to (16)"<<endl;
+    cout<<"  fields=<n>         instance fields of each class (4)"<<endl;
+    cout<<"  pattern=local|shared|mixed"<<endl
+        <<"                     which objects are touched (mixed)"<<endl;
+    cout<<"  share=<percent>    events on the shared pool when mixed (10)"
+        <<endl;
+    cout<<"  writes=<percent>   events that are modifications (25)"<<endl;
+    cout<<"  free_every=<n>     free a thread's object every n events (0)"
+        <<endl;
+    cout<<"  latency_sample=<n> measure every n-th event (16)"<<endl;
+    cout<<"  agent=<options>    agent options, for example "<<endl
+        <<"                     agent=BenchObjectInfo,BenchObjectAccesses,"
+        <<"sync=atomic"<<endl;
+}
+
+/* Applies a 'key=value' bench option, returns false if it is unknown. */
+static bool set_bench_option(const string& key, const string& value) {
+    if(key.compare("threads") == 0)
+        thread_count = max(1, atoi(value.c_str()));
+    else if(key.compare("events") == 0)
+        events_per_thread = max(1LL, atoll(value.c_str()));
+    else if(key.compare("objects") == 0)
+        private_objects = max(1, atoi(value.c_str()));
+    else if(key.compare("shared") == 0)
+        shared_objects = max(1, atoi(value.c_str()));
+    else if(key.compare("classes") == 0)
+        class_count = max(1, atoi(value.c_str()));
+    else if(key.compare("fields") == 0)
+        field_count = max(1, atoi(value.c_str()));
+    else if(key.compare("share") == 0)
+        share_percent = min(100, max(0, atoi(value.c_str())));
+    else if(key.compare("writes") == 0)
+        write_percent = min(100, max(0, atoi(value.c_str())));
+    else if(key.compare("free_every") == 0)
+        free_every = max(0LL, atoll(value.c_str()));
+    else if(key.compare("latency_sample") == 0)
+        latency_sample = max(1LL, atoll(value.c_str()));
+    else if(key.compare("agent") == 0)
+        agent_options = value;
+    else if(key.compare("pattern") == 0) {
+        if(value.compare("local") == 0)
+            pattern = PATTERN_LOCAL;
+        else if(value.compare("shared") == 0)
+            pattern = PATTERN_SHARED;
+        else if(value.compare("mixed") == 0)
+            pattern = PATTERN_MIXED;
+        else
+            return false;
+    }
+    else
+        return false;
+    return true;
+}
+
+static string pattern_name() {
+    ostringstream name;
+    if(pattern == PATTERN_LOCAL)
+        name<<"local";
+    else if(pattern == PATTERN_SHARED)
+        name<<"shared";
+    else
+        name<<"mixed ("<<share_percent<<"% shared)";
+    return name.str();
+}
+
+
+/******************************************************************************/
+/* Bench                                                                      */
+/******************************************************************************/
+
+int main(int argc, char* argv[]) {
+    for(int i = 1; i < argc; ++i) {
+        string option(argv[i]);
+        if(option.compare("help") == 0) {
+            show_usage();
+            return 0;
+        }
+        size_t equals = option.find('=');
+        if(equals == string::npos ||
+           !set_bench_option(option.substr(0, equals),
+                             option.substr(equals + 1))) {
+            cout<<"Unknown option: "<<option<<endl;
+            show_usage();
+            return 1;
+        }
+    }
+
+    fake_jvm::init();
+    vector<char> options(agent_options.begin(), agent_options.end());
+    options.push_back('\0');
+    if(Agent_OnLoad(fake_jvm::java_vm(), &options[0], NULL) != JNI_OK) {
+        cout<<"The agent did not load"<<endl;
+        return 1;
+    }
+
+    fake_object* main_thread = fake_jvm::new_thread("main");
+    fake_jvm::attach_thread(main_thread);
+    fake_jvm::post_vm_init(main_thread);
+
+    for(int i = 0; i < class_count; ++i) {
+        ostringstream signature;
+        signature<<"Lbench/Class"<<i<<";";
+        object_classes.push_back(fake_jvm::new_class(signature.str().c_str(),
+                                                     field_count));
+        fake_jvm::post_class_prepare(object_classes.back());
+    }
+    for(int i = 0; i < shared_objects; ++i) {
+        shared_pool.push_back(make_bench_object(i, main_thread));
+    }
+
+    vector<bench_thread> benches(thread_count);
+    for(int t = 0; t < thread_count; ++t) {
+        ostringstream name;
+        name<<"Bench "<<t;
+        benches[t].thread = fake_jvm::new_thread(name.str().c_str());
+        benches[t].random = 0x9E3779B97F4A7C15ULL * (t + 1);
+        benches[t].frees = 0;
+        if(pattern != PATTERN_SHARED) {
+            for(int i = 0; i < private_objects; ++i) {
+                benches[t].objects.push_back(make_bench_object(i,
+                                                               main_thread));
+            }
+        }
+    }
+
+    // The main thread joins the barrier to time the events only.
+    pthread_barrier_init(&start_barrier, NULL, thread_count + 1);
+    vector<pthread_t> native_threads(thread_count);
+    for(int t = 0; t < thread_count; ++t) {
+        pthread_create(&native_threads[t], NULL, &run_bench_thread,
+                       &benches[t]);
+    }
+    pthread_barrier_wait(&start_barrier);
+    jlong start = now_nanos();
+    pthread_barrier_wait(&start_barrier);
+    jlong elapsed = now_nanos() - start;
+
+    for(int t = 0; t < thread_count; ++t) {
+        pthread_join(native_threads[t], NULL);
+    }
+    pthread_barrier_destroy(&start_barrier);
+
+    // Measured before VM death gives the records of shared objects back.
+    jlong tracked = fake_jvm::tagged_objects();
+    jlong pool_bytes = info_pool::live_bytes();
+    jlong list_bytes = access_lists_memory;
+    jlong agent_bytes = pool_bytes + list_bytes;
+    jlong peak_bytes = info_pool::peak_bytes() + peak_access_lists_memory;
+    jlong reserved_bytes = info_pool::reserved_bytes();
+
+    fake_jvm::post_vm_death();
+    fake_jvm::join_agent_threads();
+    Agent_OnUnload(fake_jvm::java_vm());
+
+    vector<jlong> latencies;
+    jlong frees = 0;
+    for(int t = 0; t < thread_count; ++t) {
+        latencies.insert(latencies.end(), benches[t].latencies.begin(),
+                         benches[t].latencies.end());
+        frees += benches[t].frees;
+    }
+    sort(latencies.begin(), latencies.end());
+
+    jlong events = events_per_thread*thread_count;
+    double seconds = elapsed/1e9;
+
+    cout<<"\nAgent bench: "<<thread_count<<" threads, "
+        <<pattern_name()<<" objects, "<<write_percent<<"% writes"<<endl;
+    cout<<"Agent options: "<<agent_options<<endl;
+    cout<<"Events: "<<events<<" field events and "<<frees
+        <<" frees in "<<seconds<<" s, "
+        <<(jlong) (seconds > 0 ? events/seconds : 0)<<" events/s"<<endl;
+    cout<<"Latency (ns, every "<<latency_sample<<" events): "
+        <<"p50 "<<percentile(latencies, 50)
+        <<", p90 "<<percentile(latencies, 90)
+        <<", p99 "<<percentile(latencies, 99)
+        <<", p99.9 "<<percentile(latencies, 99.9)
+        <<", max "<<(latencies.empty() ? 0 : latencies.back())<<endl;
+    cout<<"Agent memory: "<<agent_bytes<<" bytes for "<<tracked
+        <<" tracked objects, "
+        <<(tracked > 0 ? agent_bytes/(double) tracked : 0)
+        <<" bytes per object ("<<pool_bytes<<" in records, "
+        <<list_bytes<<" in access lists, "<<peak_bytes<<" peak, "
+        <<reserved_bytes<<" reserved)"<<endl;
+    return 0;
+}
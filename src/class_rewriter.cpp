@@ -0,0 +1,844 @@
+#include <string.h>
+#include <vector>
+#include "jvmti.h"
+#include "class_rewriter.h"
+
+using namespace std;
+
+/* Constant pool tags */
+const unsigned char CONSTANT_Utf8 = 1;
+const unsigned char CONSTANT_Integer = 3;
+const unsigned char CONSTANT_Float = 4;
+const unsigned char CONSTANT_Long = 5;
+const unsigned char CONSTANT_Double = 6;
+const unsigned char CONSTANT_Class = 7;
+const unsigned char CONSTANT_String = 8;
+const unsigned char CONSTANT_Fieldref = 9;
+const unsigned char CONSTANT_Methodref = 10;
+const unsigned char CONSTANT_InterfaceMethodref = 11;
+const unsigned char CONSTANT_NameAndType = 12;
+const unsigned char CONSTANT_MethodHandle = 15;
+const unsigned char CONSTANT_MethodType = 16;
+const unsigned char CONSTANT_Dynamic = 17;
+const unsigned char CONSTANT_InvokeDynamic = 18;
+const unsigned char CONSTANT_Module = 19;
+const unsigned char CONSTANT_Package = 20;
+
+/* Opcodes the rewriter emits or has to look into */
+const unsigned char OP_POP = 0x57;
+const unsigned char OP_POP2 = 0x58;
+const unsigned char OP_DUP = 0x59;
+const unsigned char OP_DUP_X2 = 0x5b;
+const unsigned char OP_DUP2 = 0x5c;
+const unsigned char OP_DUP2_X1 = 0x5d;
+const unsigned char OP_IFEQ = 0x99;
+const unsigned char OP_JSR = 0xa8;
+const unsigned char OP_TABLESWITCH = 0xaa;
+const unsigned char OP_LOOKUPSWITCH = 0xab;
+const unsigned char OP_GETFIELD = 0xb4;
+const unsigned char OP_PUTFIELD = 0xb5;
+const unsigned char OP_INVOKESTATIC = 0xb8;
+const unsigned char OP_WIDE = 0xc4;
+const unsigned char OP_IFNULL = 0xc6;
+const unsigned char OP_IFNONNULL = 0xc7;
+const unsigned char OP_GOTO_W = 0xc8;
+const unsigned char OP_JSR_W = 0xc9;
+
+/*
+ * Length of each instruction in bytes. -1 marks instructions of variable
+ * length, 0 marks opcodes that are not valid in a class file.
+ */
+const signed char opcode_lengths[256] = {
+     1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /* 0x00 */
+     2,  3,  2,  3,  3,  2,  2,  2,  2,  2,  1,  1,  1,  1,  1,  1,  /* 0x10 */
+     1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /* 0x20 */
+     1,  1,  1,  1,  1,  1,  2,  2,  2,  2,  2,  1,  1,  1,  1,  1,  /* 0x30 */
+     1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /* 0x40 */
+     1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /* 0x50 */
+     1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /* 0x60 */
+     1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /* 0x70 */
+     1,  1,  1,  1,  3,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /* 0x80 */
+     1,  1,  1,  1,  1,  1,  1,  1,  1,  3,  3,  3,  3,  3,  3,  3,  /* 0x90 */
+     3,  3,  3,  3,  3,  3,  3,  3,  3,  2, -1, -1,  1,  1,  1,  1,  /* 0xa0 */
+     1,  1,  3,  3,  3,  3,  3,  3,  3,  5,  5,  3,  2,  3,  1,  1,  /* 0xb0 */
+     3,  3,  1,  1, -1,  4,  3,  3,  5,  5,  0,  0,  0,  0,  0,  0,  /* 0xc0 */
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  /* 0xd0 */
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  /* 0xe0 */
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  /* 0xf0 */
+};
+
+/* Number of constant pool entries added to each rewritten class. */
+const unsigned int added_constants = 9;
+
+/*
+ * Reads big endian values from a class file. Reading past the end sets
+ * 'failed' and returns zeros, so callers check once after a group of reads.
+ */
+struct class_input {
+    const unsigned char* data;
+    size_t length;
+    size_t pos;
+    bool failed;
+};
+
+/* A class file's constant pool, as offsets of each entry's tag. */
+struct constant_pool {
+    const unsigned char* data;
+    vector<unsigned char> tags;
+    vector<size_t> offsets;
+};
+
+/* Constant pool indices of the recorder methods in a rewritten class. */
+struct recorder_refs {
+    unsigned int read_method;
+    unsigned int write_method;
+};
+
+static void init_input(class_input* in, const unsigned char* data, size_t length) {
+    in->data = data;
+    in->length = length;
+    in->pos = 0;
+    in->failed = false;
+}
+
+/* Returns the next count bytes, or NULL if there are not that many. */
+static const unsigned char* read_bytes(class_input* in, size_t count) {
+    if(in->failed || count > in->length - in->pos) {
+        in->failed = true;
+        return NULL;
+    }
+    const unsigned char* bytes = in->data + in->pos;
+    in->pos += count;
+    return bytes;
+}
+
+static unsigned int read_u1(class_input* in) {
+    const unsigned char* p = read_bytes(in, 1);
+    return p ? p[0] : 0;
+}
+
+static unsigned int read_u2(class_input* in) {
+    const unsigned char* p = read_bytes(in, 2);
+    return p ? (p[0] << 8) | p[1] : 0;
+}
+
+static unsigned int read_u4(class_input* in) {
+    const unsigned char* p = read_bytes(in, 4);
+    return p ? ((unsigned int) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]
+             : 0;
+}
+
+static int get_s2(const unsigned char* p) {
+    return (short) ((p[0] << 8) | p[1]);
+}
+
+static int get_s4(const unsigned char* p) {
+    return (int) (((unsigned int) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]);
+}
+
+static void put_u1(vector<unsigned char>* out, unsigned int value) {
+    out->push_back((unsigned char) value);
+}
+
+static void put_u2(vector<unsigned char>* out, unsigned int value) {
+    out->push_back((unsigned char) (value >> 8));
+    out->push_back((unsigned char) value);
+}
+
+static void put_u4(vector<unsigned char>* out, unsigned int value) {
+    out->push_back((unsigned char) (value >> 24));
+    out->push_back((unsigned char) (value >> 16));
+    out->push_back((unsigned char) (value >> 8));
+    out->push_back((unsigned char) value);
+}
+
+static void put_bytes(vector<unsigned char>* out,
+                      const unsigned char* bytes,
+                      size_t count) {
+    out->insert(out->end(), bytes, bytes + count);
+}
+
+static void set_u2(vector<unsigned char>* out, size_t pos, unsigned int value) {
+    (*out)[pos] = (unsigned char) (value >> 8);
+    (*out)[pos + 1] = (unsigned char) value;
+}
+
+static void set_u4(vector<unsigned char>* out, size_t pos, unsigned int value) {
+    (*out)[pos] = (unsigned char) (value >> 24);
+    (*out)[pos + 1] = (unsigned char) (value >> 16);
+    (*out)[pos + 2] = (unsigned char) (value >> 8);
+    (*out)[pos + 3] = (unsigned char) value;
+}
+
+static void put_utf8(vector<unsigned char>* out, const char* str) {
+    put_u1(out, CONSTANT_Utf8);
+    put_u2(out, strlen(str));
+    put_bytes(out, reinterpret_cast<const unsigned char*>(str), strlen(str));
+}
+
+/* Reads the constant pool, leaving 'in' at the class's access flags. */
+static bool read_constant_pool(class_input* in,
+                               unsigned int count,
+                               constant_pool* cp) {
+    cp->data = in->data;
+    cp->tags.assign(count, 0);
+    cp->offsets.assign(count, 0);
+
+    for(unsigned int i = 1; i < count; ++i) {
+        cp->offsets[i] = in->pos;
+        unsigned char tag = read_u1(in);
+        cp->tags[i] = tag;
+
+        switch(tag) {
+            case CONSTANT_Utf8:
+                read_bytes(in, read_u2(in));
+                break;
+            case CONSTANT_Class:
+            case CONSTANT_String:
+            case CONSTANT_MethodType:
+            case CONSTANT_Module:
+            case CONSTANT_Package:
+                read_bytes(in, 2);
+                break;
+            case CONSTANT_MethodHandle:
+                read_bytes(in, 3);
+                break;
+            case CONSTANT_Integer:
+            case CONSTANT_Float:
+            case CONSTANT_Fieldref:
+            case CONSTANT_Methodref:
+            case CONSTANT_InterfaceMethodref:
+            case CONSTANT_NameAndType:
+            case CONSTANT_Dynamic:
+            case CONSTANT_InvokeDynamic:
+                read_bytes(in, 4);
+                break;
+            case CONSTANT_Long:
+            case CONSTANT_Double:
+                // These take two slots in the pool.
+                read_bytes(in, 8);
+                ++i;
+                break;
+            default:
+                return false;
+        }
+        if(in->failed) return false;
+    }
+    return true;
+}
+
+/* Compares a Utf8 constant with a string. */
+static bool utf8_equals(const constant_pool& cp,
+                        unsigned int index,
+                        const char* str) {
+    if(index == 0 || index >= cp.tags.size() ||
+       cp.tags[index] != CONSTANT_Utf8)
+        return false;
+
+    const unsigned char* entry = cp.data + cp.offsets[index];
+    size_t length = (entry[1] << 8) | entry[2];
+    return length == strlen(str) && memcmp(entry + 3, str, length) == 0;
+}
+
+/* Returns the first character of a Fieldref's descriptor, 0 if malformed. */
+static char field_descriptor_type(const constant_pool& cp, unsigned int index) {
+    if(index == 0 || index >= cp.tags.size() ||
+       cp.tags[index] != CONSTANT_Fieldref)
+        return 0;
+
+    const unsigned char* field = cp.data + cp.offsets[index];
+    unsigned int name_and_type = (field[3] << 8) | field[4];
+    if(name_and_type >= cp.tags.size() ||
+       cp.tags[name_and_type] != CONSTANT_NameAndType)
+        return 0;
+
+    const unsigned char* nat = cp.data + cp.offsets[name_and_type];
+    unsigned int descriptor = (nat[3] << 8) | nat[4];
+    if(descriptor >= cp.tags.size() || cp.tags[descriptor] != CONSTANT_Utf8)
+        return 0;
+
+    const unsigned char* utf8 = cp.data + cp.offsets[descriptor];
+    return ((utf8[1] << 8) | utf8[2]) > 0 ? utf8[3] : 0;
+}
+
+/*
+ * Returns the length of the instruction at pc, or 0 if it is not valid or
+ * runs past the end of the code.
+ */
+static unsigned int instruction_length(const unsigned char* code,
+                                       unsigned int code_length,
+                                       unsigned int pc) {
+    unsigned char op = code[pc];
+    long length = opcode_lengths[op];
+
+    if(op == OP_TABLESWITCH || op == OP_LOOKUPSWITCH) {
+        // Operands are aligned to 4 bytes from the start of the code.
+        unsigned int operands = pc + 1 + (3 - pc % 4);
+        if(operands + 12 > code_length) return 0;
+
+        if(op == OP_TABLESWITCH) {
+            long low = get_s4(code + operands + 4);
+            long high = get_s4(code + operands + 8);
+            if(high < low) return 0;
+            length = operands - pc + 12 + 4*(high - low + 1);
+        }
+        else {
+            long pairs = get_s4(code + operands + 4);
+            if(pairs < 0) return 0;
+            length = operands - pc + 8 + 8*pairs;
+        }
+    }
+    else if(op == OP_WIDE) {
+        if(pc + 1 >= code_length) return 0;
+        length = (code[pc + 1] == 0x84 ? 6 : 4);
+    }
+
+    if(length <= 0 || length > (long) (code_length - pc)) return 0;
+    return (unsigned int) length;
+}
+
+/* Length of the code inserted before the instruction at pc. */
+static unsigned int inserted_length(const unsigned char* code,
+                                    unsigned int pc,
+                                    const constant_pool& cp) {
+    if(code[pc] == OP_GETFIELD) {
+        return 4;
+    }
+    if(code[pc] == OP_PUTFIELD) {
+        char type = field_descriptor_type(cp, (code[pc + 1] << 8) | code[pc + 2]);
+        return (type == 'J' || type == 'D' ? 6 : 5);
+    }
+    return 0;
+}
+
+/*
+ * Emits the code that passes the object of a getfield or putfield to the
+ * recorder, leaving the operand stack as it was.
+ */
+static void put_recorder_call(const unsigned char* code,
+                              unsigned int pc,
+                              unsigned int inserted,
+                              const recorder_refs& refs,
+                              vector<unsigned char>* out) {
+    if(code[pc] == OP_GETFIELD) {
+        // ..., object -> ..., object, object
+        put_u1(out, OP_DUP);
+        put_u1(out, OP_INVOKESTATIC);
+        put_u2(out, refs.read_method);
+        return;
+    }
+
+    if(inserted == 5) {
+        // ..., object, value -> ..., object, value, object
+        put_u1(out, OP_DUP2);
+        put_u1(out, OP_POP);
+    }
+    else {
+        // ..., object, wide value -> ..., object, wide value, object
+        put_u1(out, OP_DUP2_X1);
+        put_u1(out, OP_POP2);
+        put_u1(out, OP_DUP_X2);
+    }
+    put_u1(out, OP_INVOKESTATIC);
+    put_u2(out, refs.write_method);
+}
+
+/*
+ * Maps an offset in the original code to the rewritten code. Code inserted
+ * before an instruction belongs to it, so branches and frames now land on
+ * the inserted code.
+ */
+static unsigned int map_offset(const vector<int>& new_offsets,
+                               long offset,
+                               bool* failed) {
+    if(offset < 0 || offset >= (long) new_offsets.size() ||
+       new_offsets[offset] < 0) {
+        *failed = true;
+        return 0;
+    }
+    return new_offsets[offset];
+}
+
+/* Copies a stack map verification type, relocating 'uninitialized' ones. */
+static void copy_verification_type(class_input* in,
+                                   const vector<int>& new_offsets,
+                                   vector<unsigned char>* out,
+                                   bool* failed) {
+    unsigned int tag = read_u1(in);
+    put_u1(out, tag);
+
+    if(tag == 7) {
+        // Object: a class constant
+        put_u2(out, read_u2(in));
+    }
+    else if(tag == 8) {
+        // Uninitialized: offset of the 'new' instruction
+        put_u2(out, map_offset(new_offsets, read_u2(in), failed));
+    }
+    else if(tag > 8) {
+        *failed = true;
+    }
+}
+
+/*
+ * Rewrites a StackMapTable. Frame offsets are deltas from the previous frame,
+ * so every frame is re-encoded, switching to the extended frame forms when a
+ * delta no longer fits in the compact ones.
+ */
+static bool rewrite_stack_map(const unsigned char* body,
+                              size_t length,
+                              const vector<int>& new_offsets,
+                              vector<unsigned char>* out) {
+    class_input in;
+    init_input(&in, body, length);
+    bool failed = false;
+
+    unsigned int frames = read_u2(&in);
+    put_u2(out, frames);
+
+    long old_offset = -1;
+    long new_previous = -1;
+
+    for(unsigned int i = 0; i < frames && !in.failed && !failed; ++i) {
+        unsigned int type = read_u1(&in);
+        unsigned int delta;
+
+        if(type < 128)
+            delta = type % 64;
+        else if(type >= 247)
+            delta = read_u2(&in);
+        else
+            return false;
+
+        old_offset += delta + 1;
+        long new_offset = map_offset(new_offsets, old_offset, &failed);
+        unsigned int new_delta = new_offset - new_previous - 1;
+        new_previous = new_offset;
+
+        if(type < 64 || type == 251) {
+            // same_frame
+            if(new_delta < 64) {
+                put_u1(out, new_delta);
+            }
+            else {
+                put_u1(out, 251);
+                put_u2(out, new_delta);
+            }
+        }
+        else if(type < 128 || type == 247) {
+            // same_locals_1_stack_item_frame
+            if(new_delta < 64) {
+                put_u1(out, 64 + new_delta);
+            }
+            else {
+                put_u1(out, 247);
+                put_u2(out, new_delta);
+            }
+            copy_verification_type(&in, new_offsets, out, &failed);
+        }
+        else if(type < 251) {
+            // chop_frame
+            put_u1(out, type);
+            put_u2(out, new_delta);
+        }
+        else if(type < 255) {
+            // append_frame
+            put_u1(out, type);
+            put_u2(out, new_delta);
+            for(unsigned int j = 0; j < type - 251; ++j)
+                copy_verification_type(&in, new_offsets, out, &failed);
+        }
+        else {
+            // full_frame
+            put_u1(out, type);
+            put_u2(out, new_delta);
+
+            unsigned int locals = read_u2(&in);
+            put_u2(out, locals);
+            for(unsigned int j = 0; j < locals; ++j)
+                copy_verification_type(&in, new_offsets, out, &failed);
+
+            unsigned int stack = read_u2(&in);
+            put_u2(out, stack);
+            for(unsigned int j = 0; j < stack; ++j)
+                copy_verification_type(&in, new_offsets, out, &failed);
+        }
+    }
+    return !in.failed && !failed;
+}
+
+/*
+ * Rewrites the body of a Code attribute. Returns false if the method has no
+ * field instructions, or cannot be rewritten, in which case it is left as
+ * it was.
+ */
+static bool rewrite_code(const unsigned char* body,
+                         size_t length,
+                         const constant_pool& cp,
+                         const recorder_refs& refs,
+                         vector<unsigned char>* out) {
+    class_input in;
+    init_input(&in, body, length);
+
+    unsigned int max_stack = read_u2(&in);
+    unsigned int max_locals = read_u2(&in);
+    unsigned int code_length = read_u4(&in);
+    const unsigned char* code = read_bytes(&in, code_length);
+    if(in.failed || code_length == 0) return false;
+
+    /*
+     * First pass: find where each instruction, together with the code
+     * inserted before it, starts in the rewritten code. Switch padding
+     * depends on the new position, so lengths are worked out as we go.
+     */
+    vector<int> new_offsets(code_length + 1, -1);
+    unsigned int new_pc = 0;
+    bool has_fields = false;
+
+    for(unsigned int pc = 0; pc < code_length; ) {
+        unsigned int insn_length = instruction_length(code, code_length, pc);
+        if(insn_length == 0) return false;
+
+        unsigned int inserted = inserted_length(code, pc, cp);
+        has_fields = has_fields || inserted > 0;
+
+        new_offsets[pc] = new_pc;
+        new_pc += inserted;
+
+        if(code[pc] == OP_TABLESWITCH || code[pc] == OP_LOOKUPSWITCH)
+            new_pc += insn_length - (3 - pc % 4) + (3 - new_pc % 4);
+        else
+            new_pc += insn_length;
+
+        pc += insn_length;
+    }
+    new_offsets[code_length] = new_pc;
+
+    // The verifier limits methods to 64K of code.
+    if(!has_fields || new_pc > 65535) return false;
+
+    put_u2(out, (max_stack + 2 > 65535 ? 65535 : max_stack + 2));
+    put_u2(out, max_locals);
+    put_u4(out, new_pc);
+
+    // Second pass: emit the code with branch offsets relocated.
+    size_t code_start = out->size();
+    bool failed = false;
+
+    for(unsigned int pc = 0; pc < code_length && !failed; ) {
+        unsigned char op = code[pc];
+        unsigned int insn_length = instruction_length(code, code_length, pc);
+        unsigned int inserted = inserted_length(code, pc, cp);
+
+        if(inserted > 0)
+            put_recorder_call(code, pc, inserted, refs, out);
+
+        long insn_pc = out->size() - code_start;
+
+        if((op >= OP_IFEQ && op <= OP_JSR) ||
+           op == OP_IFNULL || op == OP_IFNONNULL) {
+            long target = map_offset(new_offsets,
+                                     (long) pc + get_s2(code + pc + 1),
+                                     &failed);
+            long offset = target - insn_pc;
+            // A short branch that no longer reaches its target.
+            if(offset < -32768 || offset > 32767) failed = true;
+            put_u1(out, op);
+            put_u2(out, (unsigned int) offset);
+        }
+        else if(op == OP_GOTO_W || op == OP_JSR_W) {
+            long target = map_offset(new_offsets,
+                                     (long) pc + get_s4(code + pc + 1),
+                                     &failed);
+            put_u1(out, op);
+            put_u4(out, (unsigned int) (target - insn_pc));
+        }
+        else if(op == OP_TABLESWITCH || op == OP_LOOKUPSWITCH) {
+            put_u1(out, op);
+            while((out->size() - code_start) % 4 != 0)
+                put_u1(out, 0);
+
+            const unsigned char* operands = code + pc + 1 + (3 - pc % 4);
+            long default_target = map_offset(new_offsets,
+                                             (long) pc + get_s4(operands),
+                                             &failed);
+            put_u4(out, (unsigned int) (default_target - insn_pc));
+
+            long entries;
+            const unsigned char* entry;
+            size_t entry_size;
+            if(op == OP_TABLESWITCH) {
+                put_bytes(out, operands + 4, 8);
+                entries = (long) get_s4(operands + 8) - get_s4(operands + 4) + 1;
+                entry = operands + 12;
+                entry_size = 4;
+            }
+            else {
+                put_bytes(out, operands + 4, 4);
+                entries = get_s4(operands + 4);
+                entry = operands + 8;
+                entry_size = 8;
+            }
+
+            for(long i = 0; i < entries; ++i, entry += entry_size) {
+                // Lookup switch entries start with the matched value.
+                if(entry_size == 8) put_bytes(out, entry, 4);
+                long target = map_offset(new_offsets,
+                                         (long) pc + get_s4(entry + entry_size - 4),
+                                         &failed);
+                put_u4(out, (unsigned int) (target - insn_pc));
+            }
+        }
+        else {
+            put_bytes(out, code + pc, insn_length);
+        }
+        pc += insn_length;
+    }
+    if(failed || out->size() - code_start != new_pc) return false;
+
+    // Exception handlers
+    unsigned int handlers = read_u2(&in);
+    put_u2(out, handlers);
+    for(unsigned int i = 0; i < handlers; ++i) {
+        put_u2(out, map_offset(new_offsets, read_u2(&in), &failed));
+        put_u2(out, map_offset(new_offsets, read_u2(&in), &failed));
+        put_u2(out, map_offset(new_offsets, read_u2(&in), &failed));
+        put_u2(out, read_u2(&in));
+    }
+
+    /*
+     * Attributes of the code. Those that refer to code offsets we know of are
+     * relocated, others (such as type annotations) may refer to offsets that
+     * are no longer valid, so they are dropped.
+     */
+    unsigned int attributes = read_u2(&in);
+    size_t count_pos = out->size();
+    unsigned int kept = 0;
+    put_u2(out, 0);
+
+    for(unsigned int i = 0; i < attributes && !in.failed && !failed; ++i) {
+        unsigned int name = read_u2(&in);
+        unsigned int attribute_length = read_u4(&in);
+        const unsigned char* attribute = read_bytes(&in, attribute_length);
+        if(in.failed) break;
+
+        bool lines = utf8_equals(cp, name, "LineNumberTable");
+        bool locals = utf8_equals(cp, name, "LocalVariableTable") ||
+                      utf8_equals(cp, name, "LocalVariableTypeTable");
+        bool frames = utf8_equals(cp, name, "StackMapTable");
+        if(!lines && !locals && !frames) continue;
+
+        put_u2(out, name);
+        size_t length_pos = out->size();
+        put_u4(out, 0);
+
+        if(frames) {
+            failed = !rewrite_stack_map(attribute, attribute_length,
+                                        new_offsets, out);
+        }
+        else {
+            class_input table;
+            init_input(&table, attribute, attribute_length);
+            unsigned int entries = read_u2(&table);
+            put_u2(out, entries);
+
+            for(unsigned int j = 0; j < entries; ++j) {
+                unsigned int start = read_u2(&table);
+                unsigned int new_start = map_offset(new_offsets, start, &failed);
+                put_u2(out, new_start);
+
+                if(lines) {
+                    put_u2(out, read_u2(&table));
+                }
+                else {
+                    unsigned int end = start + read_u2(&table);
+                    put_u2(out, map_offset(new_offsets, end, &failed)
+                                - new_start);
+                    put_bytes(out, read_bytes(&table, 6), 6);
+                }
+            }
+            failed = failed || table.failed;
+        }
+
+        set_u4(out, length_pos, out->size() - length_pos - 4);
+        ++kept;
+    }
+    set_u2(out, count_pos, kept);
+
+    return !in.failed && !failed;
+}
+
+/* Skips the fields or methods of a class, with their attributes. */
+static void skip_members(class_input* in) {
+    unsigned int members = read_u2(in);
+    for(unsigned int i = 0; i < members && !in->failed; ++i) {
+        read_bytes(in, 6);
+        unsigned int attributes = read_u2(in);
+        for(unsigned int j = 0; j < attributes && !in->failed; ++j) {
+            read_bytes(in, 2);
+            read_bytes(in, read_u4(in));
+        }
+    }
+}
+
+namespace class_rewriter {
+
+    const char* recorder_class_name = "ThreadLocalityRecorder";
+    const char* field_read_method = "fieldRead";
+    const char* field_write_method = "fieldWrite";
+    const char* recorder_method_signature = "(Ljava/lang/Object;)V";
+
+    /*
+     * Builds the recorder class: a public final class with two public static
+     * native methods taking the object whose field is read or written.
+     */
+    void build_recorder_class(vector<unsigned char>* class_data) {
+        vector<unsigned char>* out = class_data;
+        out->clear();
+
+        put_u4(out, 0xCAFEBABE);
+        put_u2(out, 0);
+        put_u2(out, 49);
+
+        put_u2(out, 8);
+        put_utf8(out, recorder_class_name);         // #1
+        put_u1(out, CONSTANT_Class);                // #2
+        put_u2(out, 1);
+        put_utf8(out, "java/lang/Object");          // #3
+        put_u1(out, CONSTANT_Class);                // #4
+        put_u2(out, 3);
+        put_utf8(out, field_read_method);           // #5
+        put_utf8(out, field_write_method);          // #6
+        put_utf8(out, recorder_method_signature);   // #7
+
+        // public final super, this class, super class, no interfaces, fields
+        put_u2(out, 0x0031);
+        put_u2(out, 2);
+        put_u2(out, 4);
+        put_u2(out, 0);
+        put_u2(out, 0);
+
+        // public static native methods, without attributes
+        put_u2(out, 2);
+        put_u2(out, 0x0109);
+        put_u2(out, 5);
+        put_u2(out, 7);
+        put_u2(out, 0);
+        put_u2(out, 0x0109);
+        put_u2(out, 6);
+        put_u2(out, 7);
+        put_u2(out, 0);
+
+        put_u2(out, 0);
+    }
+
+    /*
+     * Rewrites a class so every getfield and putfield outside of constructors
+     * first calls the recorder with its object. Constructors are left alone,
+     * since the verifier does not let 'this' escape before the super
+     * constructor has run. Returns false if the class needs no rewriting or
+     * cannot be rewritten. A method that cannot be rewritten is kept as it
+     * was.
+     */
+    bool rewrite_class(const unsigned char* class_data,
+                       jint class_data_length,
+                       vector<unsigned char>* new_class_data,
+                       int* rewritten_methods) {
+        class_input in;
+        init_input(&in, class_data, class_data_length);
+        *rewritten_methods = 0;
+
+        if(read_u4(&in) != 0xCAFEBABE) return false;
+        read_bytes(&in, 4);
+
+        unsigned int cp_count = read_u2(&in);
+        if(in.failed || cp_count == 0 || cp_count + added_constants > 65535)
+            return false;
+
+        constant_pool cp;
+        if(!read_constant_pool(&in, cp_count, &cp)) return false;
+        size_t cp_end = in.pos;
+
+        // Access flags, this and super class, then interfaces and fields.
+        read_bytes(&in, 6);
+        read_bytes(&in, 2*read_u2(&in));
+        skip_members(&in);
+        if(in.failed) return false;
+        size_t methods_start = in.pos;
+
+        vector<unsigned char>* out = new_class_data;
+        out->clear();
+        out->reserve(class_data_length + class_data_length/4 + 128);
+
+        put_bytes(out, class_data, 8);
+        put_u2(out, cp_count + added_constants);
+        put_bytes(out, class_data + 10, cp_end - 10);
+
+        unsigned int base = cp_count;
+        put_utf8(out, recorder_class_name);         // base
+        put_u1(out, CONSTANT_Class);                // base + 1
+        put_u2(out, base);
+        put_utf8(out, field_read_method);           // base + 2
+        put_utf8(out, field_write_method);          // base + 3
+        put_utf8(out, recorder_method_signature);   // base + 4
+        put_u1(out, CONSTANT_NameAndType);          // base + 5
+        put_u2(out, base + 2);
+        put_u2(out, base + 4);
+        put_u1(out, CONSTANT_NameAndType);          // base + 6
+        put_u2(out, base + 3);
+        put_u2(out, base + 4);
+        put_u1(out, CONSTANT_Methodref);            // base + 7
+        put_u2(out, base + 1);
+        put_u2(out, base + 5);
+        put_u1(out, CONSTANT_Methodref);            // base + 8
+        put_u2(out, base + 1);
+        put_u2(out, base + 6);
+
+        recorder_refs refs;
+        refs.read_method = base + 7;
+        refs.write_method = base + 8;
+
+        put_bytes(out, class_data + cp_end, methods_start - cp_end);
+
+        unsigned int methods = read_u2(&in);
+        put_u2(out, methods);
+
+        vector<unsigned char> code;
+        for(unsigned int i = 0; i < methods && !in.failed; ++i) {
+            const unsigned char* header = read_bytes(&in, 6);
+            unsigned int attributes = read_u2(&in);
+            if(in.failed) break;
+
+            put_bytes(out, header, 6);
+            put_u2(out, attributes);
+            bool constructor = utf8_equals(cp, (header[2] << 8) | header[3],
+                                           "<init>");
+
+            for(unsigned int j = 0; j < attributes; ++j) {
+                unsigned int name = read_u2(&in);
+                unsigned int length = read_u4(&in);
+                const unsigned char* body = read_bytes(&in, length);
+                if(in.failed) break;
+
+                code.clear();
+                if(!constructor && utf8_equals(cp, name, "Code") &&
+                   rewrite_code(body, length, cp, refs, &code)) {
+                    put_u2(out, name);
+                    put_u4(out, code.size());
+                    put_bytes(out, &code[0], code.size());
+                    ++*rewritten_methods;
+                }
+                else {
+                    put_u2(out, name);
+                    put_u4(out, length);
+                    put_bytes(out, body, length);
+                }
+            }
+        }
+        if(in.failed || *rewritten_methods == 0) return false;
+
+        // Class attributes
+        put_bytes(out, class_data + in.pos, class_data_length - in.pos);
+        return true;
+    }
+};
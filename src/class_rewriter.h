@@ -0,0 +1,33 @@
+/*
+ * File:   class_rewriter.h
+ *
+ * Bytecode instrumentation for the agent's bytecode engine. Instead of
+ * relying on JVMTI field watches, classes are rewritten as they load so that
+ * every getfield and putfield first passes the object to a static native
+ * method of the recorder class, which the agent defines and binds itself.
+ */
+#include <vector>
+
+#include "jvmti.h"
+#ifndef CLASS_REWRITER_H
+#define	CLASS_REWRITER_H
+
+using namespace std;
+
+namespace class_rewriter {
+    /* Internal name of the recorder class the rewritten code calls. */
+    extern const char* recorder_class_name;
+
+    /* Names and signature of the recorder's native methods. */
+    extern const char* field_read_method;
+    extern const char* field_write_method;
+    extern const char* recorder_method_signature;
+
+    void build_recorder_class(vector<unsigned char>* class_data);
+    bool rewrite_class(const unsigned char* class_data,
+                       jint class_data_length,
+                       vector<unsigned char>* new_class_data,
+                       int* rewritten_methods);
+};
+
+#endif	/* CLASS_REWRITER_H */
@@ -0,0 +1,893 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+#include "jvmti.h"
+#include "fake_jvm.h"
+
+using namespace std;
+using fake_jvm::fake_object;
+
+/******************************************************************************/
+/* Heap and threads                                                           */
+/******************************************************************************/
+
+/* Every object ever made, classes and threads included. */
+static vector<fake_object*> heap;
+static vector<fake_object*> threads;
+static vector<fake_object*> classes;
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The thread object of the calling native thread. */
+static __thread fake_object* current_thread = NULL;
+
+/* Native threads running agent threads, joined after VM death. */
+static vector<pthread_t> agent_threads;
+
+struct agent_thread_start {
+    fake_object* thread;
+    jvmtiStartFunction proc;
+    void* arg;
+};
+
+static jvmtiPhase phase = JVMTI_PHASE_ONLOAD;
+
+/* Enabled events, indexed by event number. */
+static volatile bool enabled_events[128];
+static jvmtiEventCallbacks callbacks;
+
+/* Stands for every method and field ID handed out. */
+static char any_member;
+
+/*
+ * Allocations are sampled like HotSpot does, after an exponentially
+ * distributed number of bytes a thread allocates, with a mean of
+ * sampling_interval. While an allocation is posted, allocating_object makes
+ * up the stack.
+ */
+static jint sampling_interval = 512*1024;
+static __thread double bytes_until_sample = -1;
+static __thread unsigned long long sample_random = 0;
+static __thread fake_object* allocating_object = NULL;
+const int allocation_depth = 2;
+
+static char* copy_name(const char* name) {
+    return name != NULL ? strdup(name) : NULL;
+}
+
+static fake_object* make_object(fake_object* klass, jlong size,
+                                const char* name, bool is_class) {
+    fake_object* object = new fake_object;
+    object->tag = 0;
+    object->size = size;
+    object->klass = klass;
+    object->name = copy_name(name);
+    object->is_class = is_class;
+    object->field_count = 0;
+    object->local_storage = NULL;
+
+    pthread_mutex_lock(&heap_lock);
+    heap.push_back(object);
+    if(is_class) classes.push_back(object);
+    pthread_mutex_unlock(&heap_lock);
+    return object;
+}
+
+static fake_object* as_object(jobject object) {
+    return reinterpret_cast<fake_object*>(object);
+}
+
+template<typename T>
+static T as_ref(fake_object* object) {
+    return reinterpret_cast<T>(object);
+}
+
+/* Field IDs are the field number plus one, shifted like a slot offset. */
+static jfieldID field_ID(int field) {
+    return reinterpret_cast<jfieldID>((size_t) (field + 1) << 2);
+}
+
+static int field_number(jfieldID field) {
+    return (int) (reinterpret_cast<size_t>(field) >> 2) - 1;
+}
+
+/*
+ * Method IDs of allocation stacks are the allocated class plus the frame
+ * number, classes are allocated with new so the low bits are free.
+ */
+static jmethodID method_ID(fake_object* klass, int frame) {
+    return reinterpret_cast<jmethodID>(reinterpret_cast<size_t>(klass) +
+                                       frame);
+}
+
+static fake_object* method_class(jmethodID method) {
+    return reinterpret_cast<fake_object*>(
+            reinterpret_cast<size_t>(method) & ~(size_t) 7);
+}
+
+static int method_frame(jmethodID method) {
+    return (int) (reinterpret_cast<size_t>(method) & 7);
+}
+
+/* Draws the bytes a thread allocates before its next sampled allocation. */
+static double next_sample_distance() {
+    if(sample_random == 0)
+        sample_random = reinterpret_cast<size_t>(&sample_random) | 1;
+    sample_random ^= sample_random >> 12;
+    sample_random ^= sample_random << 25;
+    sample_random ^= sample_random >> 27;
+    double unit = ((sample_random*2685821657736338717ULL) >> 11) *
+                  (1.0/9007199254740992.0);
+    return -sampling_interval*log(1 - unit);
+}
+
+/* Finds the class with a signature, making it the first time. */
+static fake_object* find_class(const string& signature) {
+    pthread_mutex_lock(&heap_lock);
+    for(size_t i = 0; i < classes.size(); ++i) {
+        if(signature.compare(classes[i]->name) == 0) {
+            pthread_mutex_unlock(&heap_lock);
+            return classes[i];
+        }
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return fake_jvm::new_class(signature.c_str());
+}
+
+
+/******************************************************************************/
+/* Raw monitors                                                               */
+/******************************************************************************/
+
+/*
+ * A reentrant monitor. The owner is the address of a thread local, which a
+ * thread only sets to its own and clears before it lets go of the mutex, so
+ * checking for reentry needs no lock.
+ */
+struct raw_monitor {
+    pthread_mutex_t mutex;
+    pthread_cond_t condition;
+    void* volatile owner;
+    int entries;
+};
+
+static __thread char monitor_identity;
+
+static raw_monitor* as_monitor(jrawMonitorID monitor) {
+    return reinterpret_cast<raw_monitor*>(monitor);
+}
+
+static jvmtiError JNICALL create_raw_monitor(jvmtiEnv* env,
+                                             const char* name,
+                                             jrawMonitorID* monitor_ptr) {
+    raw_monitor* monitor = new raw_monitor;
+    pthread_mutex_init(&monitor->mutex, NULL);
+    pthread_cond_init(&monitor->condition, NULL);
+    monitor->owner = NULL;
+    monitor->entries = 0;
+    *monitor_ptr = reinterpret_cast<jrawMonitorID>(monitor);
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL destroy_raw_monitor(jvmtiEnv* env,
+                                              jrawMonitorID id) {
+    raw_monitor* monitor = as_monitor(id);
+    pthread_mutex_destroy(&monitor->mutex);
+    pthread_cond_destroy(&monitor->condition);
+    delete monitor;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL raw_monitor_enter(jvmtiEnv* env, jrawMonitorID id) {
+    raw_monitor* monitor = as_monitor(id);
+    if(monitor->owner == &monitor_identity) {
+        ++monitor->entries;
+        return JVMTI_ERROR_NONE;
+    }
+    pthread_mutex_lock(&monitor->mutex);
+    monitor->owner = &monitor_identity;
+    monitor->entries = 1;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL raw_monitor_exit(jvmtiEnv* env, jrawMonitorID id) {
+    raw_monitor* monitor = as_monitor(id);
+    if(monitor->owner != &monitor_identity) return JVMTI_ERROR_NOT_AVAILABLE;
+
+    if(--monitor->entries == 0) {
+        monitor->owner = NULL;
+        pthread_mutex_unlock(&monitor->mutex);
+    }
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL raw_monitor_wait(jvmtiEnv* env,
+                                           jrawMonitorID id,
+                                           jlong millis) {
+    raw_monitor* monitor = as_monitor(id);
+    if(monitor->owner != &monitor_identity) return JVMTI_ERROR_NOT_AVAILABLE;
+
+    int entries = monitor->entries;
+    monitor->owner = NULL;
+    monitor->entries = 0;
+
+    if(millis <= 0) {
+        pthread_cond_wait(&monitor->condition, &monitor->mutex);
+    }
+    else {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        jlong nanos = (jlong) now.tv_usec*1000 + (millis % 1000)*1000000;
+
+        struct timespec until;
+        until.tv_sec = now.tv_sec + millis/1000 + nanos/1000000000;
+        until.tv_nsec = nanos % 1000000000;
+        pthread_cond_timedwait(&monitor->condition, &monitor->mutex, &until);
+    }
+
+    monitor->owner = &monitor_identity;
+    monitor->entries = entries;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL raw_monitor_notify(jvmtiEnv* env, jrawMonitorID id) {
+    pthread_cond_signal(&as_monitor(id)->condition);
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL raw_monitor_notify_all(jvmtiEnv* env,
+                                                 jrawMonitorID id) {
+    pthread_cond_broadcast(&as_monitor(id)->condition);
+    return JVMTI_ERROR_NONE;
+}
+
+
+/******************************************************************************/
+/* JVMTI functions                                                            */
+/******************************************************************************/
+
+static jvmtiError JNICALL allocate(jvmtiEnv* env,
+                                   jlong size,
+                                   unsigned char** mem_ptr) {
+    *mem_ptr = static_cast<unsigned char*>(malloc(size > 0 ? size : 1));
+    return *mem_ptr != NULL ? JVMTI_ERROR_NONE : JVMTI_ERROR_OUT_OF_MEMORY;
+}
+
+static jvmtiError JNICALL deallocate(jvmtiEnv* env, unsigned char* mem) {
+    free(mem);
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL get_phase(jvmtiEnv* env, jvmtiPhase* phase_ptr) {
+    *phase_ptr = phase;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL get_tag(jvmtiEnv* env,
+                                  jobject object,
+                                  jlong* tag_ptr) {
+    if(object == NULL) return JVMTI_ERROR_INVALID_OBJECT;
+    *tag_ptr = as_object(object)->tag;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL set_tag(jvmtiEnv* env, jobject object, jlong tag) {
+    if(object == NULL) return JVMTI_ERROR_INVALID_OBJECT;
+    as_object(object)->tag = tag;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL get_object_size(jvmtiEnv* env,
+                                          jobject object,
+                                          jlong* size_ptr) {
+    if(object == NULL) return JVMTI_ERROR_INVALID_OBJECT;
+    *size_ptr = as_object(object)->size;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL get_class_signature(jvmtiEnv* env,
+                                              jclass klass,
+                                              char** signature_ptr,
+                                              char** generic_ptr) {
+    fake_object* object = as_object(klass);
+    if(object == NULL || !object->is_class) return JVMTI_ERROR_INVALID_CLASS;
+
+    if(signature_ptr != NULL) *signature_ptr = copy_name(object->name);
+    if(generic_ptr != NULL) *generic_ptr = NULL;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL get_class_fields(jvmtiEnv* env,
+                                           jclass klass,
+                                           jint* field_count_ptr,
+                                           jfieldID** fields_ptr) {
+    fake_object* object = as_object(klass);
+    if(object == NULL || !object->is_class) return JVMTI_ERROR_INVALID_CLASS;
+
+    jfieldID* fields = static_cast<jfieldID*>(
+            malloc(sizeof(jfieldID)*(object->field_count > 0 ?
+                                         object->field_count : 1)));
+    for(int i = 0; i < object->field_count; ++i) {
+        fields[i] = field_ID(i);
+    }
+    *field_count_ptr = object->field_count;
+    *fields_ptr = fields;
+    return JVMTI_ERROR_NONE;
+}
+
+/* All fields are plain instance fields. */
+static jvmtiError JNICALL is_field_synthetic(jvmtiEnv* env,
+                                             jclass klass,
+                                             jfieldID field,
+                                             jboolean* is_synthetic_ptr) {
+    *is_synthetic_ptr = JNI_FALSE;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL get_field_modifiers(jvmtiEnv* env,
+                                              jclass klass,
+                                              jfieldID field,
+                                              jint* modifiers_ptr) {
+    *modifiers_ptr = 0;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL get_field_name(jvmtiEnv* env,
+                                         jclass klass,
+                                         jfieldID field,
+                                         char** name_ptr,
+                                         char** signature_ptr,
+                                         char** generic_ptr) {
+    fake_object* object = as_object(klass);
+    int number = field_number(field);
+    if(object == NULL || number < 0 || number >= object->field_count)
+        return JVMTI_ERROR_INVALID_FIELDID;
+
+    char name[32];
+    snprintf(name, sizeof(name), "field%d", number);
+    if(name_ptr != NULL) *name_ptr = copy_name(name);
+    if(signature_ptr != NULL) *signature_ptr = copy_name("J");
+    if(generic_ptr != NULL) *generic_ptr = NULL;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL get_stack_trace(jvmtiEnv* env,
+                                          jthread thread,
+                                          jint start_depth,
+                                          jint max_frame_count,
+                                          jvmtiFrameInfo* frame_buffer,
+                                          jint* count_ptr) {
+    *count_ptr = 0;
+    if(allocating_object == NULL) return JVMTI_ERROR_NONE;
+
+    for(int f = start_depth; f < allocation_depth &&
+        *count_ptr < max_frame_count; ++f) {
+        frame_buffer[*count_ptr].method = method_ID(allocating_object->klass,
+                                                    f);
+        frame_buffer[*count_ptr].location = 4*f;
+        ++*count_ptr;
+    }
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL get_method_declaring_class(
+                                    jvmtiEnv* env,
+                                    jmethodID method,
+                                    jclass* declaring_class_ptr) {
+    *declaring_class_ptr = as_ref<jclass>(method_class(method));
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL get_method_name(jvmtiEnv* env,
+                                          jmethodID method,
+                                          char** name_ptr,
+                                          char** signature_ptr,
+                                          char** generic_ptr) {
+    char name[32];
+    snprintf(name, sizeof(name), "alloc%d", method_frame(method));
+    if(name_ptr != NULL) *name_ptr = copy_name(name);
+    if(signature_ptr != NULL) *signature_ptr = copy_name("()V");
+    if(generic_ptr != NULL) *generic_ptr = NULL;
+    return JVMTI_ERROR_NONE;
+}
+
+/* Each method is one line, numbered after its frame. */
+static jvmtiError JNICALL get_line_number_table(
+                                    jvmtiEnv* env,
+                                    jmethodID method,
+                                    jint* entry_count_ptr,
+                                    jvmtiLineNumberEntry** table_ptr) {
+    jvmtiLineNumberEntry* table = static_cast<jvmtiLineNumberEntry*>(
+            malloc(sizeof(jvmtiLineNumberEntry)));
+    table->start_location = 0;
+    table->line_number = 10*(method_frame(method) + 1);
+    *entry_count_ptr = 1;
+    *table_ptr = table;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL set_heap_sampling_interval(jvmtiEnv* env,
+                                                     jint interval) {
+    if(interval < 0) return JVMTI_ERROR_ILLEGAL_ARGUMENT;
+    sampling_interval = interval;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL get_thread_info(jvmtiEnv* env,
+                                          jthread thread,
+                                          jvmtiThreadInfo* info_ptr) {
+    fake_object* object = (thread != NULL ? as_object(thread)
+                                          : current_thread);
+    if(object == NULL) return JVMTI_ERROR_INVALID_THREAD;
+
+    memset(info_ptr, 0, sizeof(*info_ptr));
+    info_ptr->name = copy_name(object->name);
+    info_ptr->priority = JVMTI_THREAD_NORM_PRIORITY;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL get_current_thread(jvmtiEnv* env,
+                                             jthread* thread_ptr) {
+    if(current_thread == NULL) return JVMTI_ERROR_UNATTACHED_THREAD;
+    *thread_ptr = as_ref<jthread>(current_thread);
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL get_all_threads(jvmtiEnv* env,
+                                          jint* threads_count_ptr,
+                                          jthread** threads_ptr) {
+    pthread_mutex_lock(&heap_lock);
+    jint count = threads.size();
+    jthread* result = static_cast<jthread*>(
+            malloc(sizeof(jthread)*(count > 0 ? count : 1)));
+    for(jint i = 0; i < count; ++i) {
+        result[i] = as_ref<jthread>(threads[i]);
+    }
+    pthread_mutex_unlock(&heap_lock);
+
+    *threads_count_ptr = count;
+    *threads_ptr = result;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL set_thread_local_storage(jvmtiEnv* env,
+                                                   jthread thread,
+                                                   const void* data) {
+    fake_object* object = (thread != NULL ? as_object(thread)
+                                          : current_thread);
+    if(object == NULL) return JVMTI_ERROR_UNATTACHED_THREAD;
+    object->local_storage = const_cast<void*>(data);
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL get_thread_local_storage(jvmtiEnv* env,
+                                                   jthread thread,
+                                                   void** data_ptr) {
+    fake_object* object = (thread != NULL ? as_object(thread)
+                                          : current_thread);
+    if(object == NULL) return JVMTI_ERROR_UNATTACHED_THREAD;
+    *data_ptr = object->local_storage;
+    return JVMTI_ERROR_NONE;
+}
+
+static void* run_agent_thread_body(void* arg) {
+    agent_thread_start* start = static_cast<agent_thread_start*>(arg);
+    fake_jvm::attach_thread(start->thread);
+    start->proc(fake_jvm::jvmti_env(), fake_jvm::jni_env(), start->arg);
+    delete start;
+    return NULL;
+}
+
+static jvmtiError JNICALL run_agent_thread(jvmtiEnv* env,
+                                           jthread thread,
+                                           jvmtiStartFunction proc,
+                                           const void* arg,
+                                           jint priority) {
+    agent_thread_start* start = new agent_thread_start;
+    start->thread = as_object(thread);
+    start->proc = proc;
+    start->arg = const_cast<void*>(arg);
+
+    pthread_t native_thread;
+    if(pthread_create(&native_thread, NULL, &run_agent_thread_body, start)) {
+        delete start;
+        return JVMTI_ERROR_INTERNAL;
+    }
+    pthread_mutex_lock(&heap_lock);
+    agent_threads.push_back(native_thread);
+    pthread_mutex_unlock(&heap_lock);
+    return JVMTI_ERROR_NONE;
+}
+
+/*
+ * Visits the objects of the heap. Only the tag filters are honoured, the
+ * class filter is ignored.
+ */
+static jvmtiError JNICALL iterate_through_heap(
+                                    jvmtiEnv* env,
+                                    jint heap_filter,
+                                    jclass klass,
+                                    const jvmtiHeapCallbacks* heap_callbacks,
+                                    const void* user_data) {
+    if(heap_callbacks->heap_iteration_callback == NULL)
+        return JVMTI_ERROR_NONE;
+
+    pthread_mutex_lock(&heap_lock);
+    vector<fake_object*> objects(heap);
+    pthread_mutex_unlock(&heap_lock);
+
+    for(size_t i = 0; i < objects.size(); ++i) {
+        fake_object* object = objects[i];
+        jlong tag = object->tag;
+        if(tag == 0 && (heap_filter & JVMTI_HEAP_FILTER_UNTAGGED)) continue;
+        if(tag != 0 && (heap_filter & JVMTI_HEAP_FILTER_TAGGED)) continue;
+
+        jlong class_tag = (object->klass != NULL ? object->klass->tag : 0);
+        jint visit = heap_callbacks->heap_iteration_callback(
+                class_tag, object->size, const_cast<jlong*>(&object->tag), -1,
+                const_cast<void*>(user_data));
+        if(visit & JVMTI_VISIT_ABORT) break;
+    }
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL get_time(jvmtiEnv* env, jlong* nanos_ptr) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    *nanos_ptr = (jlong) now.tv_sec*1000000000 + now.tv_nsec;
+    return JVMTI_ERROR_NONE;
+}
+
+/* The fake VM has every capability. */
+static jvmtiError JNICALL get_potential_capabilities(
+                                    jvmtiEnv* env,
+                                    jvmtiCapabilities* capabilities_ptr) {
+    memset(capabilities_ptr, 0xff, sizeof(*capabilities_ptr));
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL add_capabilities(
+                                    jvmtiEnv* env,
+                                    const jvmtiCapabilities* capabilities_ptr) {
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL set_event_notification_mode(jvmtiEnv* env,
+                                                      jvmtiEventMode mode,
+                                                      jvmtiEvent event_type,
+                                                      jthread event_thread,
+                                                      ...) {
+    if(event_type < 0 || event_type >= 128)
+        return JVMTI_ERROR_ILLEGAL_ARGUMENT;
+    enabled_events[event_type] = (mode == JVMTI_ENABLE);
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL set_event_callbacks(
+                                    jvmtiEnv* env,
+                                    const jvmtiEventCallbacks* event_callbacks,
+                                    jint size_of_callbacks) {
+    memset(&callbacks, 0, sizeof(callbacks));
+    if(event_callbacks != NULL) {
+        memcpy(&callbacks, event_callbacks,
+               (size_t) size_of_callbacks < sizeof(callbacks) ?
+                   size_of_callbacks : sizeof(callbacks));
+    }
+    return JVMTI_ERROR_NONE;
+}
+
+/* Field watches cost nothing here, every field event is posted anyway. */
+static jvmtiError JNICALL set_field_watch(jvmtiEnv* env,
+                                          jclass klass,
+                                          jfieldID field) {
+    return JVMTI_ERROR_NONE;
+}
+
+
+/******************************************************************************/
+/* JNI functions                                                              */
+/******************************************************************************/
+
+static jclass JNICALL jni_find_class(JNIEnv* env, const char* name) {
+    return as_ref<jclass>(find_class("L" + string(name) + ";"));
+}
+
+static void JNICALL jni_exception_clear(JNIEnv* env) {
+}
+
+static void JNICALL jni_delete_local_ref(JNIEnv* env, jobject object) {
+}
+
+static jobject JNICALL jni_new_local_ref(JNIEnv* env, jobject object) {
+    return object;
+}
+
+static jclass JNICALL jni_get_object_class(JNIEnv* env, jobject object) {
+    return as_ref<jclass>(as_object(object)->klass);
+}
+
+static jmethodID JNICALL jni_get_method_id(JNIEnv* env,
+                                           jclass klass,
+                                           const char* name,
+                                           const char* signature) {
+    return reinterpret_cast<jmethodID>(&any_member);
+}
+
+/*
+ * Constructs an object. Thread constructors take the thread name, which is
+ * all that is kept of their arguments.
+ */
+static jobject JNICALL jni_new_object_v(JNIEnv* env,
+                                        jclass klass,
+                                        jmethodID method,
+                                        va_list args) {
+    fake_object* object_class = as_object(klass);
+    if(strcmp(object_class->name, "Ljava/lang/Thread;") == 0) {
+        jstring name = va_arg(args, jstring);
+        return as_ref<jobject>(fake_jvm::new_thread(
+                name != NULL ? as_object(name)->name : "?"));
+    }
+    return as_ref<jobject>(fake_jvm::new_object(object_class, 16));
+}
+
+static jobject JNICALL jni_new_object(JNIEnv* env,
+                                      jclass klass,
+                                      jmethodID method,
+                                      ...) {
+    va_list args;
+    va_start(args, method);
+    jobject object = jni_new_object_v(env, klass, method, args);
+    va_end(args);
+    return object;
+}
+
+static jstring JNICALL jni_new_string_utf(JNIEnv* env, const char* utf) {
+    fake_object* text = make_object(find_class("Ljava/lang/String;"),
+                                    24, utf, false);
+    return as_ref<jstring>(text);
+}
+
+static jweak JNICALL jni_new_weak_global_ref(JNIEnv* env, jobject object) {
+    return object;
+}
+
+static jint JNICALL vm_get_env(JavaVM* vm, void** penv, jint version) {
+    if((version & JVMTI_VERSION_MASK_INTERFACE_TYPE) ==
+            JVMTI_VERSION_INTERFACE_JVMTI)
+        *penv = fake_jvm::jvmti_env();
+    else
+        *penv = fake_jvm::jni_env();
+    return JNI_OK;
+}
+
+static jvmtiInterface_1_ jvmti_functions;
+static JNINativeInterface_ jni_functions;
+static JNIInvokeInterface_ vm_functions;
+
+static _jvmtiEnv fake_jvmti_env;
+static JNIEnv_ fake_jni_env;
+static JavaVM_ fake_java_vm;
+
+
+/******************************************************************************/
+/* The fake VM                                                                */
+/******************************************************************************/
+
+void fake_jvm::init(void) {
+    memset(&jvmti_functions, 0, sizeof(jvmti_functions));
+    jvmti_functions.SetEventNotificationMode = &set_event_notification_mode;
+    jvmti_functions.Allocate = &allocate;
+    jvmti_functions.Deallocate = &deallocate;
+    jvmti_functions.GetPhase = &get_phase;
+    jvmti_functions.GetTag = &get_tag;
+    jvmti_functions.SetTag = &set_tag;
+    jvmti_functions.GetObjectSize = &get_object_size;
+    jvmti_functions.GetClassSignature = &get_class_signature;
+    jvmti_functions.GetClassFields = &get_class_fields;
+    jvmti_functions.IsFieldSynthetic = &is_field_synthetic;
+    jvmti_functions.GetFieldModifiers = &get_field_modifiers;
+    jvmti_functions.GetFieldName = &get_field_name;
+    jvmti_functions.GetStackTrace = &get_stack_trace;
+    jvmti_functions.GetMethodDeclaringClass = &get_method_declaring_class;
+    jvmti_functions.GetMethodName = &get_method_name;
+    jvmti_functions.GetLineNumberTable = &get_line_number_table;
+    jvmti_functions.SetHeapSamplingInterval = &set_heap_sampling_interval;
+    jvmti_functions.GetThreadInfo = &get_thread_info;
+    jvmti_functions.GetCurrentThread = &get_current_thread;
+    jvmti_functions.GetAllThreads = &get_all_threads;
+    jvmti_functions.SetThreadLocalStorage = &set_thread_local_storage;
+    jvmti_functions.GetThreadLocalStorage = &get_thread_local_storage;
+    jvmti_functions.RunAgentThread = &run_agent_thread;
+    jvmti_functions.IterateThroughHeap = &iterate_through_heap;
+    jvmti_functions.GetTime = &get_time;
+    jvmti_functions.GetPotentialCapabilities = &get_potential_capabilities;
+    jvmti_functions.AddCapabilities = &add_capabilities;
+    jvmti_functions.SetEventCallbacks = &set_event_callbacks;
+    jvmti_functions.SetFieldAccessWatch = &set_field_watch;
+    jvmti_functions.ClearFieldAccessWatch = &set_field_watch;
+    jvmti_functions.SetFieldModificationWatch = &set_field_watch;
+    jvmti_functions.ClearFieldModificationWatch = &set_field_watch;
+    jvmti_functions.CreateRawMonitor = &create_raw_monitor;
+    jvmti_functions.DestroyRawMonitor = &destroy_raw_monitor;
+    jvmti_functions.RawMonitorEnter = &raw_monitor_enter;
+    jvmti_functions.RawMonitorExit = &raw_monitor_exit;
+    jvmti_functions.RawMonitorWait = &raw_monitor_wait;
+    jvmti_functions.RawMonitorNotify = &raw_monitor_notify;
+    jvmti_functions.RawMonitorNotifyAll = &raw_monitor_notify_all;
+    fake_jvmti_env.functions = &jvmti_functions;
+
+    memset(&jni_functions, 0, sizeof(jni_functions));
+    jni_functions.FindClass = &jni_find_class;
+    jni_functions.ExceptionClear = &jni_exception_clear;
+    jni_functions.DeleteLocalRef = &jni_delete_local_ref;
+    jni_functions.NewLocalRef = &jni_new_local_ref;
+    jni_functions.GetObjectClass = &jni_get_object_class;
+    jni_functions.GetMethodID = &jni_get_method_id;
+    jni_functions.NewObject = &jni_new_object;
+    jni_functions.NewObjectV = &jni_new_object_v;
+    jni_functions.NewStringUTF = &jni_new_string_utf;
+    jni_functions.NewWeakGlobalRef = &jni_new_weak_global_ref;
+    fake_jni_env.functions = &jni_functions;
+
+    memset(&vm_functions, 0, sizeof(vm_functions));
+    vm_functions.GetEnv = &vm_get_env;
+    fake_java_vm.functions = &vm_functions;
+
+    memset(&callbacks, 0, sizeof(callbacks));
+    for(int i = 0; i < 128; ++i) {
+        enabled_events[i] = false;
+    }
+    phase = JVMTI_PHASE_ONLOAD;
+}
+
+JavaVM* fake_jvm::java_vm(void) {
+    return &fake_java_vm;
+}
+
+jvmtiEnv* fake_jvm::jvmti_env(void) {
+    return &fake_jvmti_env;
+}
+
+JNIEnv* fake_jvm::jni_env(void) {
+    return &fake_jni_env;
+}
+
+fake_object* fake_jvm::new_class(const char* signature, int field_count) {
+    fake_object* klass = make_object(NULL, 64, signature, true);
+    klass->field_count = field_count;
+    return klass;
+}
+
+fake_object* fake_jvm::new_object(fake_object* klass, jlong size) {
+    return make_object(klass, size, NULL, false);
+}
+
+fake_object* fake_jvm::new_thread(const char* name) {
+    fake_object* thread = make_object(find_class("Ljava/lang/Thread;"),
+                                      120, name, false);
+    pthread_mutex_lock(&heap_lock);
+    threads.push_back(thread);
+    pthread_mutex_unlock(&heap_lock);
+    return thread;
+}
+
+void fake_jvm::attach_thread(fake_object* thread) {
+    current_thread = thread;
+}
+
+bool fake_jvm::event_enabled(jvmtiEvent event) {
+    return enabled_events[event];
+}
+
+void fake_jvm::post_vm_init(fake_object* thread) {
+    phase = JVMTI_PHASE_LIVE;
+    if(enabled_events[JVMTI_EVENT_VM_INIT] && callbacks.VMInit != NULL)
+        callbacks.VMInit(jvmti_env(), jni_env(), as_ref<jthread>(thread));
+}
+
+void fake_jvm::post_vm_death(void) {
+    if(enabled_events[JVMTI_EVENT_VM_DEATH] && callbacks.VMDeath != NULL)
+        callbacks.VMDeath(jvmti_env(), jni_env());
+    phase = JVMTI_PHASE_DEAD;
+}
+
+void fake_jvm::post_thread_start(fake_object* thread) {
+    if(enabled_events[JVMTI_EVENT_THREAD_START] &&
+       callbacks.ThreadStart != NULL)
+        callbacks.ThreadStart(jvmti_env(), jni_env(), as_ref<jthread>(thread));
+}
+
+void fake_jvm::post_thread_end(fake_object* thread) {
+    if(enabled_events[JVMTI_EVENT_THREAD_END] && callbacks.ThreadEnd != NULL)
+        callbacks.ThreadEnd(jvmti_env(), jni_env(), as_ref<jthread>(thread));
+}
+
+void fake_jvm::post_class_prepare(fake_object* klass) {
+    if(enabled_events[JVMTI_EVENT_CLASS_PREPARE] &&
+       callbacks.ClassPrepare != NULL)
+        callbacks.ClassPrepare(jvmti_env(), jni_env(),
+                               as_ref<jthread>(current_thread),
+                               as_ref<jclass>(klass));
+}
+
+void fake_jvm::post_field_event(fake_object* thread,
+                                fake_object* object,
+                                int field_index,
+                                bool write) {
+    // Each field is touched by its own bytecode, in a method of its class.
+    jmethodID method = method_ID(object->klass, 0);
+    jlocation location = field_index;
+    jfieldID field = field_ID(field_index);
+
+    if(write) {
+        if(!enabled_events[JVMTI_EVENT_FIELD_MODIFICATION] ||
+           callbacks.FieldModification == NULL) return;
+
+        jvalue value;
+        value.j = 0;
+        callbacks.FieldModification(jvmti_env(), jni_env(),
+                                    as_ref<jthread>(thread), method, location,
+                                    as_ref<jclass>(object->klass),
+                                    as_ref<jobject>(object), field, 'J', value);
+    }
+    else {
+        if(!enabled_events[JVMTI_EVENT_FIELD_ACCESS] ||
+           callbacks.FieldAccess == NULL) return;
+
+        callbacks.FieldAccess(jvmti_env(), jni_env(),
+                              as_ref<jthread>(thread), method, location,
+                              as_ref<jclass>(object->klass),
+                              as_ref<jobject>(object), field);
+    }
+}
+
+void fake_jvm::post_object_alloc(fake_object* thread, fake_object* object) {
+    if(!enabled_events[JVMTI_EVENT_SAMPLED_OBJECT_ALLOC] ||
+       callbacks.SampledObjectAlloc == NULL) return;
+
+    if(bytes_until_sample < 0) bytes_until_sample = next_sample_distance();
+    bytes_until_sample -= object->size;
+    if(bytes_until_sample > 0) return;
+    bytes_until_sample = next_sample_distance();
+
+    allocating_object = object;
+    callbacks.SampledObjectAlloc(jvmti_env(), jni_env(),
+                                 as_ref<jthread>(thread),
+                                 as_ref<jobject>(object),
+                                 as_ref<jclass>(object->klass), object->size);
+    allocating_object = NULL;
+}
+
+void fake_jvm::free_object(fake_object* object) {
+    jlong tag = object->tag;
+    object->tag = 0;
+    if(tag != 0 && enabled_events[JVMTI_EVENT_OBJECT_FREE] &&
+       callbacks.ObjectFree != NULL)
+        callbacks.ObjectFree(jvmti_env(), tag);
+}
+
+jlong fake_jvm::tagged_objects(void) {
+    jlong count = 0;
+    pthread_mutex_lock(&heap_lock);
+    for(size_t i = 0; i < heap.size(); ++i) {
+        if(heap[i]->tag != 0 && !heap[i]->is_class) ++count;
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return count;
+}
+
+void fake_jvm::join_agent_threads(void) {
+    pthread_mutex_lock(&heap_lock);
+    vector<pthread_t> started(agent_threads);
+    agent_threads.clear();
+    pthread_mutex_unlock(&heap_lock);
+
+    for(size_t i = 0; i < started.size(); ++i) {
+        pthread_join(started[i], NULL);
+    }
+}
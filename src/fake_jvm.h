@@ -0,0 +1,82 @@
+/*
+ * File:   fake_jvm.h
+ *
+ * An in-process stand-in for the JVM, enough of JVMTI and JNI to load the
+ * agent and drive its callbacks without launching Java. Objects live in a
+ * fake heap and carry their tag, size and class, threads are objects with a
+ * name and thread local storage, raw monitors are pthread mutexes, and
+ * agent threads are pthreads. Functions the agent only uses for class
+ * preparation and the bytecode engine are left out. The stack of a sampled
+ * allocation is made up from the allocated object's class, two frames deep,
+ * so each class has one allocation site.
+ */
+#include "jvmti.h"
+#ifndef FAKE_JVM_H
+#define	FAKE_JVM_H
+
+namespace fake_jvm {
+    /*
+     * An object of the fake heap. Classes and threads are objects as well,
+     * their name is the class signature or the thread name.
+     */
+    struct fake_object {
+        volatile jlong tag;
+        jlong size;
+        fake_object* klass;
+        char* name;
+        bool is_class;
+        /* Number of instance fields, classes only. */
+        int field_count;
+        /* Thread local storage, threads only. */
+        void* local_storage;
+    };
+
+    void init(void);
+    JavaVM* java_vm(void);
+    jvmtiEnv* jvmti_env(void);
+    JNIEnv* jni_env(void);
+
+    fake_object* new_class(const char* signature, int field_count = 0);
+    fake_object* new_object(fake_object* klass, jlong size);
+    fake_object* new_thread(const char* name);
+
+    /* Makes a thread the current thread of the calling native thread. */
+    void attach_thread(fake_object* thread);
+
+    bool event_enabled(jvmtiEvent event);
+    void post_vm_init(fake_object* thread);
+    void post_vm_death(void);
+    void post_thread_start(fake_object* thread);
+    void post_thread_end(fake_object* thread);
+    void post_class_prepare(fake_object* klass);
+
+    /*
+     * Posts an event of a field of the object's class, fields are numbered
+     * from 0. Like HotSpot's, field IDs only encode the field's slot, so
+     * the same IDs stand for the fields of every class.
+     */
+    void post_field_event(fake_object* thread,
+                          fake_object* object,
+                          int field,
+                          bool write);
+
+    /*
+     * Counts an allocation of a thread, and posts a sampled allocation event
+     * once the thread allocated the sampling interval since its last one.
+     */
+    void post_object_alloc(fake_object* thread, fake_object* object);
+
+    /*
+     * Collects an object: posts its free event if it is tagged, then clears
+     * the tag so the object can stand for a newly allocated one.
+     */
+    void free_object(fake_object* object);
+
+    /* Number of tagged objects in the heap, not counting classes. */
+    jlong tagged_objects(void);
+
+    /* Waits for the agent threads to finish, after VM death. */
+    void join_agent_threads(void);
+};
+
+#endif	/* FAKE_JVM_H */
@@ -1,33 +1,167 @@
+#include <algorithm>
+#include <cstdio>
 #include <cstdlib>
+#include <fcntl.h>
 #include <iostream>
 #include <fstream>
 #include <ios>
 #include <list>
 #include <map>
+#include <pthread.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
 #include "jvmti.h"
 #include "info_file_io.h"
 
 using namespace std;
 
+/* A class signature in a mapped file, not NUL terminated. */
+struct class_view {
+  const char* name;
+  int length;
+};
+
+/*
+ * A loaded object. The class signature and the thread IDs point into the
+ * mapped profiling files, thread IDs are access_size bytes each.
+ */
 struct object_info_record {
-  char* object_class;
-  jlong* thread_accesses;
+  class_view object_class;
+  const char* thread_accesses;
   int accesses_length;
+  int access_size;
+};
+
+/* A profiling file mapped into memory for reading. */
+struct mapped_file {
+  const char* data;
+  size_t size;
 };
 
+/*
+ * Output formats. Version 1 files are bare sequences of records:
+ *
+ *   ObjectInfo:     int class_length, jlong object_ID, class signature
+ *   ObjectAccesses: int length*8, jlong object_ID, jlong thread IDs[length]
+ *
+ * Version 2 files start with a header, followed by typed, length prefixed
+ * chunks, and end with an index of the chunks and a trailer:
+ *
+ *   header:  "TLPF", u2 version, u2 byte order mark 0x0102, u4 file kind,
+ *            u4 flags
+ *   chunk:   u4 type, u4 payload length, payload
+ *   trailer: u8 offset of the index chunk, "TLPX"
+ *
+ * All values are in the byte order of the machine that wrote the file,
+ * readers use the byte order mark to tell. Chunk payloads all start with a
+ * u4 entry count:
+ *
+ *   classes:  u4 class_ID, u4 length, signature
+ *   objects:  u8 object_ID, u8 object size, u4 class_ID[, u4 site_ID]
+ *   accesses: u8 object_ID, u4 length, u4 thread IDs[length]
+ *   index:    u4 chunk type, u8 chunk offset
+ *   fields:   u4 field_ID, u4 class_ID, u8 cross-thread touches,
+ *             u8 shared objects, u8 shared bytes, u4 length, name
+ *   sites:    u4 site_ID, u4 frame count, frames[count] as u4 length, name
+ *
+ * Class IDs are given by the agent. Each signature is written once, in a
+ * classes chunk that precedes the first objects or fields chunk referring to
+ * it. The ObjectInfo file ends with one fields chunk, holding the fields
+ * that threads touched after another thread. Readers skip chunk types they
+ * do not know.
+ *
+ * With FORMAT_ACCESS_WRITES set in the flags of an ObjectAccesses file,
+ * thread IDs carry ACCESS_WRITE when the thread wrote to the object during
+ * that access. Version 1 files only hold thread IDs.
+ *
+ * With FORMAT_OBJECT_SITES set in the flags of an ObjectInfo file, objects
+ * carry the ID of their allocation site, 0 if it is not known, and the file
+ * ends with a sites chunk naming the frames of the sites.
+ */
+const char format_magic[4] = { 'T', 'L', 'P', 'F' };
+const char trailer_magic[4] = { 'T', 'L', 'P', 'X' };
+const unsigned short byte_order_mark = 0x0102;
+const int header_size = 16;
+const int chunk_header_size = 8;
+const int trailer_size = 12;
+
+const jint FILE_OBJECT_INFO = 1;
+const jint FILE_OBJECT_ACCESSES = 2;
+
+/* Header flags. */
+const jint FORMAT_ACCESS_WRITES = 1;
+const jint FORMAT_OBJECT_SITES = 2;
+
+const jint CHUNK_CLASSES = 1;
+const jint CHUNK_OBJECTS = 2;
+const jint CHUNK_ACCESSES = 3;
+const jint CHUNK_INDEX = 4;
+const jint CHUNK_FIELDS = 5;
+const jint CHUNK_SITES = 6;
+
+/* Chunks written to a version 2 file so far, for its index. */
+struct chunk_index_entry {
+    jint type;
+    jlong offset;
+};
+
+struct format_output {
+    ofstream* writer;
+    jlong offset;
+    vector<chunk_index_entry> index;
+};
+
+int output_format = 2;
+format_output info_output;
+format_output accesses_output;
+
+/* Classes whose signature was written to the ObjectInfo file, by ID. */
+vector<bool> written_classes;
+
+/* Class signatures read from a version 2 file, by ID. */
+vector<class_view> class_names;
+const class_view unknown_class = { "?", 1 };
+const class_view mixed_classes = { "*", 1 };
+
+/* Set when the file being read was written with the other byte order. */
+bool swap_byte_order = false;
+
+/* Set when the ObjectAccesses file read tells reads from writes. */
+bool access_writes = false;
+
+/*
+ * Set when objects carry their allocation site, in the ObjectInfo file
+ * written or read.
+ */
+bool object_sites = false;
+
 map<jlong, object_info_record> shared_objects;
+mapped_file info_map;
+mapped_file accesses_map;
 
 ofstream profiling_writer;
 ofstream object_info_writer;
-ifstream profiling_reader;
 
 char* object_info_file = "ObjectInfo";
 char* object_accesses_file = "ObjectAccesses";
 
 
+/*
+ * Size of the record batches handed to the writer, and of the output streams'
+ * buffers. Set with set_write_buffer_size before the files are opened.
+ */
+int write_buffer_size = 64*1024;
+char* info_stream_buffer = NULL;
+char* accesses_stream_buffer = NULL;
+
 char io_mode;
 int max_record_size;
+
+/* Number of threads decoding the ObjectAccesses file. */
+int reader_threads = 1;
 string object_class;
 const string all_objects = "a";
 namespace profiling_io {
@@ -40,6 +174,10 @@ namespace profiling_io {
         max_record_size = size;
     }
 
+    void set_reader_threads(int count) {
+        reader_threads = (count > 0 ? count : 1);
+    }
+
     void set_object_class(string object_class_str) {
         object_class.assign(object_class_str);
     }
@@ -57,10 +195,86 @@ namespace profiling_io {
     }
 
     void set_write_buffer_size(int size) {
-        // Not sure how to control that.
+        write_buffer_size = size;
+    }
+
+    void set_output_format(int version) {
+        output_format = version;
+    }
+
+    /* Whether object records carry a site ID, set before opening files. */
+    void set_object_sites(bool enabled) {
+        object_sites = enabled;
+    }
+
+    /* Writes a chunk to a version 2 file and adds it to the file's index. */
+    static void write_chunk(format_output* output,
+                            jint type,
+                            const vector<char>& payload) {
+        chunk_index_entry entry;
+        entry.type = type;
+        entry.offset = output->offset;
+        output->index.push_back(entry);
+
+        jint length = payload.size();
+        output->writer->write((char*)&type, sizeof(jint));
+        output->writer->write((char*)&length, sizeof(jint));
+        if(length > 0) output->writer->write(&payload[0], length);
+        output->offset += chunk_header_size + length;
+    }
+
+    /* Appends a value to a chunk payload. */
+    template <class T>
+    static void put_value(vector<char>* payload, T value) {
+        const char* bytes = (const char*)&value;
+        payload->insert(payload->end(), bytes, bytes + sizeof(T));
+    }
+
+    /* Writes the header of a version 2 file. */
+    static void start_format_output(format_output* output,
+                                    ofstream* writer,
+                                    jint kind,
+                                    jint flags) {
+        output->writer = writer;
+        output->offset = header_size;
+        output->index.clear();
+
+        unsigned short version = 2;
+        writer->write(format_magic, 4);
+        writer->write((char*)&version, sizeof(version));
+        writer->write((char*)&byte_order_mark, sizeof(byte_order_mark));
+        writer->write((char*)&kind, sizeof(jint));
+        writer->write((char*)&flags, sizeof(jint));
+    }
+
+    /* Writes the index chunk and the trailer of a version 2 file. */
+    static void finish_format_output(format_output* output) {
+        vector<char> payload;
+        put_value<jint>(&payload, output->index.size());
+        for(size_t i = 0; i < output->index.size(); ++i) {
+            put_value<jint>(&payload, output->index[i].type);
+            put_value<jlong>(&payload, output->index[i].offset);
+        }
+
+        jlong index_offset = output->offset;
+        write_chunk(output, CHUNK_INDEX, payload);
+        output->writer->write((char*)&index_offset, sizeof(jlong));
+        output->writer->write(trailer_magic, 4);
     }
 
     void open_write(void) {
+        /*
+         * Records reach the streams in batches of about write_buffer_size
+         * bytes, give the streams buffers of the same size so each batch
+         * becomes a single large write.
+         */
+        info_stream_buffer = new char[write_buffer_size];
+        accesses_stream_buffer = new char[write_buffer_size];
+        object_info_writer.rdbuf()->pubsetbuf(info_stream_buffer,
+                                              write_buffer_size);
+        profiling_writer.rdbuf()->pubsetbuf(accesses_stream_buffer,
+                                            write_buffer_size);
+
         if(object_accesses_file && object_info_file) {
             profiling_writer.open(
                 object_accesses_file, ios::out  | ios::trunc |ios::binary);
@@ -73,23 +287,50 @@ namespace profiling_io {
             object_info_writer.open(
                 "ObjectAccesses", ios::out | ios::trunc | ios::binary);
         }
+
+        if(output_format == 2) {
+            start_format_output(&info_output, &object_info_writer,
+                                FILE_OBJECT_INFO,
+                                object_sites ? FORMAT_OBJECT_SITES : 0);
+            start_format_output(&accesses_output, &profiling_writer,
+                                FILE_OBJECT_ACCESSES, FORMAT_ACCESS_WRITES);
+        }
     }
     
     void close_write(void) {
+        if(output_format == 2) {
+            finish_format_output(&info_output);
+            finish_format_output(&accesses_output);
+        }
         profiling_writer.close();
         object_info_writer.close();
+        delete[] info_stream_buffer;
+        delete[] accesses_stream_buffer;
+        info_stream_buffer = accesses_stream_buffer = NULL;
     }
 
-    void write_access_info(jlong object_ID, list<jlong>* access_seq) {
-        
-        int record_size = access_seq->size()*sizeof(jlong);
+    /*
+     * Writes the sequence of thread numbers that accessed an object. The file
+     * keeps a jlong per entry, entries are widened in blocks so the stream
+     * sees a few large writes instead of one per entry. Version 1 files do
+     * not tell writes apart, ACCESS_WRITE is dropped.
+     */
+    void write_access_info(jlong object_ID, const jint* threads, int length) {
+
+        int record_size = length*sizeof(jlong);
 
         profiling_writer.write((char*)&record_size, sizeof(int));
         profiling_writer.write((char*)&object_ID, sizeof(jlong));
 
-        for(list<jlong>::const_iterator it = access_seq->begin();
-            it != (access_seq->end()); ++it) {
-            profiling_writer.write((char*)&(*it),sizeof(jlong));
+        const int block_length = 512;
+        jlong block[block_length];
+
+        for(int i = 0; i < length; i += block_length) {
+            int count = (length - i < block_length ? length - i : block_length);
+            for(int j = 0; j < count; ++j) {
+                block[j] = threads[i + j] & ~ACCESS_WRITE;
+            }
+            profiling_writer.write((char*)block, count*sizeof(jlong));
         }
     }
 
@@ -104,87 +345,893 @@ namespace profiling_io {
         object_info_writer.write((char*)&(*object_class),record_size);
     }
 
-    void read_objects_class() {
-        profiling_reader.open(object_info_file);
-        
-        if(profiling_reader.fail()) {
-            cout<<"Could not open Object Info file!"<<endl;
-            exit(1);
+    void init_buffer(record_buffer* buffer) {
+        buffer->data = NULL;
+        buffer->length = 0;
+        buffer->capacity = 0;
+    }
+
+    void free_buffer(record_buffer* buffer) {
+        free(buffer->data);
+        init_buffer(buffer);
+    }
+
+    /* Size of an object info record in a batch. */
+    const int object_record_size =
+            2*sizeof(jint) + 2*sizeof(jlong) + sizeof(const char*);
+
+    /* Makes room for 'needed' bytes in a batch, returns where they go. */
+    static char* reserve_buffer(record_buffer* buffer, int needed) {
+        needed += buffer->length;
+        if(needed > buffer->capacity) {
+            int capacity = (needed > write_buffer_size ?
+                                needed : write_buffer_size);
+            buffer->data = (char*) realloc(buffer->data, capacity);
+            buffer->capacity = capacity;
         }
-        
-        profiling_reader.peek();
-        if(profiling_reader.eof()){
-            cout<<"No shared objects were found"<<endl;
-            profiling_reader.close();
+        char* out = buffer->data + buffer->length;
+        buffer->length = needed;
+        return out;
+    }
+
+    /*
+     * Encodes an object info record into a batch. Batches keep records as
+     * jint class_ID, jint site_ID, jlong object_ID, jlong object_size and a
+     * pointer to the class signature, and are converted to the output format
+     * when written, so the signature must stay valid until the batch is
+     * written. Returns true when the batch is full and should be written.
+     */
+    bool buffer_object_info(record_buffer* buffer,
+                            jlong object_ID,
+                            jlong object_size,
+                            jint class_ID,
+                            jint site_ID,
+                            const char* object_class) {
+
+        char* out = reserve_buffer(buffer, object_record_size);
+
+        memcpy(out, &class_ID, sizeof(jint));
+        out += sizeof(jint);
+        memcpy(out, &site_ID, sizeof(jint));
+        out += sizeof(jint);
+        memcpy(out, &object_ID, sizeof(jlong));
+        out += sizeof(jlong);
+        memcpy(out, &object_size, sizeof(jlong));
+        out += sizeof(jlong);
+        memcpy(out, &object_class, sizeof(const char*));
+
+        return buffer->length >= write_buffer_size;
+    }
+
+    /*
+     * Encodes an access record into a batch, as int length, jlong object_ID
+     * and the thread IDs. Returns true when the batch is full and should be
+     * written.
+     */
+    bool buffer_access_info(record_buffer* buffer,
+                            jlong object_ID,
+                            const jint* threads,
+                            int length) {
+
+        char* out = reserve_buffer(buffer, sizeof(int) + sizeof(jlong) +
+                                           length*sizeof(jint));
+
+        memcpy(out, &length, sizeof(int));
+        out += sizeof(int);
+        memcpy(out, &object_ID, sizeof(jlong));
+        out += sizeof(jlong);
+        memcpy(out, threads, length*sizeof(jint));
+
+        return buffer->length >= write_buffer_size;
+    }
+
+    /*
+     * Adds a class to a classes chunk payload unless its signature was
+     * written before, returns whether it was added.
+     */
+    static bool put_class(vector<char>* classes,
+                          jint class_ID,
+                          const char* klass) {
+        if((size_t)class_ID >= written_classes.size())
+            written_classes.resize(class_ID + 1, false);
+        if(written_classes[class_ID]) return false;
+
+        jint length = strlen(klass);
+        put_value<jint>(classes, class_ID);
+        put_value<jint>(classes, length);
+        classes->insert(classes->end(), klass, klass + length);
+        written_classes[class_ID] = true;
+        return true;
+    }
+
+    /*
+     * Writes a batch of object info records as a version 2 objects chunk,
+     * preceded by a classes chunk for the signatures not written before.
+     */
+    static void write_object_info_chunk(record_buffer* buffer) {
+        vector<char> classes, objects;
+        jint new_classes = 0, object_count = 0;
+        put_value<jint>(&classes, 0);
+        put_value<jint>(&objects, 0);
+
+        for(char* in = buffer->data; in < buffer->data + buffer->length;
+            in += object_record_size) {
+            jint class_ID, site_ID;
+            jlong object_ID, object_size;
+            const char* klass;
+            memcpy(&class_ID, in, sizeof(jint));
+            memcpy(&site_ID, in + sizeof(jint), sizeof(jint));
+            memcpy(&object_ID, in + 2*sizeof(jint), sizeof(jlong));
+            memcpy(&object_size, in + 2*sizeof(jint) + sizeof(jlong),
+                   sizeof(jlong));
+            memcpy(&klass, in + 2*sizeof(jint) + 2*sizeof(jlong),
+                   sizeof(const char*));
+
+            if(put_class(&classes, class_ID, klass)) ++new_classes;
+
+            put_value<jlong>(&objects, object_ID);
+            put_value<jlong>(&objects, object_size);
+            put_value<jint>(&objects, class_ID);
+            if(object_sites) put_value<jint>(&objects, site_ID);
+            ++object_count;
+        }
+
+        if(new_classes > 0) {
+            memcpy(&classes[0], &new_classes, sizeof(jint));
+            write_chunk(&info_output, CHUNK_CLASSES, classes);
+        }
+        memcpy(&objects[0], &object_count, sizeof(jint));
+        write_chunk(&info_output, CHUNK_OBJECTS, objects);
+    }
+
+    /* Writes a batch of access records as a version 2 accesses chunk. */
+    static void write_access_info_chunk(record_buffer* buffer) {
+        vector<char> accesses;
+        jint count = 0;
+        put_value<jint>(&accesses, 0);
+
+        for(char* in = buffer->data; in < buffer->data + buffer->length; ) {
+            int length;
+            memcpy(&length, in, sizeof(int));
+            int record_size = sizeof(int) + sizeof(jlong) + length*sizeof(jint);
+
+            // The batch layout matches the chunk's, apart from the order.
+            accesses.insert(accesses.end(), in + sizeof(int),
+                            in + sizeof(int) + sizeof(jlong));
+            put_value<jint>(&accesses, length);
+            accesses.insert(accesses.end(), in + sizeof(int) + sizeof(jlong),
+                            in + record_size);
+            in += record_size;
+            ++count;
+        }
+
+        memcpy(&accesses[0], &count, sizeof(jint));
+        write_chunk(&accesses_output, CHUNK_ACCESSES, accesses);
+    }
+
+    /*
+     * Writes a batch of records to the file it belongs to, in the selected
+     * output format, and empties it.
+     */
+    void write_buffer(record_buffer* buffer, record_file file) {
+        if(buffer->length == 0) return;
+
+        if(output_format == 2) {
+            if(file == OBJECT_INFO_RECORDS)
+                write_object_info_chunk(buffer);
+            else
+                write_access_info_chunk(buffer);
+            buffer->length = 0;
             return;
         }
 
-        int record_size = 0;
-        jlong object_ID = -1;
+        for(char* in = buffer->data; in < buffer->data + buffer->length; ) {
+            if(file == OBJECT_INFO_RECORDS) {
+                // The size and site are not part of version 1 files.
+                jlong object_ID;
+                char* klass;
+                memcpy(&object_ID, in + 2*sizeof(jint), sizeof(jlong));
+                memcpy(&klass, in + 2*sizeof(jint) + 2*sizeof(jlong),
+                       sizeof(char*));
+                write_object_info(object_ID, 0, klass);
+                in += object_record_size;
+            }
+            else {
+                int length;
+                jlong object_ID;
+                memcpy(&length, in, sizeof(int));
+                memcpy(&object_ID, in + sizeof(int), sizeof(jlong));
+                in += sizeof(int) + sizeof(jlong);
+
+                // Access records are multiples of 4 bytes, so this is aligned.
+                write_access_info(object_ID, (const jint*)in, length);
+                in += length*sizeof(jint);
+            }
+        }
+        buffer->length = 0;
+    }
+
+    /*
+     * Writes the field table as a version 2 fields chunk, preceded by a
+     * classes chunk for the signatures not written before. Version 1 files
+     * have no place for it.
+     */
+    void write_field_table(const vector<field_record>& fields) {
+        if(output_format != 2 || fields.empty()) return;
 
-           do{
-           // size of the class signature (string terminator not included!)
-           profiling_reader.read((char*)&(record_size), sizeof(int));
+        vector<char> classes, payload;
+        jint new_classes = 0;
+        put_value<jint>(&classes, 0);
+        put_value<jint>(&payload, fields.size());
 
-           // object id
-           profiling_reader.read((char*)&(object_ID), sizeof(jlong));
+        for(size_t i = 0; i < fields.size(); ++i) {
+            const field_record& field = fields[i];
+            if(put_class(&classes, field.class_ID, field.object_class))
+                ++new_classes;
 
-           // class signature:
-           shared_objects[object_ID].object_class =
-                   (char*) malloc(record_size + sizeof(char));
-           profiling_reader.read(
-                shared_objects[object_ID].object_class,record_size);
-           (*(shared_objects[object_ID].object_class+record_size)) = '\0';
+            jint length = strlen(field.field_name);
+            put_value<jint>(&payload, field.field_ID);
+            put_value<jint>(&payload, field.class_ID);
+            put_value<jlong>(&payload, field.cross_thread_touches);
+            put_value<jlong>(&payload, field.shared_objects);
+            put_value<jlong>(&payload, field.shared_bytes);
+            put_value<jint>(&payload, length);
+            payload.insert(payload.end(), field.field_name,
+                           field.field_name + length);
+        }
 
-           profiling_reader.peek();
-        }while(!(profiling_reader.eof()));
-        profiling_reader.close();
+        if(new_classes > 0) {
+            memcpy(&classes[0], &new_classes, sizeof(jint));
+            write_chunk(&info_output, CHUNK_CLASSES, classes);
+        }
+        write_chunk(&info_output, CHUNK_FIELDS, payload);
     }
 
-    void read_objects_accesses() {
-        profiling_reader.open(object_accesses_file);
+    /*
+     * Writes the allocation sites as a version 2 sites chunk. Only files
+     * whose objects carry site IDs have one.
+     */
+    void write_site_table(const vector<site_record>& sites) {
+        if(output_format != 2 || !object_sites) return;
+
+        vector<char> payload;
+        put_value<jint>(&payload, sites.size());
+        for(size_t i = 0; i < sites.size(); ++i) {
+            const vector<string>& frames = sites[i].frames;
+            put_value<jint>(&payload, sites[i].site_ID);
+            put_value<jint>(&payload, frames.size());
+            for(size_t f = 0; f < frames.size(); ++f) {
+                put_value<jint>(&payload, frames[f].length());
+                payload.insert(payload.end(), frames[f].begin(),
+                               frames[f].end());
+            }
+        }
+        write_chunk(&info_output, CHUNK_SITES, payload);
+    }
 
-         if(profiling_reader.fail()) {
-            cout<<"Could not open Accesses file!"<<endl;
+    /* Reads a value of a version 2 file. */
+    template <class T>
+    static T get_value(const char* in) {
+        T value;
+        if(swap_byte_order) {
+            char bytes[sizeof(T)];
+            for(size_t i = 0; i < sizeof(T); ++i) {
+                bytes[i] = in[sizeof(T) - 1 - i];
+            }
+            memcpy(&value, bytes, sizeof(T));
+        }
+        else {
+            memcpy(&value, in, sizeof(T));
+        }
+        return value;
+    }
+
+    /*
+     * Maps a profiling file for reading, exits if it cannot be opened. The
+     * files are read front to back, so the kernel is told to read ahead and
+     * to drop pages once they were passed.
+     */
+    static void map_file(const char* name,
+                         const char* error,
+                         mapped_file* file) {
+        struct stat status;
+        int fd = open(name, O_RDONLY);
+
+        if(fd < 0 || fstat(fd, &status) != 0) {
+            cout<<error<<endl;
             exit(1);
         }
 
-        profiling_reader.peek();
-        if(profiling_reader.eof()){
-            cout<<"No shared objects were found"<<endl;
-            profiling_reader.close();
+        file->data = NULL;
+        file->size = status.st_size;
+        if(file->size > 0) {
+            void* data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(data == MAP_FAILED) {
+                cout<<error<<endl;
+                exit(1);
+            }
+            madvise(data, file->size, MADV_SEQUENTIAL);
+            file->data = (const char*) data;
+        }
+        close(fd);
+    }
+
+    static void unmap_file(mapped_file* file) {
+        if(file->data != NULL) {
+            munmap((void*) file->data, file->size);
+        }
+        file->data = NULL;
+        file->size = 0;
+    }
+
+    /*
+     * Checks whether a mapped file is a version 2 file of the given kind.
+     * Version 1 files have no header.
+     */
+    static bool read_format_header(const mapped_file& file, jint kind) {
+        swap_byte_order = false;
+        if(kind == FILE_OBJECT_ACCESSES)
+            access_writes = false;
+        else
+            object_sites = false;
+        if(file.size < (size_t)header_size ||
+           memcmp(file.data, format_magic, 4) != 0) {
+            return false;
+        }
+
+        unsigned short mark;
+        memcpy(&mark, file.data + 6, sizeof(mark));
+        swap_byte_order = (mark != byte_order_mark);
+
+        if(get_value<unsigned short>(file.data + 4) != 2 ||
+           get_value<jint>(file.data + 8) != kind) {
+            cout<<"Unsupported profiling file version or kind!"<<endl;
+            exit(1);
+        }
+        jint flags = get_value<jint>(file.data + 12);
+        if(kind == FILE_OBJECT_ACCESSES)
+            access_writes = (flags & FORMAT_ACCESS_WRITES) != 0;
+        else
+            object_sites = (flags & FORMAT_OBJECT_SITES) != 0;
+        return true;
+    }
+
+    /*
+     * Returns the payload of the chunk at the given offset of a version 2
+     * file, or NULL if the chunk is cut short.
+     */
+    static const char* chunk_payload(const mapped_file& file,
+                                     jlong offset,
+                                     jint* type,
+                                     size_t* length) {
+        if(offset < 0 || offset + chunk_header_size > (jlong)file.size)
+            return NULL;
+
+        const char* chunk = file.data + offset;
+        *type = get_value<jint>(chunk);
+        *length = (unsigned int)get_value<jint>(chunk + sizeof(jint));
+
+        // Every payload starts with its entry count.
+        if(*length < sizeof(jint) ||
+           *length > file.size - offset - chunk_header_size)
+            return NULL;
+        return chunk + chunk_header_size;
+    }
+
+    /*
+     * Returns the offset of the index chunk of a version 2 file, or -1 if the
+     * file has no trailer.
+     */
+    static jlong find_index(const mapped_file& file) {
+        if(file.size < (size_t)(header_size + trailer_size)) return -1;
+
+        const char* trailer = file.data + file.size - trailer_size;
+        if(memcmp(trailer + sizeof(jlong), trailer_magic, 4) != 0)
+            return -1;
+        return get_value<jlong>(trailer);
+    }
+
+    /*
+     * Finds the offsets of the chunks of a given type in a version 2 file,
+     * through the index. Files without a trailer, whose writer did not
+     * finish, are walked chunk by chunk instead.
+     */
+    static void find_chunks(const mapped_file& file,
+                            jint type,
+                            vector<jlong>* offsets) {
+        jlong index_offset = find_index(file);
+
+        if(index_offset >= 0) {
+            jint index_type;
+            size_t length;
+            const char* index = chunk_payload(file, index_offset,
+                                              &index_type, &length);
+            if(index != NULL && index_type == CHUNK_INDEX) {
+                jint count = get_value<jint>(index);
+                const size_t entry_size = sizeof(jint) + sizeof(jlong);
+                for(jint i = 0; i < count &&
+                    sizeof(jint) + (i + 1)*entry_size <= length; ++i) {
+                    const char* entry = index + sizeof(jint) + i*entry_size;
+                    if(get_value<jint>(entry) == type)
+                        offsets->push_back(get_value<jlong>(entry +
+                                                            sizeof(jint)));
+                }
+                return;
+            }
+        }
+
+        jlong offset = header_size;
+        while(offset + chunk_header_size <= (jlong)file.size) {
+            const char* chunk = file.data + offset;
+            jlong next = offset + chunk_header_size +
+                         (unsigned int)get_value<jint>(chunk + sizeof(jint));
+            if(next > (jlong)file.size) break;
+
+            if(get_value<jint>(chunk) == type)
+                offsets->push_back(offset);
+            offset = next;
+        }
+    }
+
+    /* Reads the class table of a version 2 file into class_names. */
+    static void read_class_table_v2(const mapped_file& file) {
+        vector<jlong> offsets;
+        jint type;
+        size_t length;
+
+        find_chunks(file, CHUNK_CLASSES, &offsets);
+        for(size_t c = 0; c < offsets.size(); ++c) {
+            const char* payload = chunk_payload(file, offsets[c],
+                                                &type, &length);
+            if(payload == NULL) continue;
+
+            const char* in = payload + sizeof(jint);
+            const char* end = payload + length;
+            jint count = get_value<jint>(payload);
+
+            for(jint i = 0; i < count && in + 2*sizeof(jint) <= end; ++i) {
+                class_view name;
+                jint class_ID = get_value<jint>(in);
+                name.length = get_value<jint>(in + sizeof(jint));
+                name.name = in + 2*sizeof(jint);
+                if(class_ID < 0 || name.length < 0 ||
+                   name.length > end - name.name) break;
+                in = name.name + name.length;
+
+                if((size_t)class_ID >= class_names.size())
+                    class_names.resize(class_ID + 1, unknown_class);
+                class_names[class_ID] = name;
+            }
+        }
+    }
+
+    /* Returns the name of a class read from a version 2 file. */
+    static class_view class_name(jint class_ID) {
+        if(class_ID >= 0 && (size_t)class_ID < class_names.size())
+            return class_names[class_ID];
+        return unknown_class;
+    }
+
+    /*
+     * Walks the records of a mapped file in place. Version 1 files are one
+     * run of records, version 2 files are walked chunk by chunk.
+     */
+    struct record_cursor {
+        const mapped_file* file;
+        bool version2;
+        vector<jlong> chunks;
+        size_t next_chunk;
+        const char* in;
+        const char* end;
+        jint remaining;
+    };
+
+    /* An object info record, pointing into the mapped ObjectInfo file. */
+    struct object_view {
+        jlong object_ID;
+        jlong object_size;
+        jint class_ID;
+        jint site_ID;
+        class_view klass;
+    };
+
+    /* An access record, pointing into the mapped ObjectAccesses file. */
+    struct accesses_view {
+        jlong object_ID;
+        int accesses_length;
+        const char* thread_accesses;
+        int access_size;
+    };
+
+    static void open_cursor(record_cursor* cursor,
+                            const mapped_file& file,
+                            bool version2,
+                            jint chunk_type) {
+        cursor->file = &file;
+        cursor->version2 = version2;
+        cursor->next_chunk = 0;
+        cursor->remaining = 0;
+        cursor->in = cursor->end = NULL;
+
+        if(version2)
+            find_chunks(file, chunk_type, &cursor->chunks);
+        else if(file.data != NULL) {
+            cursor->in = file.data;
+            cursor->end = file.data + file.size;
+        }
+    }
+
+    /*
+     * Moves a version 2 cursor to its next record, at least record_size
+     * bytes long, entering the next chunk when needed. The rest of a chunk
+     * cut short is skipped.
+     */
+    static bool next_chunk_record(record_cursor* cursor, size_t record_size) {
+        while(cursor->remaining <= 0 ||
+              (size_t)(cursor->end - cursor->in) < record_size) {
+            if(cursor->next_chunk == cursor->chunks.size()) return false;
+
+            jint type;
+            size_t length;
+            const char* payload = chunk_payload(*cursor->file,
+                    cursor->chunks[cursor->next_chunk++], &type, &length);
+            if(payload == NULL) continue;
+
+            cursor->remaining = get_value<jint>(payload);
+            cursor->in = payload + sizeof(jint);
+            cursor->end = payload + length;
+        }
+        --cursor->remaining;
+        return true;
+    }
+
+    static bool next_object(record_cursor* cursor, object_view* object) {
+        if(cursor->version2) {
+            const size_t record_size = 2*sizeof(jlong) +
+                                       (object_sites ? 2 : 1)*sizeof(jint);
+            if(!next_chunk_record(cursor, record_size)) return false;
+
+            object->object_ID = get_value<jlong>(cursor->in);
+            object->object_size = get_value<jlong>(cursor->in + sizeof(jlong));
+            object->class_ID = get_value<jint>(cursor->in + 2*sizeof(jlong));
+            object->site_ID = (object_sites ?
+                get_value<jint>(cursor->in + 2*sizeof(jlong) + sizeof(jint)) :
+                0);
+            object->klass = class_name(object->class_ID);
+            cursor->in += record_size;
+            return true;
+        }
+
+        // size of the class signature (string terminator not included!)
+        // followed by the object id and the signature
+        if(cursor->end - cursor->in < (int)(sizeof(int) + sizeof(jlong)))
+            return false;
+        object->klass.length = get_value<int>(cursor->in);
+        object->klass.name = cursor->in + sizeof(int) + sizeof(jlong);
+        if(object->klass.length < 0 ||
+           object->klass.length > cursor->end - object->klass.name)
+            return false;
+
+        object->object_ID = get_value<jlong>(cursor->in + sizeof(int));
+        object->object_size = 0;   // not recorded in version 1 files
+        object->class_ID = -1;
+        object->site_ID = 0;
+        cursor->in = object->klass.name + object->klass.length;
+        return true;
+    }
+
+    static bool next_accesses(record_cursor* cursor, accesses_view* accesses) {
+        const size_t header = sizeof(jlong) + sizeof(jint);
+
+        if(cursor->version2) {
+            for(;;) {
+                if(!next_chunk_record(cursor, header)) return false;
+
+                accesses->accesses_length =
+                        get_value<jint>(cursor->in + sizeof(jlong));
+                accesses->thread_accesses = cursor->in + header;
+                if(accesses->accesses_length >= 0 &&
+                   accesses->accesses_length <= (cursor->end -
+                        accesses->thread_accesses)/(jint)sizeof(jint))
+                    break;
+                cursor->remaining = 0;
+            }
+            accesses->object_ID = get_value<jlong>(cursor->in);
+            accesses->access_size = sizeof(jint);
+        }
+        else {
+            // size of the accesses array, followed by the object id
+            if(cursor->end - cursor->in < (int)header) return false;
+            int record_size = get_value<int>(cursor->in);
+            accesses->object_ID = get_value<jlong>(cursor->in + sizeof(int));
+            accesses->thread_accesses = cursor->in + header;
+            if(record_size < 0 ||
+               record_size > cursor->end - accesses->thread_accesses)
+                return false;
+
+            accesses->accesses_length = record_size/sizeof(jlong);
+            accesses->access_size = sizeof(jlong);
+        }
+
+        cursor->in = accesses->thread_accesses +
+                     accesses->accesses_length*accesses->access_size;
+        return true;
+    }
+
+    /* Returns a thread ID of an access record. */
+    static jlong thread_access(const char* threads, int access_size, int i) {
+        return (access_size == sizeof(jlong) ?
+                get_value<jlong>(threads + i*access_size) :
+                get_value<jint>(threads + i*access_size) & ~ACCESS_WRITE);
+    }
+
+    /* Whether the thread of an access wrote to the object. */
+    static bool access_is_write(const char* threads, int access_size, int i) {
+        return access_size == sizeof(jint) &&
+               (get_value<jint>(threads + i*access_size) & ACCESS_WRITE) != 0;
+    }
+
+    /*
+     * Parallel reader for ObjectAccesses. The main thread cuts the mapped
+     * file into large blocks of whole records (or chunks, in version 2
+     * files) by following the length prefixes. Worker threads walk the
+     * blocks into their own lists, which are merged into shared_objects
+     * once the file is read, so the walk runs on all workers.
+     */
+    const size_t parse_block_size = 16*1024*1024;
+
+    struct parse_block {
+        const char* begin;
+        const char* end;
+    };
+
+    /* Blocks waiting to be decoded, at most max_blocks of them. */
+    struct parse_queue {
+        pthread_mutex_t mutex;
+        pthread_cond_t changed;
+        list<parse_block> blocks;
+        size_t max_blocks;
+        bool done;
+    };
+
+    struct parse_worker {
+        pthread_t thread;
+        parse_queue* queue;
+        bool version2;
+        vector<accesses_view> decoded;
+    };
+
+    /*
+     * Returns the size of the record or chunk starting at 'in', or 0 if not
+     * even its header fits in 'available' bytes.
+     */
+    static size_t parse_unit_size(const char* in,
+                                  size_t available,
+                                  bool version2) {
+        if(version2) {
+            if(available < (size_t)chunk_header_size) return 0;
+            return chunk_header_size +
+                   (unsigned int)get_value<jint>(in + sizeof(jint));
+        }
+        if(available < sizeof(int) + sizeof(jlong)) return 0;
+        return sizeof(int) + sizeof(jlong) +
+               (unsigned int)get_value<int>(in);
+    }
+
+    /* Decodes a block of whole records or chunks. */
+    static void decode_block(const parse_block& block, parse_worker* worker) {
+        record_cursor cursor;
+        accesses_view accesses;
+        cursor.version2 = worker->version2;
+        cursor.next_chunk = 0;
+        cursor.remaining = 0;
+
+        if(!worker->version2) {
+            cursor.in = block.begin;
+            cursor.end = block.end;
+            while(next_accesses(&cursor, &accesses)) {
+                worker->decoded.push_back(accesses);
+            }
             return;
         }
 
-        int record_size = 0;
-        jlong object_ID = -1;
+        // Only access chunks hold records, others are skipped.
+        for(const char* in = block.begin; in < block.end;) {
+            size_t size = parse_unit_size(in, block.end - in, true);
+            if(get_value<jint>(in) == CHUNK_ACCESSES &&
+               size >= chunk_header_size + sizeof(jint)) {
+                cursor.remaining = get_value<jint>(in + chunk_header_size);
+                cursor.in = in + chunk_header_size + sizeof(jint);
+                cursor.end = in + size;
+                while(next_accesses(&cursor, &accesses)) {
+                    worker->decoded.push_back(accesses);
+                }
+            }
+            in += size;
+        }
+    }
+
+    static void* parse_worker_main(void* arg) {
+        parse_worker* worker = static_cast<parse_worker*>(arg);
+        parse_queue* queue = worker->queue;
+
+        for(;;) {
+            pthread_mutex_lock(&queue->mutex);
+            while(queue->blocks.empty() && !queue->done) {
+                pthread_cond_wait(&queue->changed, &queue->mutex);
+            }
+            if(queue->blocks.empty()) {
+                pthread_mutex_unlock(&queue->mutex);
+                break;
+            }
+            parse_block block = queue->blocks.front();
+            queue->blocks.pop_front();
+            pthread_cond_broadcast(&queue->changed);
+            pthread_mutex_unlock(&queue->mutex);
+
+            decode_block(block, worker);
+        }
+        return NULL;
+    }
+
+    /* Hands a block to the workers, waiting while the queue is full. */
+    static void push_block(parse_queue* queue, const parse_block& block) {
+        pthread_mutex_lock(&queue->mutex);
+        while(queue->blocks.size() >= queue->max_blocks) {
+            pthread_cond_wait(&queue->changed, &queue->mutex);
+        }
+        queue->blocks.push_back(block);
+        pthread_cond_broadcast(&queue->changed);
+        pthread_mutex_unlock(&queue->mutex);
+    }
+
+    /*
+     * Reads the records of the mapped ObjectAccesses file, between 'begin'
+     * and 'end', on reader_threads workers.
+     */
+    static void read_objects_accesses_parallel(bool version2,
+                                               const char* begin,
+                                               const char* end) {
+        parse_queue queue;
+        pthread_mutex_init(&queue.mutex, NULL);
+        pthread_cond_init(&queue.changed, NULL);
+        queue.max_blocks = 2*reader_threads;
+        queue.done = false;
+
+        vector<parse_worker> workers(reader_threads);
+        for(int i = 0; i < reader_threads; ++i) {
+            workers[i].queue = &queue;
+            workers[i].version2 = version2;
+            pthread_create(&workers[i].thread, NULL, &parse_worker_main,
+                           &workers[i]);
+        }
+
+        // A record cut short at the end of the file is dropped.
+        parse_block block;
+        block.begin = block.end = begin;
+        size_t size;
+        while((size = parse_unit_size(block.end, end - block.end,
+                                      version2)) > 0 &&
+              size <= (size_t)(end - block.end)) {
+            block.end += size;
+            if((size_t)(block.end - block.begin) >= parse_block_size) {
+                push_block(&queue, block);
+                block.begin = block.end;
+            }
+        }
+        if(block.end > block.begin)
+            push_block(&queue, block);
+
+        pthread_mutex_lock(&queue.mutex);
+        queue.done = true;
+        pthread_cond_broadcast(&queue.changed);
+        pthread_mutex_unlock(&queue.mutex);
+
+        for(int i = 0; i < reader_threads; ++i) {
+            pthread_join(workers[i].thread, NULL);
+
+            vector<accesses_view>& decoded = workers[i].decoded;
+            for(size_t j = 0; j < decoded.size(); ++j) {
+                object_info_record& record =
+                        shared_objects[decoded[j].object_ID];
+                record.thread_accesses = decoded[j].thread_accesses;
+                record.accesses_length = decoded[j].accesses_length;
+                record.access_size = decoded[j].access_size;
+            }
+        }
+
+        pthread_cond_destroy(&queue.changed);
+        pthread_mutex_destroy(&queue.mutex);
+    }
+
+    void read_objects_class() {
+        map_file(object_info_file, "Could not open Object Info file!",
+                 &info_map);
+
+        bool version2 = read_format_header(info_map, FILE_OBJECT_INFO);
+        if(version2) read_class_table_v2(info_map);
+
+        record_cursor cursor;
+        object_view object;
+        bool found = false;
+
+        open_cursor(&cursor, info_map, version2, CHUNK_OBJECTS);
+        while(next_object(&cursor, &object)) {
+            shared_objects[object.object_ID].object_class = object.klass;
+            found = true;
+        }
+
+        if(!found) {
+            cout<<"No shared objects were found"<<endl;
+        }
+    }
+
+    void read_objects_accesses() {
+        map_file(object_accesses_file, "Could not open Accesses file!",
+                 &accesses_map);
 
-        do {
-           // size of the accesses array
-           profiling_reader.read((char*)&(record_size), sizeof(int));
+        bool version2 = read_format_header(accesses_map, FILE_OBJECT_ACCESSES);
 
-           // object id
-           profiling_reader.read((char*)&(object_ID), sizeof(jlong));
+        if(reader_threads > 1) {
+            const char* begin = accesses_map.data;
+            const char* end = accesses_map.data + accesses_map.size;
 
-           int arr_length = record_size/sizeof(jlong);
-           int read_length = (arr_length<max_record_size?
-                                arr_length:max_record_size);
-           int skip_length = arr_length-read_length;
+            // Version 2 records end where the index chunk starts.
+            if(version2) {
+                begin += header_size;
+                jlong index_offset = find_index(accesses_map);
+                if(index_offset >= header_size &&
+                   index_offset <= (jlong)accesses_map.size)
+                    end = accesses_map.data + index_offset;
+            }
+            read_objects_accesses_parallel(version2, begin, end);
+            return;
+        }
 
-           shared_objects[object_ID].thread_accesses = new jlong[read_length];
+        record_cursor cursor;
+        accesses_view accesses;
+        bool found = false;
 
-           for(int i = 0; i< read_length; ++i) {
-               profiling_reader.read((char*)&(
-                       shared_objects[object_ID].thread_accesses[i]),
-                       sizeof(jlong));
-           }
-           profiling_reader.seekg(skip_length*sizeof(jlong), ios_base::cur);
-           shared_objects[object_ID].accesses_length = arr_length;
+        open_cursor(&cursor, accesses_map, version2, CHUNK_ACCESSES);
+        while(next_accesses(&cursor, &accesses)) {
+            object_info_record& record = shared_objects[accesses.object_ID];
+            record.thread_accesses = accesses.thread_accesses;
+            record.accesses_length = accesses.accesses_length;
+            record.access_size = accesses.access_size;
+            found = true;
+        }
 
-           profiling_reader.peek();
-        } while(!(profiling_reader.eof()));
+        if(!found) {
+            cout<<"No shared objects were found"<<endl;
+        }
+    }
+
+    static bool class_matches(const class_view& klass) {
+        return object_class.compare(all_objects) == 0 ||
+               object_class.compare(0, string::npos,
+                                    klass.name, klass.length) == 0;
+    }
 
-        profiling_reader.close();
+    /* Classes of objects missing from ObjectInfo are printed as unknown. */
+    static class_view record_class(const object_info_record& record) {
+        return (record.object_class.name != NULL ?
+                record.object_class : unknown_class);
+    }
+
+    /* Prints one object's access record, writes are marked with a 'w'. */
+    static void print_accesses(const class_view& klass,
+                               int arr_length,
+                               const char* threads,
+                               int access_size) {
+        int read_length = (arr_length<max_record_size?
+                            arr_length:max_record_size);
+        cout.write(klass.name, klass.length);
+        cout<<arr_length<<": ";
+        for(int i = 0; i < read_length; ++i) {
+            cout<<thread_access(threads, access_size, i)
+                <<(access_is_write(threads, access_size, i) ? "w  " : "  ");
+        }
+        cout<<'\n';
     }
 
     void output_object_info(){
@@ -195,9 +1242,10 @@ namespace profiling_io {
             it != end; ++it) {
             // TODO this is the easy, dumb, memory consuming way of filtering,
             // do it right later, put only what is needed in the map.
-            if(object_class.compare(all_objects) == 0 ||
-               object_class.compare(it->second.object_class) == 0) {
-                cout<<it->second.object_class<<endl;
+            class_view klass = record_class(it->second);
+            if(class_matches(klass)) {
+                cout.write(klass.name, klass.length);
+                cout<<'\n';
             }
         }
     }
@@ -210,20 +1258,720 @@ namespace profiling_io {
             it != end; ++it) {
 
             // TODO Again the dumb way, fix later
-            if(object_class.compare(all_objects) == 0 ||
-               object_class.compare(it->second.object_class) == 0) {
-                cout<<it->second.object_class
-                    <<it->second.accesses_length<<": ";
+            class_view klass = record_class(it->second);
+            if(class_matches(klass)) {
+                print_accesses(klass, it->second.accesses_length,
+                               it->second.thread_accesses,
+                               it->second.access_size);
+            }
+        }
+    }
+
+    /*
+     * Streaming reader. Instead of loading both files into shared_objects,
+     * the class filter is applied while ObjectInfo is read, and only the
+     * IDs of matching objects are kept, in a flat hash table. ObjectAccesses
+     * is then streamed and records of other objects are skipped, so memory
+     * grows with the matched objects only. Objects are printed in file order
+     * rather than by ID.
+     */
+
+    /*
+     * Open addressing hash table from object IDs to class indices in
+     * class_names, and to object sizes if keep_sizes is set. Object IDs
+     * start at 1, so 0 marks an empty slot.
+     */
+    struct id_table {
+        vector<jlong> keys;
+        vector<jint> classes;
+        vector<jlong> sizes;
+        size_t count;
+        bool keep_sizes;
+    };
+
+    static size_t id_slot(jlong object_ID, size_t mask) {
+        unsigned long long hash = object_ID * 0x9E3779B97F4A7C15ULL;
+        return (size_t)(hash ^ (hash >> 32)) & mask;
+    }
+
+    static void id_table_insert(id_table* table,
+                                jlong object_ID,
+                                jint klass,
+                                jlong object_size) {
+        // Keep the table at most half full, so probe sequences stay short.
+        if(2*(table->count + 1) > table->keys.size()) {
+            vector<jlong> keys, sizes;
+            vector<jint> classes;
+            keys.swap(table->keys);
+            classes.swap(table->classes);
+            sizes.swap(table->sizes);
+
+            size_t capacity = (keys.empty() ? 1024 : 2*keys.size());
+            table->keys.assign(capacity, 0);
+            table->classes.assign(capacity, 0);
+            if(table->keep_sizes) table->sizes.assign(capacity, 0);
+            table->count = 0;
+            for(size_t i = 0; i < keys.size(); ++i) {
+                if(keys[i] != 0) {
+                    id_table_insert(table, keys[i], classes[i],
+                                    table->keep_sizes ? sizes[i] : 0);
+                }
+            }
+        }
+
+        size_t mask = table->keys.size() - 1;
+        size_t slot = id_slot(object_ID, mask);
+        while(table->keys[slot] != 0 && table->keys[slot] != object_ID) {
+            slot = (slot + 1) & mask;
+        }
+        if(table->keys[slot] == 0) ++table->count;
+        table->keys[slot] = object_ID;
+        table->classes[slot] = klass;
+        if(table->keep_sizes) table->sizes[slot] = object_size;
+    }
+
+    /* Finds an object, its size is only set if the table keeps sizes. */
+    static bool id_table_find(const id_table& table,
+                              jlong object_ID,
+                              jint* klass,
+                              jlong* object_size = NULL) {
+        if(table.keys.empty()) return false;
+
+        size_t mask = table.keys.size() - 1;
+        for(size_t slot = id_slot(object_ID, mask); table.keys[slot] != 0;
+            slot = (slot + 1) & mask) {
+            if(table.keys[slot] == object_ID) {
+                *klass = table.classes[slot];
+                if(object_size != NULL && table.keep_sizes)
+                    *object_size = table.sizes[slot];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /* Orders class signatures by their bytes. */
+    struct class_view_less {
+        bool operator()(const class_view& a, const class_view& b) const {
+            int common = (a.length < b.length ? a.length : b.length);
+            int order = memcmp(a.name, b.name, common);
+            return order < 0 || (order == 0 && a.length < b.length);
+        }
+    };
+
+    typedef map<class_view, jint, class_view_less> class_index_map;
+
+    /*
+     * Gives the class of a version 1 object an index in class_names, as
+     * version 1 files have no class IDs.
+     */
+    static void number_class(class_index_map* class_indices,
+                             object_view* object) {
+        class_index_map::iterator it = class_indices->find(object->klass);
+        if(it == class_indices->end()) {
+            it = class_indices->insert(
+                    make_pair(object->klass, class_names.size())).first;
+            class_names.push_back(object->klass);
+        }
+        object->class_ID = it->second;
+    }
+
+    /*
+     * Streams ObjectInfo. Prints the class of each matching object in 'i'
+     * mode, otherwise remembers matching objects in 'matched'.
+     */
+    static void stream_objects_class(id_table* matched) {
+        map_file(object_info_file, "Could not open Object Info file!",
+                 &info_map);
+
+        bool version2 = read_format_header(info_map, FILE_OBJECT_INFO);
+        if(version2) read_class_table_v2(info_map);
+
+        // Version 1 classes are numbered as they are first matched.
+        class_index_map class_indices;
+        record_cursor cursor;
+        object_view object;
+
+        open_cursor(&cursor, info_map, version2, CHUNK_OBJECTS);
+        while(next_object(&cursor, &object)) {
+            if(!class_matches(object.klass)) continue;
+
+            if(io_mode == 'i') {
+                cout.write(object.klass.name, object.klass.length);
+                cout<<'\n';
+                continue;
+            }
+
+            if(!version2) number_class(&class_indices, &object);
+            id_table_insert(matched, object.object_ID, object.class_ID, 0);
+        }
+    }
+
+    /* Streams ObjectAccesses, printing the records of matched objects. */
+    static void stream_objects_accesses(const id_table& matched) {
+        map_file(object_accesses_file, "Could not open Accesses file!",
+                 &accesses_map);
+
+        bool version2 = read_format_header(accesses_map, FILE_OBJECT_ACCESSES);
+        record_cursor cursor;
+        accesses_view accesses;
+        jint klass;
+
+        // Other objects' records are skipped without touching their IDs.
+        open_cursor(&cursor, accesses_map, version2, CHUNK_ACCESSES);
+        while(next_accesses(&cursor, &accesses)) {
+            if(id_table_find(matched, accesses.object_ID, &klass)) {
+                print_accesses(class_name(klass), accesses.accesses_length,
+                               accesses.thread_accesses, accesses.access_size);
+            }
+        }
+    }
+
+    void stream_shared_objects_info() {
+        cout<<"\nShared Objects' Details:"<<endl;
+
+        id_table matched;
+        matched.count = 0;
+        matched.keep_sizes = false;
+        stream_objects_class(&matched);
+
+        if(io_mode == 'a') {
+            stream_objects_accesses(matched);
+        }
+        unmap_file(&info_map);
+        unmap_file(&accesses_map);
+    }
+
+    /*
+     * Aggregated report. Each file is read once: ObjectInfo gives every class
+     * its shared objects and bytes, ObjectAccesses the distinct threads,
+     * access sequence lengths and writing threads of those objects. Objects
+     * are joined through the streaming reader's ID table, and one CSV line or
+     * JSON object is written per class.
+     */
+
+    /* Distinct thread counts are bucketed by powers of two. */
+    const int thread_buckets = 6;
+    const char* const thread_bucket_names[thread_buckets] = {
+        "1", "2", "3_4", "5_8", "9_16", "17_plus"
+    };
+
+    /* Shared objects by how many threads wrote to them, up to two. */
+    const int sharing_kinds = 3;
+    const char* const sharing_kind_names[sharing_kinds] = {
+        "read_only", "single_writer", "multi_writer"
+    };
+
+    struct class_summary {
+        jlong objects;
+        jlong bytes;
+        jlong threads[thread_buckets];
+        vector<jint> lengths;
+        jlong kind_objects[sharing_kinds];
+        jlong kind_bytes[sharing_kinds];
+    };
+
+    /* Report output, handed to cout in large blocks. */
+    const size_t report_block_size = 64*1024;
+    string report_output;
+
+    static void report_flush() {
+        cout.write(report_output.data(), report_output.size());
+        report_output.clear();
+    }
+
+    static void report_put(const char* text) {
+        report_output += text;
+        if(report_output.size() >= report_block_size) report_flush();
+    }
+
+    static void report_number(jlong value) {
+        char text[32];
+        snprintf(text, sizeof(text), "%lld", (long long) value);
+        report_put(text);
+    }
+
+    /* Writes text escaped for a quoted CSV field or JSON string. */
+    static void report_escaped(const class_view& text, report_format format) {
+        for(int i = 0; i < text.length; ++i) {
+            char c = text.name[i];
+            if(c == '"')
+                report_output += (format == REPORT_CSV ? "\"\"" : "\\\"");
+            else if(c == '\\' && format == REPORT_JSON)
+                report_output += "\\\\";
+            else
+                report_output += c;
+        }
+    }
 
-                int arr_length = it->second.accesses_length;
-                int read_length = (arr_length<max_record_size?
-                                arr_length:max_record_size);
-                for(int i = 0; i<read_length; i++) {
-                cout<<it->second.thread_accesses[i]<<"  ";
+    /* Writes a class signature as a quoted CSV field or JSON string. */
+    static void report_class(const class_view& klass, report_format format) {
+        report_output += '"';
+        report_escaped(klass, format);
+        report_output += '"';
+    }
+
+    static int thread_bucket(int distinct) {
+        int bucket = 0;
+        for(int limit = 1; bucket < thread_buckets - 1 && distinct > limit;
+            limit *= 2) {
+            ++bucket;
+        }
+        return bucket;
+    }
+
+    /* Counts the distinct thread IDs of an access record. */
+    static int distinct_threads(const accesses_view& accesses,
+                                vector<jlong>* scratch) {
+        scratch->resize(accesses.accesses_length);
+        for(int i = 0; i < accesses.accesses_length; ++i) {
+            (*scratch)[i] = thread_access(accesses.thread_accesses,
+                                          accesses.access_size, i);
+        }
+        sort(scratch->begin(), scratch->end());
+        return unique(scratch->begin(), scratch->end()) - scratch->begin();
+    }
+
+    /* Returns the number of threads that wrote to an object, up to two. */
+    static int sharing_kind(const accesses_view& accesses) {
+        jlong writer = 0;
+        for(int i = 0; i < accesses.accesses_length; ++i) {
+            if(!access_is_write(accesses.thread_accesses,
+                                accesses.access_size, i)) continue;
+
+            jlong thread = thread_access(accesses.thread_accesses,
+                                         accesses.access_size, i);
+            if(writer == 0)
+                writer = thread;
+            else if(thread != writer)
+                return 2;
+        }
+        return (writer == 0 ? 0 : 1);
+    }
+
+    /* Nearest rank percentile of sorted lengths. */
+    static jint length_percentile(const vector<jint>& lengths, int percent) {
+        if(lengths.empty()) return 0;
+        size_t rank = (lengths.size()*percent + 99)/100;
+        return lengths[rank > 0 ? rank - 1 : 0];
+    }
+
+    static void report_summary(const class_view& klass,
+                               class_summary* summary,
+                               report_format format,
+                               bool first) {
+        const int percents[] = { 50, 90, 99 };
+        vector<jint>& lengths = summary->lengths;
+        sort(lengths.begin(), lengths.end());
+
+        if(format == REPORT_CSV) {
+            report_class(klass, format);
+            report_put(",");
+            report_number(summary->objects);
+            report_put(",");
+            report_number(summary->bytes);
+            for(int b = 0; b < thread_buckets; ++b) {
+                report_put(",");
+                report_number(summary->threads[b]);
+            }
+            report_put(",");
+            report_number(lengths.size());
+            for(int p = 0; p < 3; ++p) {
+                report_put(",");
+                report_number(length_percentile(lengths, percents[p]));
+            }
+            report_put(",");
+            report_number(lengths.empty() ? 0 : lengths.back());
+            // Files without writes leave the sharing kinds empty.
+            for(int k = 0; k < sharing_kinds; ++k) {
+                report_put(",");
+                if(access_writes) report_number(summary->kind_objects[k]);
+                report_put(",");
+                if(access_writes) report_number(summary->kind_bytes[k]);
+            }
+            report_put("\n");
+            return;
+        }
+
+        report_put(first ? "\n  {\"class\": " : ",\n  {\"class\": ");
+        report_class(klass, format);
+        report_put(", \"objects\": ");
+        report_number(summary->objects);
+        report_put(", \"bytes\": ");
+        report_number(summary->bytes);
+        report_put(", \"threads\": {");
+        for(int b = 0; b < thread_buckets; ++b) {
+            report_put(b == 0 ? "\"" : ", \"");
+            report_put(thread_bucket_names[b]);
+            report_put("\": ");
+            report_number(summary->threads[b]);
+        }
+        report_put("}, \"accessed\": ");
+        report_number(lengths.size());
+        report_put(", \"length\": {");
+        for(int p = 0; p < 3; ++p) {
+            char name[16];
+            snprintf(name, sizeof(name), "\"p%d\": ", percents[p]);
+            report_put(name);
+            report_number(length_percentile(lengths, percents[p]));
+            report_put(", ");
+        }
+        report_put("\"max\": ");
+        report_number(lengths.empty() ? 0 : lengths.back());
+        report_put("}");
+        if(access_writes) {
+            report_put(", \"sharing\": {");
+            for(int k = 0; k < sharing_kinds; ++k) {
+                report_put(k == 0 ? "\"" : ", \"");
+                report_put(sharing_kind_names[k]);
+                report_put("\": {\"objects\": ");
+                report_number(summary->kind_objects[k]);
+                report_put(", \"bytes\": ");
+                report_number(summary->kind_bytes[k]);
+                report_put("}");
+            }
+            report_put("}");
+        }
+        report_put("}");
+    }
+
+    void report_shared_objects_info(report_format format) {
+        map_file(object_info_file, "Could not open Object Info file!",
+                 &info_map);
+        bool version2 = read_format_header(info_map, FILE_OBJECT_INFO);
+        if(version2) read_class_table_v2(info_map);
+
+        id_table objects;
+        objects.count = 0;
+        objects.keep_sizes = true;
+        class_index_map class_indices;
+        vector<class_summary> summaries;
+        record_cursor cursor;
+        object_view object;
+
+        open_cursor(&cursor, info_map, version2, CHUNK_OBJECTS);
+        while(next_object(&cursor, &object)) {
+            if(!class_matches(object.klass)) continue;
+
+            if(!version2) number_class(&class_indices, &object);
+            if(object.class_ID < 0 ||
+               (size_t)object.class_ID >= class_names.size()) continue;
+
+            if((size_t)object.class_ID >= summaries.size())
+                summaries.resize(object.class_ID + 1, class_summary());
+            ++summaries[object.class_ID].objects;
+            summaries[object.class_ID].bytes += object.object_size;
+            id_table_insert(&objects, object.object_ID, object.class_ID,
+                            object.object_size);
+        }
+
+        map_file(object_accesses_file, "Could not open Accesses file!",
+                 &accesses_map);
+        version2 = read_format_header(accesses_map, FILE_OBJECT_ACCESSES);
+
+        accesses_view accesses;
+        vector<jlong> scratch;
+        jint klass;
+        jlong object_size = 0;
+
+        open_cursor(&cursor, accesses_map, version2, CHUNK_ACCESSES);
+        while(next_accesses(&cursor, &accesses)) {
+            if(!id_table_find(objects, accesses.object_ID, &klass,
+                              &object_size)) continue;
+
+            class_summary& summary = summaries[klass];
+            summary.lengths.push_back(accesses.accesses_length);
+            int distinct = distinct_threads(accesses, &scratch);
+            if(distinct > 0) ++summary.threads[thread_bucket(distinct)];
+
+            int kind = sharing_kind(accesses);
+            ++summary.kind_objects[kind];
+            summary.kind_bytes[kind] += object_size;
+        }
+
+        if(format == REPORT_CSV) {
+            report_put("class,objects,bytes");
+            for(int b = 0; b < thread_buckets; ++b) {
+                report_put(",threads_");
+                report_put(thread_bucket_names[b]);
             }
-            cout<<endl;
+            report_put(",accessed,length_p50,length_p90,length_p99,"
+                       "length_max");
+            for(int k = 0; k < sharing_kinds; ++k) {
+                report_put(",");
+                report_put(sharing_kind_names[k]);
+                report_put("_objects,");
+                report_put(sharing_kind_names[k]);
+                report_put("_bytes");
             }
+            report_put("\n");
+        }
+        else {
+            report_put("[");
         }
+
+        bool first = true;
+        for(size_t c = 0; c < summaries.size(); ++c) {
+            if(summaries[c].objects == 0) continue;
+            report_summary(class_names[c], &summaries[c], format, first);
+            first = false;
+        }
+
+        if(format == REPORT_JSON) report_put("\n]\n");
+        report_flush();
+        cout.flush();
+
+        unmap_file(&info_map);
+        unmap_file(&accesses_map);
+    }
+
+    /*
+     * Field report. Ranks the fields of the fields chunk by the touches
+     * threads made to objects another thread touched last, the fields
+     * through which objects are shared and that are worth padding, moving
+     * or making thread local.
+     */
+
+    /* A field of the fields chunk, with its name in the mapped file. */
+    struct field_view {
+        class_view klass;
+        class_view name;
+        jlong cross_thread_touches;
+        jlong shared_objects;
+        jlong shared_bytes;
+    };
+
+    static bool field_touched_more(const field_view& a, const field_view& b) {
+        if(a.cross_thread_touches != b.cross_thread_touches)
+            return a.cross_thread_touches > b.cross_thread_touches;
+        return a.shared_bytes > b.shared_bytes;
+    }
+
+    /* Reads the fields chunks of a version 2 ObjectInfo file. */
+    static void read_field_table(const mapped_file& file,
+                                 vector<field_view>* fields) {
+        const size_t entry_size = 3*sizeof(jint) + 3*sizeof(jlong);
+        vector<jlong> offsets;
+        jint type;
+        size_t length;
+
+        find_chunks(file, CHUNK_FIELDS, &offsets);
+        for(size_t c = 0; c < offsets.size(); ++c) {
+            const char* payload = chunk_payload(file, offsets[c],
+                                                &type, &length);
+            if(payload == NULL) continue;
+
+            const char* in = payload + sizeof(jint);
+            const char* end = payload + length;
+            jint count = get_value<jint>(payload);
+
+            for(jint i = 0; i < count && in + entry_size <= end; ++i) {
+                field_view field;
+                field.klass = class_name(get_value<jint>(in + sizeof(jint)));
+                field.cross_thread_touches =
+                        get_value<jlong>(in + 2*sizeof(jint));
+                field.shared_objects =
+                        get_value<jlong>(in + 2*sizeof(jint) + sizeof(jlong));
+                field.shared_bytes =
+                        get_value<jlong>(in + 2*sizeof(jint) + 2*sizeof(jlong));
+                field.name.length =
+                        get_value<jint>(in + 2*sizeof(jint) + 3*sizeof(jlong));
+                field.name.name = in + entry_size;
+                if(field.name.length < 0 ||
+                   field.name.length > end - field.name.name) break;
+                in = field.name.name + field.name.length;
+
+                if(class_matches(field.klass)) fields->push_back(field);
+            }
+        }
+    }
+
+    void report_fields_info(report_format format) {
+        map_file(object_info_file, "Could not open Object Info file!",
+                 &info_map);
+        if(!read_format_header(info_map, FILE_OBJECT_INFO)) {
+            cout<<"Version 1 files carry no field table"<<endl;
+            unmap_file(&info_map);
+            return;
+        }
+        read_class_table_v2(info_map);
+
+        vector<field_view> fields;
+        read_field_table(info_map, &fields);
+        sort(fields.begin(), fields.end(), field_touched_more);
+
+        if(format == REPORT_CSV)
+            report_put("class,field,cross_thread_touches,shared_objects,"
+                       "shared_bytes\n");
+        else
+            report_put("[");
+
+        for(size_t i = 0; i < fields.size(); ++i) {
+            const field_view& field = fields[i];
+            if(format == REPORT_CSV) {
+                report_class(field.klass, format);
+                report_put(",");
+                report_class(field.name, format);
+                report_put(",");
+            }
+            else {
+                report_put(i == 0 ? "\n  {\"class\": " : ",\n  {\"class\": ");
+                report_class(field.klass, format);
+                report_put(", \"field\": ");
+                report_class(field.name, format);
+                report_put(", \"cross_thread_touches\": ");
+            }
+            report_number(field.cross_thread_touches);
+            report_put(format == REPORT_CSV ? "," : ", \"shared_objects\": ");
+            report_number(field.shared_objects);
+            report_put(format == REPORT_CSV ? "," : ", \"shared_bytes\": ");
+            report_number(field.shared_bytes);
+            report_put(format == REPORT_CSV ? "\n" : "}");
+        }
+
+        if(format == REPORT_JSON) report_put("\n]\n");
+        report_flush();
+        cout.flush();
+        unmap_file(&info_map);
+    }
+
+    /*
+     * Site report. Ranks the allocation sites of the shared objects by their
+     * bytes, with the class of their objects and the frames of their stack.
+     * Objects allocated where no stack was sampled are summed up as site 0,
+     * whose class is '*' as it holds objects of many classes.
+     */
+
+    /* The shared objects of an allocation site, and its frames. */
+    struct site_summary {
+        jint site_ID;
+        jlong objects;
+        jlong bytes;
+        jint class_ID;
+        vector<class_view> frames;
+    };
+
+    static bool site_larger(const site_summary* a, const site_summary* b) {
+        if(a->bytes != b->bytes) return a->bytes > b->bytes;
+        return a->objects > b->objects;
+    }
+
+    /* Reads the frames of the sites chunks into summaries by site ID. */
+    static void read_site_table(const mapped_file& file,
+                                vector<site_summary>* sites) {
+        vector<jlong> offsets;
+        jint type;
+        size_t length;
+
+        find_chunks(file, CHUNK_SITES, &offsets);
+        for(size_t c = 0; c < offsets.size(); ++c) {
+            const char* payload = chunk_payload(file, offsets[c],
+                                                &type, &length);
+            if(payload == NULL) continue;
+
+            const char* in = payload + sizeof(jint);
+            const char* end = payload + length;
+            jint count = get_value<jint>(payload);
+
+            for(jint i = 0; i < count && in + 2*sizeof(jint) <= end; ++i) {
+                jint site_ID = get_value<jint>(in);
+                jint frame_count = get_value<jint>(in + sizeof(jint));
+                in += 2*sizeof(jint);
+                if(site_ID < 0 || frame_count < 0) return;
+
+                vector<class_view> frames;
+                for(jint f = 0; f < frame_count; ++f) {
+                    class_view frame;
+                    if(in + sizeof(jint) > end) return;
+                    frame.length = get_value<jint>(in);
+                    frame.name = in + sizeof(jint);
+                    if(frame.length < 0 || frame.length > end - frame.name)
+                        return;
+                    in = frame.name + frame.length;
+                    frames.push_back(frame);
+                }
+
+                if((size_t)site_ID >= sites->size())
+                    sites->resize(site_ID + 1, site_summary());
+                (*sites)[site_ID].frames.swap(frames);
+            }
+        }
+    }
+
+    void report_sites_info(report_format format) {
+        map_file(object_info_file, "Could not open Object Info file!",
+                 &info_map);
+        if(!read_format_header(info_map, FILE_OBJECT_INFO) || !object_sites) {
+            cout<<"The object info file carries no allocation sites"<<endl;
+            unmap_file(&info_map);
+            return;
+        }
+        read_class_table_v2(info_map);
+
+        vector<site_summary> sites;
+        read_site_table(info_map, &sites);
+
+        record_cursor cursor;
+        object_view object;
+        open_cursor(&cursor, info_map, true, CHUNK_OBJECTS);
+        while(next_object(&cursor, &object)) {
+            if(!class_matches(object.klass) || object.site_ID < 0) continue;
+
+            if((size_t)object.site_ID >= sites.size())
+                sites.resize(object.site_ID + 1, site_summary());
+            site_summary& site = sites[object.site_ID];
+            if(site.objects == 0)
+                site.class_ID = object.class_ID;
+            else if(site.class_ID != object.class_ID)
+                site.class_ID = -1;
+            ++site.objects;
+            site.bytes += object.object_size;
+        }
+
+        vector<const site_summary*> ranked;
+        for(size_t i = 0; i < sites.size(); ++i) {
+            sites[i].site_ID = i;
+            if(sites[i].objects > 0) ranked.push_back(&sites[i]);
+        }
+        sort(ranked.begin(), ranked.end(), site_larger);
+
+        if(format == REPORT_CSV)
+            report_put("site,class,objects,bytes,frames\n");
+        else
+            report_put("[");
+
+        for(size_t i = 0; i < ranked.size(); ++i) {
+            const site_summary& site = *ranked[i];
+            report_put(format == REPORT_CSV ? "" :
+                       i == 0 ? "\n  {\"site\": " : ",\n  {\"site\": ");
+            report_number(site.site_ID);
+            report_put(format == REPORT_CSV ? "," : ", \"class\": ");
+            report_class(site.class_ID >= 0 ? class_name(site.class_ID) :
+                                              mixed_classes, format);
+            report_put(format == REPORT_CSV ? "," : ", \"objects\": ");
+            report_number(site.objects);
+            report_put(format == REPORT_CSV ? "," : ", \"bytes\": ");
+            report_number(site.bytes);
+
+            // CSV joins the frames into one field, innermost first.
+            report_put(format == REPORT_CSV ? ",\"" : ", \"frames\": [");
+            for(size_t f = 0; f < site.frames.size(); ++f) {
+                if(format == REPORT_CSV) {
+                    if(f > 0) report_put(";");
+                    report_escaped(site.frames[f], format);
+                }
+                else {
+                    if(f > 0) report_put(", ");
+                    report_class(site.frames[f], format);
+                }
+            }
+            report_put(format == REPORT_CSV ? "\"\n" : "]}");
+        }
+
+        if(format == REPORT_JSON) report_put("\n]\n");
+        report_flush();
+        cout.flush();
+        unmap_file(&info_map);
     }
 
     void output_shared_objects_info() {
@@ -239,7 +1987,7 @@ namespace profiling_io {
             read_objects_accesses();
             output_accesses();
         }      
+        unmap_file(&info_map);
+        unmap_file(&accesses_map);
     }
 };
-
-
@@ -4,7 +4,8 @@
  *
  * Created on September 26, 2011, 4:56 PM
  */
-#include <list>
+#include <string>
+#include <vector>
 
 #include "jvmti.h"
 #ifndef INFO_FILE_IO_H
@@ -15,18 +16,85 @@ using namespace std;
 extern "C" {
 #endif
 namespace profiling_io {
+    /*
+     * A batch of encoded object info records. Each producer fills its own
+     * batch without locking, the batch is then written out in one go.
+     */
+    struct record_buffer {
+        char* data;
+        int length;
+        int capacity;
+    };
+
+    /* The output file a batch of records belongs to. */
+    enum record_file { OBJECT_INFO_RECORDS, OBJECT_ACCESSES_RECORDS };
+
+    /*
+     * Set on an access sequence entry, next to the thread ID, when that
+     * thread wrote to the object during its run of touches.
+     */
+    const jint ACCESS_WRITE = 0x40000000;
+
+    /* Formats of the aggregated per class report. */
+    enum report_format { REPORT_CSV, REPORT_JSON };
+
+    /*
+     * The sharing counters of a watched field. The class signature and field
+     * name only need to stay valid while the field table is written.
+     */
+    struct field_record {
+        jint field_ID;
+        jint class_ID;
+        const char* object_class;
+        const char* field_name;
+        jlong cross_thread_touches;
+        jlong shared_objects;
+        jlong shared_bytes;
+    };
+
+    /*
+     * An allocation site, the frames of the stack that allocated the
+     * objects of the site, innermost first.
+     */
+    struct site_record {
+        jint site_ID;
+        vector<string> frames;
+    };
+
     void set_output_mode(char mode);
     void set_max_record_size(int size);
+    void set_reader_threads(int count);
     void set_object_class(string object_class_str);
     void change_profiling_files(string* info, string* accesses);
     void set_write_buffer_size(int size);
+    void set_output_format(int version);
+    void set_object_sites(bool enabled);
     void open_read(void);
     void open_write(void);
     void close_read(void);
     void close_write(void);
-    void write_access_info(jlong object_ID, list<jlong>* access_seq);
+    void write_access_info(jlong object_ID, const jint* threads, int length);
     void write_object_info(jlong object_ID,jlong object_size,char* object_class);
+    void init_buffer(record_buffer* buffer);
+    void free_buffer(record_buffer* buffer);
+    bool buffer_object_info(record_buffer* buffer,
+                            jlong object_ID,
+                            jlong object_size,
+                            jint class_ID,
+                            jint site_ID,
+                            const char* object_class);
+    bool buffer_access_info(record_buffer* buffer,
+                            jlong object_ID,
+                            const jint* threads,
+                            int length);
+    void write_buffer(record_buffer* buffer, record_file file);
+    void write_field_table(const vector<field_record>& fields);
+    void write_site_table(const vector<site_record>& sites);
     void output_shared_objects_info(void);
+    void stream_shared_objects_info(void);
+    void report_shared_objects_info(report_format format);
+    void report_fields_info(report_format format);
+    void report_sites_info(report_format format);
 };
 
 #ifdef	__cplusplus
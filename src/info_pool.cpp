@@ -0,0 +1,203 @@
+#include <cstdlib>
+#include "jvmti.h"
+#include "info_pool.h"
+
+/* Size of the blocks records are carved from. */
+const size_t slab_size = 256*1024;
+
+/* A cache adds its allocations to the live count in batches of this size. */
+const int pending_limit = 256;
+
+/*
+ * Slabs start with the link to the slab taken before, so they can be freed
+ * when the pool is released. Records follow, still aligned for jlongs.
+ */
+struct slab_header {
+    slab_header* next;
+};
+const size_t slab_header_size = sizeof(jlong);
+slab_header* volatile slabs = NULL;
+
+/* A recycled record holds the link to the next recycled record. */
+struct free_record {
+    free_record* next;
+};
+
+size_t record_size = 0;
+
+/*
+ * Records recycled by any thread. Producers push with a compare and swap,
+ * caches take the whole list at once, so the list never suffers from ABA.
+ */
+free_record* volatile recycled_records = NULL;
+
+/*
+ * Used when a record is needed before the calling thread has a cache of its
+ * own, protected by shared_cache_lock.
+ */
+info_pool::pool_cache shared_cache = { NULL, NULL, NULL, 0 };
+volatile int shared_cache_lock = 0;
+
+volatile jlong live_records = 0;
+volatile jlong peak_records = 0;
+volatile jlong slab_bytes = 0;
+
+/* Adds a cache's batched allocations to the live count and updates the peak. */
+static void add_live(info_pool::pool_cache* cache) {
+    jlong live = __sync_add_and_fetch(&live_records, cache->pending_records);
+    cache->pending_records = 0;
+
+    jlong peak = peak_records;
+    while(live > peak &&
+          !__sync_bool_compare_and_swap(&peak_records, peak, live)) {
+        peak = peak_records;
+    }
+}
+
+static void push_recycled(free_record* first, free_record* last) {
+    free_record* head;
+    do {
+        head = recycled_records;
+        last->next = head;
+    } while(!__sync_bool_compare_and_swap(&recycled_records, head, first));
+}
+
+static void push_slab(slab_header* slab) {
+    slab_header* head;
+    do {
+        head = slabs;
+        slab->next = head;
+    } while(!__sync_bool_compare_and_swap(&slabs, head, slab));
+}
+
+static void* allocate_from(info_pool::pool_cache* cache) {
+    void* record;
+
+    if(cache->free_records == NULL) {
+        // Take everything other threads have recycled so far.
+        cache->free_records = __sync_lock_test_and_set(&recycled_records, NULL);
+    }
+
+    if(cache->free_records != NULL) {
+        free_record* first = static_cast<free_record*>(cache->free_records);
+        cache->free_records = first->next;
+        record = first;
+    }
+    else {
+        if(cache->slab_cursor == NULL ||
+           cache->slab_cursor + record_size > cache->slab_end) {
+            char* slab = static_cast<char*>(malloc(slab_size));
+            if(slab == NULL) return NULL;
+            push_slab(reinterpret_cast<slab_header*>(slab));
+            cache->slab_cursor = slab + slab_header_size;
+            cache->slab_end = slab + slab_size;
+            __sync_fetch_and_add(&slab_bytes, (jlong) slab_size);
+        }
+        record = cache->slab_cursor;
+        cache->slab_cursor += record_size;
+    }
+
+    if(++cache->pending_records >= pending_limit) {
+        add_live(cache);
+    }
+    return record;
+}
+
+namespace info_pool {
+
+    /* Must be called once, before any allocation. */
+    void init_pool(size_t size) {
+        // Keep records aligned for the jlongs they hold.
+        record_size = (size + sizeof(jlong) - 1) & ~(sizeof(jlong) - 1);
+        if(record_size < sizeof(free_record))
+            record_size = sizeof(free_record);
+    }
+
+    void init_cache(pool_cache* cache) {
+        cache->free_records = NULL;
+        cache->slab_cursor = NULL;
+        cache->slab_end = NULL;
+        cache->pending_records = 0;
+    }
+
+    /*
+     * Hands the records a cache still holds, including the unused part of
+     * its slab, back to the pool.
+     */
+    void release_cache(pool_cache* cache) {
+        while(cache->slab_cursor != NULL &&
+              cache->slab_cursor + record_size <= cache->slab_end) {
+            free_record* record =
+                    reinterpret_cast<free_record*>(cache->slab_cursor);
+            record->next = static_cast<free_record*>(cache->free_records);
+            cache->free_records = record;
+            cache->slab_cursor += record_size;
+        }
+
+        if(cache->free_records != NULL) {
+            free_record* first = static_cast<free_record*>(cache->free_records);
+            free_record* last = first;
+            while(last->next != NULL) last = last->next;
+            push_recycled(first, last);
+        }
+        add_live(cache);
+        init_cache(cache);
+    }
+
+    /*
+     * Returns a record of the pool's record size. cache may be NULL for
+     * threads without a cache of their own.
+     */
+    void* allocate(pool_cache* cache) {
+        if(cache != NULL) return allocate_from(cache);
+
+        while(__sync_lock_test_and_set(&shared_cache_lock, 1)) {}
+        void* record = allocate_from(&shared_cache);
+        __sync_lock_release(&shared_cache_lock);
+        return record;
+    }
+
+    /* Returns a record to the pool, may be called from any thread. */
+    void recycle(void* record) {
+        free_record* freed = static_cast<free_record*>(record);
+        push_recycled(freed, freed);
+        __sync_fetch_and_sub(&live_records, 1);
+    }
+
+    /*
+     * Frees every slab, giving the memory of all records back to the system.
+     * Only called once no thread allocates or recycles records any more, and
+     * the caches were released.
+     */
+    void release_pool(void) {
+        slab_header* slab = slabs;
+        slabs = NULL;
+        while(slab != NULL) {
+            slab_header* next = slab->next;
+            free(slab);
+            slab = next;
+        }
+
+        recycled_records = NULL;
+        init_cache(&shared_cache);
+        live_records = 0;
+        slab_bytes = 0;
+    }
+
+    /*
+     * Bytes held by records in use. Allocations are counted in batches per
+     * thread, so this may lag behind by a few hundred records per thread.
+     */
+    jlong live_bytes(void) {
+        return live_records*record_size;
+    }
+
+    jlong peak_bytes(void) {
+        return peak_records*record_size;
+    }
+
+    /* Bytes taken from the system for slabs, until the pool is released. */
+    jlong reserved_bytes(void) {
+        return slab_bytes;
+    }
+};
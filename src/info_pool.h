@@ -0,0 +1,38 @@
+/*
+ * File:   info_pool.h
+ *
+ * A pool of fixed size records used for the agent's per-object access info.
+ * Records are carved out of large slabs by per-thread caches, and records
+ * freed from any thread (typically the object free callback during GC) are
+ * recycled through a lock-free list instead of going back to malloc, until
+ * the whole pool is released.
+ */
+#include "jvmti.h"
+#ifndef INFO_POOL_H
+#define	INFO_POOL_H
+
+namespace info_pool {
+    /*
+     * A per-thread allocation cache. Only its owning thread may allocate
+     * from it, so allocating needs no locking.
+     */
+    struct pool_cache {
+        void* free_records;
+        char* slab_cursor;
+        char* slab_end;
+        /* Allocations not yet added to the pool's live count. */
+        int pending_records;
+    };
+
+    void init_pool(size_t record_size);
+    void init_cache(pool_cache* cache);
+    void release_cache(pool_cache* cache);
+    void* allocate(pool_cache* cache);
+    void recycle(void* record);
+    void release_pool(void);
+    jlong live_bytes(void);
+    jlong peak_bytes(void);
+    jlong reserved_bytes(void);
+};
+
+#endif	/* INFO_POOL_H */
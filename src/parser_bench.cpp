@@ -0,0 +1,281 @@
+/*
+ * parser_bench
+ *
+ * Purpose: Times bin_info_parser in each of its modes on a pair of profiling
+ * files, for example ones written by profile_generator, and reports the
+ * throughput over both files and the peak resident memory of each run. Each
+ * run is a separate process writing to /dev/null, so the peak memory is the
+ * mode's own.
+ *
+ * Usage: parser_bench <bin_info_parser> <info file> <accesses file>
+ * [key=value ...], see show_usage().
+ */
+
+#include <cstdlib>
+#include <cstdio>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+
+/******************************************************************************/
+/* Declerations                                                               */
+/******************************************************************************/
+
+/* A parser mode, and the options selecting it after the record size. */
+struct parser_mode {
+    string name;
+    vector<string> options;
+};
+
+/* How long a run took and the most memory it held. */
+struct run_result {
+    bool ok;
+    double seconds;
+    long peak_rss_kb;
+};
+
+static string parser_path;
+static string info_file;
+static string accesses_file;
+static string mode_list = "load,stream,parallel,report";
+static int reader_threads = 4;
+static int repeat = 3;
+static string record_size = "16";
+static bool warm_cache = true;
+
+
+/******************************************************************************/
+/* Helper functions                                                           */
+/******************************************************************************/
+
+static double now_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec/1e9;
+}
+
+static long long file_size(const string& name) {
+    struct stat info;
+    if(stat(name.c_str(), &info) != 0) return -1;
+    return info.st_size;
+}
+
+/* Reads a file once, so the first timed mode does not pay for the disk. */
+static void read_file(const string& name) {
+    int fd = open(name.c_str(), O_RDONLY);
+    if(fd < 0) return;
+
+    vector<char> block(1 << 20);
+    while(read(fd, &block[0], block.size()) > 0) {
+    }
+    close(fd);
+}
+
+/* Runs the parser once in a mode, with its output going to /dev/null. */
+static run_result run_parser(const parser_mode& mode) {
+    run_result result = { false, 0, 0 };
+
+    vector<string> args;
+    args.push_back(parser_path);
+    args.push_back("a");
+    args.push_back(info_file);
+    args.push_back(accesses_file);
+    args.push_back("a");
+    args.push_back(record_size);
+    args.insert(args.end(), mode.options.begin(), mode.options.end());
+
+    vector<char*> argv;
+    for(size_t i = 0; i < args.size(); ++i) {
+        argv.push_back(const_cast<char*>(args[i].c_str()));
+    }
+    argv.push_back(NULL);
+
+    double start = now_seconds();
+    pid_t child = fork();
+    if(child < 0) return result;
+
+    if(child == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if(null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+        execv(argv[0], &argv[0]);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if(wait4(child, &status, 0, &usage) != child) return result;
+
+    result.seconds = now_seconds() - start;
+    result.peak_rss_kb = usage.ru_maxrss;
+    result.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    return result;
+}
+
+/* Looks up a mode by the name used in the 'modes' option. */
+static bool find_mode(const string& name, parser_mode* mode) {
+    mode->name = name;
+    mode->options.clear();
+    if(name.compare("load") == 0)
+        return true;
+    if(name.compare("stream") == 0) {
+        mode->options.push_back("s");
+        return true;
+    }
+    if(name.compare("parallel") == 0) {
+        ostringstream option;
+        option<<"j"<<reader_threads;
+        mode->options.push_back(option.str());
+        return true;
+    }
+    if(name.compare("report") == 0) {
+        mode->options.push_back("rcsv");
+        return true;
+    }
+    if(name.compare("report_json") == 0) {
+        mode->options.push_back("rjson");
+        return true;
+    }
+    return false;
+}
+
+
+/******************************************************************************/
+/* Options                                                                    */
+/******************************************************************************/
+
+static void show_usage() {
+    cout<<"\nUsage: parser_bench <bin_info_parser> <info file> "
+        <<"<accesses file> [key=value ...]"<<endl;
+    cout<<"  modes=<list>     comma separated modes out of load, stream, "
+        <<"parallel,"<<endl
+        <<"                   report and report_json "
+        <<"(load,stream,parallel,report)"<<endl;
+    cout<<"  threads=<n>      reader threads of the parallel mode (4)"<<endl;
+    cout<<"  repeat=<n>       runs per mode, the fastest is reported (3)"
+        <<endl;
+    cout<<"  record_size=<n>  record size passed to the parser (16)"<<endl;
+    cout<<"  warm=0|1         read the files once before timing (1)"<<endl;
+}
+
+/* Applies a 'key=value' option, returns false if it is unknown. */
+static bool set_bench_option(const string& key, const string& value) {
+    if(key.compare("modes") == 0)
+        mode_list = value;
+    else if(key.compare("threads") == 0)
+        reader_threads = atoi(value.c_str()) > 0 ? atoi(value.c_str()) : 1;
+    else if(key.compare("repeat") == 0)
+        repeat = atoi(value.c_str()) > 0 ? atoi(value.c_str()) : 1;
+    else if(key.compare("record_size") == 0)
+        record_size = value;
+    else if(key.compare("warm") == 0)
+        warm_cache = (value.compare("0") != 0);
+    else
+        return false;
+    return true;
+}
+
+
+/******************************************************************************/
+/* Bench                                                                      */
+/******************************************************************************/
+
+int main(int argc, char* argv[]) {
+    if(argc < 4) {
+        show_usage();
+        return 1;
+    }
+    parser_path.assign(argv[1]);
+    info_file.assign(argv[2]);
+    accesses_file.assign(argv[3]);
+
+    for(int i = 4; i < argc; ++i) {
+        string option(argv[i]);
+        size_t equals = option.find('=');
+        if(equals == string::npos ||
+           !set_bench_option(option.substr(0, equals),
+                             option.substr(equals + 1))) {
+            cout<<"Unknown option: "<<option<<endl;
+            show_usage();
+            return 1;
+        }
+    }
+
+    long long info_bytes = file_size(info_file);
+    long long accesses_bytes = file_size(accesses_file);
+    if(info_bytes < 0 || accesses_bytes < 0) {
+        cout<<"Cannot read the profiling files"<<endl;
+        return 1;
+    }
+    double megabytes = (info_bytes + accesses_bytes)/(1024.0*1024.0);
+
+    vector<parser_mode> modes;
+    size_t start = 0;
+    while(start <= mode_list.length()) {
+        size_t comma = mode_list.find(',', start);
+        if(comma == string::npos) comma = mode_list.length();
+
+        parser_mode mode;
+        string name = mode_list.substr(start, comma - start);
+        if(!name.empty()) {
+            if(!find_mode(name, &mode)) {
+                cout<<"Unknown parser mode: "<<name<<endl;
+                return 1;
+            }
+            modes.push_back(mode);
+        }
+        start = comma + 1;
+    }
+
+    if(warm_cache) {
+        read_file(info_file);
+        read_file(accesses_file);
+    }
+
+    cout<<"Parsing "<<fixed<<setprecision(1)<<megabytes<<" MB ("
+        <<info_bytes<<" bytes of object info, "<<accesses_bytes
+        <<" bytes of accesses), best of "<<repeat<<" runs"<<endl;
+    cout<<left<<setw(14)<<"mode"<<right<<setw(12)<<"seconds"
+        <<setw(12)<<"MB/s"<<setw(16)<<"peak RSS MB"<<endl;
+
+    int failures = 0;
+    for(size_t m = 0; m < modes.size(); ++m) {
+        run_result best = { false, 0, 0 };
+        long peak_rss_kb = 0;
+        for(int r = 0; r < repeat; ++r) {
+            run_result result = run_parser(modes[m]);
+            if(!result.ok) {
+                best.ok = false;
+                break;
+            }
+            if(!best.ok || result.seconds < best.seconds) best = result;
+            if(result.peak_rss_kb > peak_rss_kb)
+                peak_rss_kb = result.peak_rss_kb;
+        }
+
+        cout<<left<<setw(14)<<modes[m].name<<right;
+        if(!best.ok) {
+            cout<<"  the parser failed"<<endl;
+            ++failures;
+            continue;
+        }
+        cout<<setw(12)<<setprecision(3)<<best.seconds
+            <<setw(12)<<setprecision(1)<<megabytes/best.seconds
+            <<setw(16)<<peak_rss_kb/1024.0<<endl;
+    }
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,333 @@
+/*
+ * profile_generator
+ *
+ * Purpose: Writes synthetic ObjectInfo and ObjectAccesses files through the
+ * agent's own writer, so bin_info_parser can be measured on files of any
+ * size without profiling a program. Every object is shared, and its access
+ * sequence never names the same thread twice in a row, like the agent's.
+ * Entries are marked as writes at a given rate, and objects can be spread
+ * over made up allocation sites.
+ *
+ * Usage: profile_generator <info file> <accesses file> [key=value ...], see
+ * show_usage().
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "jvmti.h"
+#include "info_file_io.h"
+
+using namespace std;
+
+/******************************************************************************/
+/* Declerations                                                               */
+/******************************************************************************/
+
+/* How the lengths of access sequences are drawn. */
+enum length_distribution { LENGTHS_FIXED, LENGTHS_UNIFORM, LENGTHS_GEOMETRIC };
+
+/*
+ * Stop after this many objects, or once the files would hold size_limit
+ * bytes. 0 is no limit, without either 1000000 objects are written.
+ */
+static jlong object_count = -1;
+static jlong size_limit = 0;
+
+/* Geometric lengths are cut off here. */
+const int max_sequence_length = 1 << 20;
+
+static int class_count = 1000;
+static bool zipf_classes = false;
+static int thread_count = 16;
+static length_distribution lengths = LENGTHS_GEOMETRIC;
+static int min_length = 2;
+static int max_length = 8;
+static double mean_length = 4;
+static int format_version = 2;
+static int write_percent = 0;
+
+/* Allocation sites objects are drawn from, 0 writes no sites. */
+static int site_count = 0;
+const int site_depth = 3;
+static unsigned long long random_state = 0x2545F4914F6CDD1DULL;
+
+/* Class signatures, and for zipf classes their cumulative weights. */
+static vector<string> signatures;
+static vector<double> class_weights;
+
+
+/******************************************************************************/
+/* Helper functions                                                           */
+/******************************************************************************/
+
+/* xorshift64*. */
+static unsigned long long next_random() {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 2685821657736338717ULL;
+}
+
+/* A uniform double in [0, 1). */
+static double next_unit() {
+    return (next_random() >> 11) * (1.0/9007199254740992.0);
+}
+
+/* Parses a count with an optional K, M or G suffix, in powers of 1024. */
+static jlong parse_size(const string& value) {
+    jlong size = atoll(value.c_str());
+    char suffix = value.empty() ? 0 : value[value.length() - 1];
+    if(suffix == 'K' || suffix == 'k') size <<= 10;
+    else if(suffix == 'M' || suffix == 'm') size <<= 20;
+    else if(suffix == 'G' || suffix == 'g') size <<= 30;
+    return size;
+}
+
+/* Parses 'fixed:<n>', 'uniform:<min>:<max>' or 'geometric:<mean>'. */
+static bool parse_lengths(const string& value) {
+    size_t colon = value.find(':');
+    if(colon == string::npos) return false;
+
+    string kind = value.substr(0, colon);
+    string args = value.substr(colon + 1);
+    if(kind.compare("fixed") == 0) {
+        lengths = LENGTHS_FIXED;
+        min_length = max_length = atoi(args.c_str());
+    }
+    else if(kind.compare("uniform") == 0) {
+        size_t second = args.find(':');
+        if(second == string::npos) return false;
+        lengths = LENGTHS_UNIFORM;
+        min_length = atoi(args.substr(0, second).c_str());
+        max_length = atoi(args.substr(second + 1).c_str());
+    }
+    else if(kind.compare("geometric") == 0) {
+        lengths = LENGTHS_GEOMETRIC;
+        mean_length = atof(args.c_str());
+        if(mean_length < 2) return false;
+    }
+    else {
+        return false;
+    }
+    // A shared object was touched by two threads at least.
+    return min_length >= 2 && max_length >= min_length;
+}
+
+/*
+ * Draws the length of an access sequence. Geometric lengths start at 2, so
+ * their mean is mean_length, with a long tail of hot objects.
+ */
+static int next_length() {
+    if(lengths == LENGTHS_FIXED)
+        return min_length;
+    if(lengths == LENGTHS_UNIFORM)
+        return min_length + next_random() % (max_length - min_length + 1);
+
+    // Inverse transform of the number of failures before a success.
+    double p = 1.0/(mean_length - 1);
+    if(p >= 1) return 2;
+    double failures = floor(log(1 - next_unit())/log(1 - p));
+    return 2 + (int) min(failures, (double) max_sequence_length);
+}
+
+/* Draws a class ID, uniformly or following Zipf's law. */
+static jint next_class() {
+    if(!zipf_classes) return next_random() % class_count;
+
+    double u = next_unit()*class_weights.back();
+    return lower_bound(class_weights.begin(), class_weights.end(), u) -
+           class_weights.begin();
+}
+
+/*
+ * Fills an access sequence in which no thread follows itself, marking
+ * write_percent of the entries as writes.
+ */
+static void next_accesses(vector<jint>* threads, int length) {
+    threads->resize(length);
+    (*threads)[0] = 1 + next_random() % thread_count;
+    for(int i = 1; i < length; ++i) {
+        // Draws from the other threads, skipping over the previous one.
+        jint thread = 1 + next_random() % (thread_count - 1);
+        if(thread >= (*threads)[i - 1]) ++thread;
+        (*threads)[i] = thread;
+    }
+    if(write_percent == 0) return;
+
+    for(int i = 0; i < length; ++i) {
+        if((int) (next_random() % 100) < write_percent)
+            (*threads)[i] |= profiling_io::ACCESS_WRITE;
+    }
+}
+
+/* Bytes a record adds to the files, in the selected format. */
+static jlong record_bytes(const string& signature, int length) {
+    if(format_version == 1)
+        return 12 + signature.length() + 12 + 8*length;
+    return (site_count > 0 ? 24 : 20) + 12 + 4*length;
+}
+
+
+/******************************************************************************/
+/* Options                                                                    */
+/******************************************************************************/
+
+static void show_usage() {
+    cout<<"\nUsage: profile_generator <info file> <accesses file> "
+        <<"[key=value ...]"<<endl;
+    cout<<"  objects=<n>      shared objects to write (1000000)"<<endl;
+    cout<<"  size=<bytes>     stop once the files hold about this much, "
+        <<"K, M and G suffixes"<<endl
+        <<"                   allowed, e.g. size=20G (no limit)"<<endl;
+    cout<<"  classes=<n>      distinct classes (1000)"<<endl;
+    cout<<"  class_dist=uniform|zipf"<<endl
+        <<"                   how objects spread over classes (uniform)"<<endl;
+    cout<<"  threads=<n>      distinct threads, at least 2 (16)"<<endl;
+    cout<<"  lengths=fixed:<n>|uniform:<min>:<max>|geometric:<mean>"<<endl
+        <<"                   access sequence lengths (geometric:4)"<<endl;
+    cout<<"  writes=<percent> accesses that are writes (0)"<<endl;
+    cout<<"  sites=<n>        allocation sites of the objects, version 2 "
+        <<"only (none)"<<endl;
+    cout<<"  format=1|2       file format version (2)"<<endl;
+    cout<<"  seed=<n>         random seed"<<endl;
+}
+
+/* Applies a 'key=value' option, returns false if it is unknown or invalid. */
+static bool set_generator_option(const string& key, const string& value) {
+    if(key.compare("objects") == 0)
+        object_count = parse_size(value);
+    else if(key.compare("size") == 0)
+        size_limit = parse_size(value);
+    else if(key.compare("classes") == 0)
+        class_count = max(1, atoi(value.c_str()));
+    else if(key.compare("threads") == 0)
+        thread_count = max(2, atoi(value.c_str()));
+    else if(key.compare("lengths") == 0)
+        return parse_lengths(value);
+    else if(key.compare("sites") == 0)
+        site_count = max(0, atoi(value.c_str()));
+    else if(key.compare("writes") == 0)
+        write_percent = min(100, max(0, atoi(value.c_str())));
+    else if(key.compare("seed") == 0)
+        random_state ^= strtoull(value.c_str(), NULL, 10);
+    else if(key.compare("class_dist") == 0) {
+        if(value.compare("zipf") == 0)
+            zipf_classes = true;
+        else if(value.compare("uniform") == 0)
+            zipf_classes = false;
+        else
+            return false;
+    }
+    else if(key.compare("format") == 0) {
+        format_version = atoi(value.c_str());
+        return format_version == 1 || format_version == 2;
+    }
+    else
+        return false;
+    return true;
+}
+
+
+/******************************************************************************/
+/* Generator                                                                  */
+/******************************************************************************/
+
+int main(int argc, char* argv[]) {
+    if(argc < 3) {
+        show_usage();
+        return 1;
+    }
+
+    for(int i = 3; i < argc; ++i) {
+        string option(argv[i]);
+        size_t equals = option.find('=');
+        if(equals == string::npos ||
+           !set_generator_option(option.substr(0, equals),
+                                 option.substr(equals + 1))) {
+            cout<<"Invalid option: "<<option<<endl;
+            show_usage();
+            return 1;
+        }
+    }
+    if(random_state == 0) random_state = 1;
+    if(object_count < 0) object_count = (size_limit > 0 ? 0 : 1000000);
+
+    for(int i = 0; i < class_count; ++i) {
+        ostringstream signature;
+        signature<<"Lgenerated/package"<<i % 97<<"/Class"<<i<<";";
+        signatures.push_back(signature.str());
+
+        // Weight 1/(i + 1), so class 0 is the most common.
+        double weight = 1.0/(i + 1);
+        class_weights.push_back(class_weights.empty() ?
+                                    weight : class_weights.back() + weight);
+    }
+
+    string info_file(argv[1]), accesses_file(argv[2]);
+    profiling_io::change_profiling_files(&info_file, &accesses_file);
+    profiling_io::set_output_format(format_version);
+    profiling_io::set_object_sites(site_count > 0);
+    profiling_io::set_write_buffer_size(1024*1024);
+    profiling_io::open_write();
+
+    profiling_io::record_buffer info_records, access_records;
+    profiling_io::init_buffer(&info_records);
+    profiling_io::init_buffer(&access_records);
+
+    vector<jint> threads;
+    jlong objects = 0, accesses = 0, bytes = 0;
+    while((object_count == 0 || objects < object_count) &&
+          (size_limit == 0 || bytes < size_limit)) {
+        jlong object_ID = objects + 1;
+        jint class_ID = next_class();
+        int length = next_length();
+        next_accesses(&threads, length);
+        jint site_ID = (site_count > 0 ? 1 + next_random() % site_count : 0);
+
+        if(profiling_io::buffer_object_info(&info_records, object_ID,
+                                            16 + 8*(next_random() % 32),
+                                            class_ID, site_ID,
+                                            signatures[class_ID].c_str()))
+            profiling_io::write_buffer(&info_records,
+                                       profiling_io::OBJECT_INFO_RECORDS);
+        if(profiling_io::buffer_access_info(&access_records, object_ID,
+                                            &threads[0], length))
+            profiling_io::write_buffer(&access_records,
+                                       profiling_io::OBJECT_ACCESSES_RECORDS);
+
+        ++objects;
+        accesses += length;
+        bytes += record_bytes(signatures[class_ID], length);
+    }
+
+    profiling_io::write_buffer(&info_records,
+                               profiling_io::OBJECT_INFO_RECORDS);
+    profiling_io::write_buffer(&access_records,
+                               profiling_io::OBJECT_ACCESSES_RECORDS);
+    profiling_io::free_buffer(&info_records);
+    profiling_io::free_buffer(&access_records);
+
+    // Site k is allocated by Factory<k>, called from site_depth - 1 callers.
+    vector<profiling_io::site_record> sites(site_count);
+    for(int k = 0; k < site_count; ++k) {
+        sites[k].site_ID = k + 1;
+        for(int f = 0; f < site_depth; ++f) {
+            ostringstream frame;
+            frame<<"Lgenerated/Factory"<<(k + f) % site_count<<";.make"<<f
+                 <<"()Ljava/lang/Object;:"<<10*(f + 1);
+            sites[k].frames.push_back(frame.str());
+        }
+    }
+    profiling_io::write_site_table(sites);
+    profiling_io::close_write();
+
+    cout<<"Wrote "<<objects<<" objects of "<<class_count<<" classes with "
+        <<accesses<<" accesses by "<<thread_count<<" threads, about "
+        <<(bytes >> 20)<<" MB in format "<<format_version<<endl;
+    return 0;
+}
@@ -19,6 +19,17 @@ void show_usage() {
     // sample: ./bin_info_parser a testInfo testAccesses a 10 >parsed_info
 
     cout<<"\nUsage: "<<"add details"<<endl;
+    cout<<"Pass 's' after the record size to stream the files instead of "
+        <<"loading them, for dumps that do not fit in memory."<<endl;
+    cout<<"Pass 'j<threads>' after the record size to decode the accesses "
+        <<"file on that many threads, e.g. j8."<<endl;
+    cout<<"Pass 'rcsv' or 'rjson' after the record size to print a summary "
+        <<"of the shared objects per class instead of every object."<<endl;
+    cout<<"Pass 'fields' after the record size to rank the watched fields "
+        <<"by their cross-thread touches, as CSV or with 'rjson' as JSON."
+        <<endl;
+    cout<<"Pass 'sites' after the record size to rank the allocation sites "
+        <<"by their shared bytes, as CSV or with 'rjson' as JSON."<<endl;
 }
 
 int main(int argc, char* argv[]) {
@@ -27,7 +38,7 @@ int main(int argc, char* argv[]) {
     int max_record_size = 0;
     
     if(argc > 1) {
-        if(argc >6)
+        if(argc > 8 || argc < 6)
             show_usage();
         else {
             // a: info  & accesses, i: info only
@@ -50,7 +61,50 @@ int main(int argc, char* argv[]) {
             profiling_io::set_max_record_size(max_record_size);
             profiling_io::set_object_class(obj_class);
             profiling_io::change_profiling_files(&obj_info, &obj_accesses);
-            profiling_io::output_shared_objects_info();
+
+            // 's': stream the files, keeping only the matched objects.
+            // 'j<threads>': decode the accesses file on several threads.
+            // 'rcsv', 'rjson': summarize the shared objects per class.
+            // 'fields': rank the fields by sharing.
+            // 'sites': rank the allocation sites by shared bytes.
+            bool stream = false;
+            bool report = false;
+            bool fields = false;
+            bool sites = false;
+            profiling_io::report_format format = profiling_io::REPORT_CSV;
+            for(int i = 6; i < argc; ++i) {
+                if(string(argv[i]) == "sites")
+                    sites = true;
+                else if(*argv[i] == 's')
+                    stream = true;
+                else if(*argv[i] == 'j')
+                    profiling_io::set_reader_threads(
+                            str_to_int(string(argv[i] + 1)));
+                else if(string(argv[i]) == "fields")
+                    fields = true;
+                else if(string(argv[i]) == "rcsv")
+                    report = true;
+                else if(string(argv[i]) == "rjson") {
+                    report = true;
+                    format = profiling_io::REPORT_JSON;
+                }
+                else {
+                    cout<<"\nUnknown option: "<<argv[i]<<endl;
+                    show_usage();
+                    return 1;
+                }
+            }
+
+            if(fields)
+                profiling_io::report_fields_info(format);
+            else if(sites)
+                profiling_io::report_sites_info(format);
+            else if(report)
+                profiling_io::report_shared_objects_info(format);
+            else if(stream)
+                profiling_io::stream_shared_objects_info();
+            else
+                profiling_io::output_shared_objects_info();
             }
     }
     else {
@@ -10,14 +10,26 @@
   * Author: Nosheen Zaza
   */
 
+#include <algorithm>
+#include <cmath>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <fstream>
 #include <list>
-#include <set>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <time.h>
+#include <unistd.h>
 #include "jvmti.h"
+#include "access_sequence.h"
+#include "class_rewriter.h"
 #include "info_file_io.h"
+#include "info_pool.h"
 
 //#define DEBUG
 //#define DEBUG_SHARED
@@ -44,17 +56,112 @@ string *field_name = NULL;
  */
 jrawMonitorID lock;
 
+/* The environment the agent was loaded with. */
+jvmtiEnv* jvmti = NULL;
+
+/*
+ * Serializes writes to the output files. It is never held while calling into
+ * JVMTI, so it is safe to take from the object free callback.
+ */
+jrawMonitorID io_lock;
+
+/*
+ * A full batch of records, waiting to be written by the writer thread.
+ */
+struct pending_batch {
+    profiling_io::record_buffer records;
+    profiling_io::record_file file;
+    pending_batch* next;
+};
+
+/*
+ * While the writer thread runs, producers hand it full batches through this
+ * queue instead of writing themselves, so no application thread waits on
+ * the disk. The queue, writer_running, and access_records are protected by
+ * write_lock, which is also where the writer waits for work.
+ */
+pending_batch* pending_batches = NULL;
+pending_batch* pending_batches_tail = NULL;
+bool writer_running = false;
+jrawMonitorID write_lock;
+
+/*
+ * Access records of objects that were freed or recorded on unload. Freed
+ * objects are reported on GC threads that have no thread state, so they share
+ * this batch.
+ */
+profiling_io::record_buffer access_records;
+
+/*
+ * How field events are synchronized. In SYNC_MONITOR mode every event holds
+ * the callbacks lock. In SYNC_ATOMIC mode events only take it to tag new
+ * objects, and the ownership of already tagged objects is updated with atomic
+ * transitions, so threads touching their own objects never wait for each
+ * other. Selected with the 'sync=monitor|atomic' agent option.
+ */
+enum sync_mode { SYNC_MONITOR, SYNC_ATOMIC };
+sync_mode event_sync = SYNC_MONITOR;
+
+/*
+ * How field accesses are observed. ENGINE_WATCH relies on JVMTI field watch
+ * events, which keep the watched code in the interpreter. ENGINE_BYTECODE
+ * rewrites classes as they load so that getfield and putfield call the natives
+ * of the recorder class, and the rewritten code can still be compiled.
+ * Selected with the 'engine=watch|bytecode' agent option.
+ */
+enum tracking_engine { ENGINE_WATCH, ENGINE_BYTECODE };
+tracking_engine engine = ENGINE_WATCH;
+
+/*
+ * Which objects are tracked. TRACK_ALL tags every object a thread touches.
+ * TRACK_SAMPLED only tracks the objects the VM samples at allocation, so
+ * touches of all other objects end at reading their tag, and the summary
+ * scales the sampled objects up to estimates for all objects. Selected with
+ * the 'tracking=all|sampled' agent option.
+ */
+enum tracking_mode { TRACK_ALL, TRACK_SAMPLED };
+tracking_mode tracking = TRACK_ALL;
+
+/*
+ * Set once the recorder class is defined and its natives are bound. Classes
+ * loaded before that are not rewritten, as they could not link against it.
+ */
+volatile bool recorder_ready = false;
+
 /*
- * To make deletion more effecient, we use this flag so we do not delete
- * elements from the set if the program is terminating.
+ * True while the VM is in the live phase. Set by the VM init and VM death
+ * callbacks, so events do not need to ask JVMTI for the phase.
  */
-bool program_running = true;
+volatile bool live_phase = false;
 
 /*
  * Special values for thread id, meaning no thread id was set before. Used as an
  * initial value.
  */
-const jlong NO_THREAD = -2;
+const jint NO_THREAD = -2;
+
+/*
+ * Values of thread_access_info::state. An object starts local, and
+ * STATE_LOCAL_WRITTEN once its owner wrote to it. The thread that wins the
+ * transition to shared holds STATE_SHARING while it builds the access list,
+ * and a thread appending to the list of a shared object holds
+ * STATE_SHARED_LOCKED for the duration of the append. A shared object is in
+ * one of the last three states, by how many of its threads wrote to it, so
+ * STATE_SHARED_READ_ONLY plus the number of writers, up to two.
+ */
+const jint STATE_LOCAL = 0;
+const jint STATE_LOCAL_WRITTEN = 1;
+const jint STATE_SHARING = 2;
+const jint STATE_SHARED_LOCKED = 3;
+const jint STATE_SHARED_READ_ONLY = 4;
+const jint STATE_SHARED_SINGLE_WRITER = 5;
+const jint STATE_SHARED_MULTI_WRITER = 6;
+
+/* Shared objects are counted by their writers, see sharing_kind_names. */
+const int SHARING_KINDS = 3;
+const char* const sharing_kind_names[SHARING_KINDS] = {
+    "read_only", "single_writer", "multi_writer"
+};
 
 /*
  * a structure that holds information about an object's thread locality.
@@ -62,33 +169,426 @@ const jlong NO_THREAD = -2;
  */
 struct thread_access_info {
     jlong object_ID;
-    bool is_thread_local : 1;
+    /* The state is short so the site ID fits next to it. */
+    volatile jshort state;
+    /* The allocation site of the object, 0 if it is not known. */
+    unsigned short site_ID;
+    /* Number of entries in accesses, once the object is shared. */
+    jint accesses_length;
     /*
      * When the object is local, thread_ID holds the ID of the only thread
      * that touched the object. When it is shared, accesses holds the IDs of
      * the sequence of threads accessing an object.
      */
     union {
-    jlong thread_ID;
-    list<jlong> *accesses;
+    volatile jint thread_ID;
+    access_sequence accesses;
     };
 };
 
 /* To make things look a bit nicer */
 typedef struct thread_access_info *ThreadAccessInfo;
 
+/*
+ * The signature and output ID of a class, resolved once per class. A class's
+ * tag points to its class_info with CLASS_TAG set, which tells it apart from
+ * the access info of tracked objects, those are always 8 byte aligned.
+ * Records waiting to be written point to the signature, so class infos are
+ * only freed on unload.
+ */
+struct field_info;
+
+struct class_info {
+    jint class_ID;
+    char* signature;
+    /* Number of objects of the class that became shared. */
+    volatile jlong shared_count;
+    /*
+     * The watched fields of the class, added when a class of its signature
+     * is prepared and before the fields are watched. Fields are only added,
+     * events read them without the lock.
+     */
+    field_info* volatile fields;
+    class_info* next;
+};
+
+/*
+ * A watched instance field and its sharing counters. Field IDs given by the
+ * VM are only unique within their class, so fields are interned per class
+ * and numbered by field_ID for the output. The counters are only touched
+ * when a thread touches an object another thread touched last, touches of
+ * local objects never look the field up.
+ */
+struct field_info {
+    jfieldID field;
+    jint field_ID;
+    class_info* klass;
+    char* name;
+    /* Touches of objects last touched by another thread. */
+    volatile jlong cross_thread_touches;
+    /* Objects that became shared by a touch of the field, and their bytes */
+    volatile jlong shared_objects;
+    volatile jlong shared_bytes;
+    field_info* next;
+};
+
+/*
+ * The field touched at a bytecode, by the method and location of the
+ * bytecode and the field ID. The class of an event is a local reference that
+ * cannot be compared without calling the VM, so events find their field
+ * through the bytecode instead, and only the first event of a bytecode
+ * resolves the class. Bytecodes are only added, readers find them without
+ * the lock.
+ */
+struct field_site {
+    jmethodID method;
+    jlocation location;
+    jfieldID field;
+    /* NULL if the field is not watched. */
+    field_info* info;
+    field_site* volatile next;
+};
+
+const int field_site_buckets_count = 4096;
+field_site* volatile field_site_buckets[field_site_buckets_count];
+
+/* Number of field sites. Protected by the callbacks lock. */
+jint field_sites_count = 0;
+
+const jlong CLASS_TAG = 1;
+
+/*
+ * Tag of a sampled object that was not touched yet, holding the ID of its
+ * allocation site shifted past SITE_TAG, and its size past the site ID. The
+ * object's access info takes the site ID over when the object is first
+ * touched.
+ */
+const jlong SITE_TAG = 2;
+const int SITE_TAG_SIZE_SHIFT = 18;
+
+/* All class infos, and the count of them. Protected by the callbacks lock. */
+class_info* class_infos = NULL;
+jint class_infos_count = 0;
+
+/* Number of field infos made so far. Protected by the callbacks lock. */
+jint field_infos_count = 0;
+
+/* How many fields the summary lists, by their cross-thread touches. */
+const size_t summary_top_fields = 10;
+
+/*
+ * Infos of classes whose Class object was already tagged as a tracked object
+ * before its class info was made, by signature. Protected by the callbacks
+ * lock.
+ */
+map<string, class_info*> untagged_class_infos;
+
+/*
+ * Allocation sites, selected with the 'sites=<depth>' agent option. Sampled
+ * allocations capture the site_depth innermost frames of their stack, which
+ * are interned into a hash table of sites. Sites are only added, readers
+ * find them without the lock, and the frames are only resolved to names
+ * once tracking stops, so a sample costs a stack walk and a lookup.
+ */
+const jint max_site_depth = 16;
+struct site_info {
+    jint site_ID;
+    jint depth;
+    unsigned long long hash;
+    jvmtiFrameInfo frames[max_site_depth];
+    /* The frames resolved to names, once tracking stops. */
+    vector<string> frame_names;
+    /* Objects of the site that became shared, and their bytes */
+    volatile jlong shared_objects;
+    volatile jlong shared_bytes;
+    site_info* volatile next;
+};
+
+jint site_depth = 0;
+
+/*
+ * Mean bytes a thread allocates between sampled allocations, set with the
+ * 'sample_interval=<bytes>' agent option. The VM has one interval, shared by
+ * allocation sites and sampled tracking. allocations_sampled is set if the
+ * VM can sample allocations, otherwise only those the VM makes itself are
+ * posted, and allocation_events once the events are enabled.
+ */
+jint sample_interval = 64*1024;
+bool allocations_sampled = false;
+bool allocation_events = false;
+
+/* Site IDs are kept in 16 bits, the site of later stacks is not known. */
+const jint max_sites = 65535;
+const int site_buckets_count = 4096;
+site_info* volatile site_buckets[site_buckets_count];
+site_info* sites_by_ID[max_sites + 1];
+
+/* The number of sites and of sampled allocations. */
+volatile jint sites_count = 0;
+volatile jlong sampled_allocations = 0;
+jrawMonitorID sites_lock;
+
+/* How many sites the summary lists, by their shared bytes. */
+const size_t summary_top_sites = 10;
+
 struct thread_info {
-    jlong thread_ID;
+    jint thread_ID;
     string* thread_name;
 };
 
 list<thread_info> thread_names;
 
 /*
- * A set used to track all shared objects, so we can collect their information
- * upon terminateion.
+ * The callbacks the agent's own overhead is measured for, with the
+ * 'overhead=on' agent option. CALLBACK_RECORDER stands for the recorder
+ * natives of the bytecode engine.
+ */
+enum agent_callback {
+    CALLBACK_FIELD_ACCESS, CALLBACK_FIELD_MODIFICATION, CALLBACK_RECORDER,
+    CALLBACK_METHOD_ENTRY, CALLBACK_OBJECT_FREE, CALLBACK_CLASS_PREPARE,
+    CALLBACK_CLASS_FILE_LOAD_HOOK, CALLBACK_THREAD_START, CALLBACK_THREAD_END,
+    CALLBACK_OBJECT_ALLOC, CALLBACK_KINDS
+};
+
+const char* const callback_names[CALLBACK_KINDS] = {
+    "field_access", "field_modification", "recorder", "method_entry",
+    "object_free", "class_prepare", "class_file_load_hook", "thread_start",
+    "thread_end", "object_alloc"
+};
+
+/*
+ * Callback durations are counted in buckets of powers of two nanoseconds,
+ * bucket i holds those of 2^i up to 2^(i+1) ns, the last one all longer.
+ */
+const int overhead_buckets = 24;
+
+/*
+ * Horvitz-Thompson sums over sampled objects, each weighted by the inverse
+ * of the probability p that the VM sampled it: the estimated objects, the
+ * estimated bytes, and the variances of both estimates, which sum
+ * (1 - p)/p^2 times the squared object count or size.
+ */
+struct estimate_sums {
+    volatile double objects;
+    volatile double bytes;
+    volatile double objects_variance;
+    volatile double bytes_variance;
+};
+
+/*
+ * Sharing counters, kept in shards. A thread with a state counts into the
+ * shard in its state without atomics, so the hot path never writes a cache
+ * line other threads write. Events that come without a thread state count
+ * into global_statistics atomically. The totals are the sum of all shards,
+ * which snapshots read without stopping the counting threads.
+ */
+struct statistics_shard {
+    /* Number of shared objects */
+    volatile jlong shared_objects_count;
+
+    /* Number of shared objects due to being touched by the garbage collector */
+    volatile jlong gc_shared_objects_count;
+
+    /* Number of shared objects due to being touched by the finalizer */
+    volatile jlong finalizer_shared_objects_count;
+
+    /* Total number of objects tagged and profiled */
+    volatile jlong total_objects_count;
+
+    /*
+     * Total memory occupied by objects tagged and profiled in bytes, only
+     * counted when sizes are exact.
+     */
+    volatile jlong total_objects_memory;
+
+    /* Objects measured when sizes are sampled, and their memory in bytes */
+    volatile jlong sampled_objects_count;
+    volatile jlong sampled_objects_memory;
+
+    /*
+     * Total memory occupied by objects shared in bytes. This does not include
+     * the objects marked as GC shared or finalizer shared.
+     */
+    volatile jlong shared_objects_memory;
+
+    /*
+     * Shared objects and their memory by how many threads wrote to them,
+     * indexed by the shared state minus STATE_SHARED_READ_ONLY. Objects move
+     * between these as threads write to them.
+     */
+    volatile jlong sharing_kind_count[SHARING_KINDS];
+    volatile jlong sharing_kind_memory[SHARING_KINDS];
+
+    /*
+     * Estimates of the touched and the shared objects, only counted when
+     * tracking is sampled. Sampled objects are only tracked by threads with
+     * a state, so these are never counted into the global shard.
+     */
+    estimate_sums tracked_estimate;
+    estimate_sums shared_estimate;
+
+    /*
+     * Calls of each callback, the nanoseconds spent in them and their
+     * histogram, and the entries to the callbacks lock with the nanoseconds
+     * spent waiting for it. Only counted when the overhead is measured.
+     */
+    volatile jlong callback_calls[CALLBACK_KINDS];
+    volatile jlong callback_nanos[CALLBACK_KINDS];
+    volatile jlong callback_histogram[CALLBACK_KINDS][overhead_buckets];
+    volatile jlong lock_entries;
+    volatile jlong lock_wait_nanos;
+
+    statistics_shard* next;
+};
+
+/*
+ * Per-thread state, kept in the JVMTI thread local storage of every thread
+ * that touches a watched field. The thread's identity is resolved once when
+ * the state is created. Object info records produced by a thread are batched
+ * here and handed to the writer once the batch is full.
+ */
+struct thread_state {
+    /*
+     * A small number identifying the thread, the ID recorded in objects'
+     * access info. Threads are numbered from 1 in the order they are first
+     * seen.
+     */
+    jint thread_ID;
+    /* Objects touched by the finalizer thread are never marked shared. */
+    bool is_finalizer;
+    /* Access info records for the objects this thread tags first. */
+    info_pool::pool_cache info_cache;
+    profiling_io::record_buffer object_info_records;
+    /* Counters of the objects this thread tags and shares. */
+    statistics_shard statistics;
+    thread_state* next;
+};
+
+/* All live thread states, so pending records can be flushed on unload. */
+thread_state* thread_states = NULL;
+
+/*
+ * Class filters from the 'include=' and 'exclude=' agent options, in the
+ * internal form used by class signatures, e.g. "com/foo/Bar", where a
+ * trailing star matches any suffix.
+ * A class is watched if it matches no exclude pattern, and matches an include
+ * pattern when there are any.
+ */
+vector<string> include_patterns;
+vector<string> exclude_patterns;
+
+/* Number of classes whose fields are watched, and of those filtered out */
+jlong watched_classes_count = 0;
+jlong filtered_classes_count = 0;
+
+/* Number of fields watched in those classes */
+jlong watched_fields_count = 0;
+
+/* Number of classes and methods rewritten by the bytecode engine */
+jlong instrumented_classes_count = 0;
+jlong instrumented_methods_count = 0;
+
+/*
+ * Field watches can be duty cycled: watched for duty_on_millis out of every
+ * duty_period_millis, selected with the 'duty_cycle=<on>/<period>' agent
+ * option. A period of 0 keeps the watches on for the whole run.
+ */
+jlong duty_on_millis = 0;
+jlong duty_period_millis = 0;
+
+/*
+ * Sharing statistics can be snapshotted while the VM runs, selected with the
+ * 'snapshot=<ms>' agent option. Every snapshot_millis a line with the
+ * counters and the snapshot_top_classes classes with the most shared objects
+ * is appended to snapshot_target, or sent to it if it has the form
+ * 'unix:<socket path>'.
+ */
+jlong snapshot_millis = 0;
+string snapshot_target = "ThreadLocalitySnapshots";
+int snapshot_top_classes = 10;
+jrawMonitorID snapshot_lock;
+
+/*
+ * Profiling can be bounded to a window of profile_millis, selected with the
+ * 'duration=<seconds>' agent option and counted from VM init, or from the
+ * attach for an agent attached to a running VM. When the window closes the
+ * watches are cleared, the results are written and all tracking state is
+ * released, while the VM keeps running.
+ */
+jlong profile_millis = 0;
+
+/* Set when the agent was attached to a running VM. */
+bool attached = false;
+
+/*
+ * Set once the agent started. Its state is set up once per VM and not reset
+ * when a window closes, so attaching again is refused.
  */
-set<jlong> shared_objects_tags;
+bool agent_started = false;
+
+/*
+ * Set by whoever stops tracking first, the closing window or VM death, and
+ * results_written once the results are out. Waiters use window_lock.
+ */
+volatile int tracking_stopped = 0;
+volatile bool results_written = false;
+jrawMonitorID window_lock;
+
+/*
+ * A field that can have its watches switched on and off. The class is held
+ * through a weak reference so recording it does not keep it from unloading.
+ */
+struct watched_field {
+    jweak klass;
+    jfieldID field;
+};
+
+/*
+ * Every watchable field, only recorded when watches are duty cycled. Along
+ * with watches_enabled it is protected by watch_lock.
+ */
+vector<watched_field> watched_fields;
+jrawMonitorID watch_lock;
+
+/* Whether the watches are currently installed. */
+bool watches_enabled = true;
+
+/* Set when the VM dies, tells agent threads to finish. */
+volatile bool agent_threads_stopping = false;
+
+/*
+ * Agent threads reading the tracking state, the duty cycle and snapshot
+ * threads. Protected by watch_lock, stop_tracking waits for them to finish.
+ */
+jint agent_threads_running = 0;
+
+/*
+ * Callbacks that use the tracking state count themselves in flight, so the
+ * state is only released once the last of them returned. Disabling an event
+ * does not wait for the callbacks already running. The counts are striped
+ * over cache lines by thread, so events of different threads do not write
+ * the same line. Threads are numbered as they first count, past
+ * in_flight_stripes threads share stripes, so stripes are always changed
+ * atomically.
+ */
+const int in_flight_stripes = 64;
+struct in_flight_count {
+    volatile jint count;
+    char padding[64 - sizeof(jint)];
+};
+in_flight_count callbacks_in_flight[in_flight_stripes];
+volatile jint in_flight_threads = 0;
+__thread int in_flight_stripe = -1;
+
+/* Nanoseconds the watches were on during the live phase, and when they were
+ * last switched on. */
+jlong watched_nanos = 0;
+jlong watch_window_start = 0;
+
+/* Start and end of the live phase in JVMTI time, in nanoseconds. */
+jlong live_start_nanos = 0;
+jlong live_end_nanos = 0;
+
 
 
 
@@ -96,26 +596,43 @@ set<jlong> shared_objects_tags;
 /* Counters to generate statistics                                            */
 /******************************************************************************/
 
-/* Number of shared objects */
-jlong shared_objects_count = 0;
+statistics_shard global_statistics;
 
-/* Number of shared objects due to being touched by the garbage collector */
-jlong gc_shared_objects_count = 0;
+/* Counts of threads that ended, folded in when their state is released. */
+statistics_shard retired_statistics;
 
-/* Number of shared objects due to being touched by the finalizer */
-jlong finalizer_shared_objects_count = 0;
-
-/* Total number of objects tagged and profiled */
-jlong total_objects_count = 0;
+/*
+ * How the memory of tracked objects is accounted, selected with the
+ * 'sizes=exact|heap|sampled' agent option. Exact sizes measure every object
+ * as it is tagged. Heap sizes only add up the tracked objects still alive at
+ * VM death, found by the heap walk that records the shared ones. Sampled
+ * sizes measure one in size_sample_interval objects a thread tags and scale
+ * their mean up to all tracked objects.
+ */
+enum size_accounting { SIZES_EXACT, SIZES_HEAP, SIZES_SAMPLED };
+size_accounting sizes = SIZES_EXACT;
+jlong size_sample_interval = 64;
 
-/* Total memory occupied by objects tagged and profiled in bytes */
-jlong total_objects_memory = 0;
+/* Memory of the tracked objects the heap walk found, in bytes. */
+jlong live_objects_memory = 0;
 
 /*
- * Total memory occupied by objects shared in bytes. This does not include the
- * objects marked as GC shared or finalizer shared.
+ * Whether the agent times its own callbacks and its waits for the callbacks
+ * lock, selected with the 'overhead=on' agent option. The times are added to
+ * the statistics shards, so measuring costs two clock reads per callback and
+ * no shared writes.
  */
-jlong shared_objects_memory = 0;
+bool measure_overhead = false;
+
+/* The shards of live thread states. Protected by statistics_lock. */
+statistics_shard* statistics_shards = NULL;
+jrawMonitorID statistics_lock;
+
+/* Bytes held by access sequences that outgrew their inline storage */
+volatile jlong access_lists_memory = 0;
+
+/* The most access_lists_memory has been at any time */
+volatile jlong peak_access_lists_memory = 0;
 
 /* Memory occupied byt the JVM objects (does not include native code memory)*/
 jlong vm_objects_memory = 0;
@@ -128,6 +645,7 @@ jlong vm_objects_memory = 0;
 static string get_thread_name(jthread thread, jvmtiEnv* jvmti_env) {
 
     jvmtiThreadInfo thread_info;
+    thread_info.name = NULL;
 
     jvmti_env->GetThreadInfo(thread, &thread_info);
 
@@ -135,6 +653,8 @@ static string get_thread_name(jthread thread, jvmtiEnv* jvmti_env) {
 
     if (thread_info.name) {
         thread_name.assign(thread_info.name);
+        jvmti_env->Deallocate(
+            reinterpret_cast<unsigned char*>(thread_info.name));
     }
     return thread_name;
 }
@@ -176,7 +696,7 @@ static void output_field_info(jfieldID field,
 static string get_method_info(jmethodID method,
                                jvmtiEnv* jvmti_env) {
     string method_info = "?";
-    char *methodName, *methodSignature;
+    char *methodName = NULL, *methodSignature = NULL;
     jvmti_env->GetMethodName(method, &methodName, &methodSignature, NULL);
 
     if (methodName && methodSignature) {
@@ -210,289 +730,2278 @@ static void output_method_info(jmethodID method,
     }
 }
 
-/* output an execution summary */
-void output_result() {
-    cout<< "\nTotal number of objects touched: "
-        << total_objects_count
-        << endl
-        << "\nNumber of local objects: "
-        << (total_objects_count-shared_objects_count)
-        << " ("
-        <<((total_objects_count-shared_objects_count)*100/
-           (double)total_objects_count)<<"%)"
-        << endl
-        << "Number of shared objects: "
-        << (shared_objects_count)
-        << " ("
-        << (shared_objects_count*100/(double)total_objects_count)<<"%)"
-        << endl
-        << "Number of objects marked shared due to garbage collection: "
-        << gc_shared_objects_count
-        << " (" <<(gc_shared_objects_count*100/(double)total_objects_count)<<"%)"
-        << endl
-        << "Number of objects marked shared due to finalization:"
-        << finalizer_shared_objects_count
-        << " (" <<(finalizer_shared_objects_count*100/(double)total_objects_count)<<"%)"
-        << endl
-        << "\nTotal touched objects memory occupied in bytes: "
-        << total_objects_memory
-        << endl  
-        << "Shared memory of touched objects occupied in bytes: "
-        << shared_objects_memory
-        << " (" <<(shared_objects_memory*100/(double)total_objects_memory)<<"%)"
-        << endl;
+/*
+ * Adds the patterns of a ':' separated list of class names, where a trailing
+ * '*' matches any suffix, e.g. "java.util.*:com.foo.Bar".
+ */
+static void add_class_patterns(const string& list, vector<string>* patterns) {
+    size_t start = 0;
+    while(start <= list.length()) {
+        size_t colon = list.find(':', start);
+        if(colon == string::npos) colon = list.length();
+
+        string pattern = list.substr(start, colon - start);
+        for(size_t i = 0; i < pattern.length(); ++i) {
+            if(pattern[i] == '.') pattern[i] = '/';
+        }
+        if(!pattern.empty()) patterns->push_back(pattern);
 
-     cout << "\nThread IDs and Names (During live phase): "<< endl;
-     list<thread_info>::const_iterator it;
-     for(it = thread_names.begin(); it!= thread_names.end(); ++it) {
-         cout<<(*it).thread_ID<<": "<<(*(*it).thread_name)<<endl;
-     }
+        start = colon + 1;
+    }
 }
 
-/******************************************************************************/
-/* Object Tags and information                                                */
-/******************************************************************************/
+/* Matches a class name in internal form against a list of patterns. */
+static bool matches_class_pattern(const string& name,
+                                  const vector<string>& patterns) {
+    for(size_t i = 0; i < patterns.size(); ++i) {
+        const string& pattern = patterns[i];
+        if(pattern[pattern.length() - 1] == '*') {
+            if(name.compare(0, pattern.length() - 1,
+                            pattern, 0, pattern.length() - 1) == 0)
+                return true;
+        }
+        else if(name.compare(pattern) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
 
 /*
- * Returns the value of an object's tag, if an error occurs while retrieving
- * the tag, -1 is returned. A tag value of 0 indicated that the object was was
- * not tagged before.
+ * Applies the include and exclude filters to a class signature such as
+ * "Ljava/lang/String;". Returns true if the class's fields should be watched.
  */
-static jlong get_tag(jobject object, jvmtiEnv* jvmti_env) {
+static bool is_class_watched(const char* signature) {
+    if(include_patterns.empty() && exclude_patterns.empty()) return true;
 
-    jlong tag_value = -1; //holds current tag value of object initialized to -1.
+    // Array and primitive classes have no fields to watch.
+    if(signature[0] != 'L') return false;
 
-    /*
-     * According to documentation of field acces & modification:
-     * "Object with the field being accessed if the field is an instance field;
-     * NULL otherwise".
-     */
+    string name(signature + 1);
+    name.erase(name.length() - 1);
 
-    jvmti_env->GetTag(object, &tag_value);
+    if(matches_class_pattern(name, exclude_patterns)) return false;
+    return include_patterns.empty() ||
+           matches_class_pattern(name, include_patterns);
+}
 
-    return tag_value;
+/*
+ * Runs proc in a new agent thread. Agent threads need a java.lang.Thread
+ * object, so this can only be called once the VM is initialized.
+ */
+static bool start_agent_thread(const char* name,
+                               jvmtiStartFunction proc,
+                               JNIEnv* jni_env,
+                               jvmtiEnv* jvmti_env) {
+
+    jclass thread_class = jni_env->FindClass("java/lang/Thread");
+    if(thread_class == NULL) return false;
+
+    jmethodID constructor = jni_env->GetMethodID(
+            thread_class, "<init>", "(Ljava/lang/String;)V");
+    if(constructor == NULL) return false;
+
+    jstring thread_name = jni_env->NewStringUTF(name);
+    jthread thread = jni_env->NewObject(thread_class, constructor, thread_name);
+    if(thread == NULL) return false;
+
+    jvmtiError err = jvmti_env->RunAgentThread(
+            thread, proc, NULL, JVMTI_THREAD_NORM_PRIORITY);
+
+    jni_env->DeleteLocalRef(thread);
+    jni_env->DeleteLocalRef(thread_name);
+    jni_env->DeleteLocalRef(thread_class);
+    return err == JVMTI_ERROR_NONE;
+}
+
+/* Adds to a counter of a thread's shard, or of the global shard. */
+static void count_statistic(thread_state* state,
+                            volatile jlong statistics_shard::* counter,
+                            jlong value) {
+    if(state != NULL)
+        state->statistics.*counter += value;
+    else
+        __sync_fetch_and_add(&(global_statistics.*counter), value);
+}
+
+/* Counts shared objects of the kind of the given shared state. */
+static void count_sharing_kind(thread_state* state,
+                               jint shared_state,
+                               jlong objects,
+                               jlong bytes) {
+    int kind = shared_state - STATE_SHARED_READ_ONLY;
+    statistics_shard* shard = (state != NULL ? &state->statistics
+                                             : &global_statistics);
+    if(state != NULL) {
+        shard->sharing_kind_count[kind] += objects;
+        shard->sharing_kind_memory[kind] += bytes;
+    }
+    else {
+        __sync_fetch_and_add(&shard->sharing_kind_count[kind], objects);
+        __sync_fetch_and_add(&shard->sharing_kind_memory[kind], bytes);
+    }
 }
 
 /*
- * Create a unique id for each object, and create an initial access info
- * structure for it.
+ * The probability that the VM samples an object of the given size. Sampled
+ * allocations are a Poisson process over the bytes a thread allocates, with
+ * a mean of sample_interval bytes between samples.
  */
-static ThreadAccessInfo create_object_info(jobject object,
-                                           jlong thread_ID,
-                                           jvmtiEnv* jvmti_env) {
+static double inclusion_probability(jlong size) {
+    if(sample_interval == 0 || size <= 0) return 1;
+    return 1 - exp(-(double) size/sample_interval);
+}
 
-    /*
-     *  We need this mainly for thread objects, since we need a way to identify
-     * threads. For now I stupidly put tags for all objects types.
-     */
-    static jlong id_generator = 1;
+/* Adds a sampled object of the given size to a thread's estimate. */
+static void count_estimate(thread_state* state,
+                           estimate_sums statistics_shard::* estimate,
+                           jlong size) {
+    double p = inclusion_probability(size);
+    double variance = (1 - p)/(p*p);
+    estimate_sums* sums = &(state->statistics.*estimate);
+    sums->objects += 1/p;
+    sums->bytes += size/p;
+    sums->objects_variance += variance;
+    sums->bytes_variance += variance*size*size;
+}
+
+/* A monotonic clock in nanoseconds that any callback may read. */
+static jlong overhead_clock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (jlong)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+/* The state of the calling thread, or NULL if it has none yet. */
+static thread_state* current_thread_state(jvmtiEnv* jvmti_env) {
+    thread_state* state = NULL;
+    jvmti_env->GetThreadLocalStorage(NULL, reinterpret_cast<void**>(&state));
+    return state;
+}
+
+/*
+ * Counts a callback in flight for its lifetime. A callback that starts once
+ * tracking stopped finds 'stopped' set, and returns without touching the
+ * tracking state. Declared before a callback's timer, so the timer is done
+ * with the thread's state before the callback stops counting.
+ */
+struct callback_guard {
+    volatile jint* count;
+    bool stopped;
+
+    callback_guard() {
+        if(in_flight_stripe < 0)
+            in_flight_stripe = __sync_fetch_and_add(&in_flight_threads, 1);
+        int stripe = in_flight_stripe % in_flight_stripes;
+        count = &callbacks_in_flight[stripe].count;
+        // A full barrier, tracking_stopped is read after the count is up.
+        __sync_fetch_and_add(count, 1);
+        stopped = (tracking_stopped != 0);
+    }
+
+    ~callback_guard() {
+        __sync_fetch_and_sub(count, 1);
+    }
+};
+
+/*
+ * Waits until no callback is in flight. tracking_stopped is set before, so
+ * callbacks starting meanwhile return at once and the wait ends. A callback
+ * keeps its stripe above zero while it runs, so reading the stripes one
+ * after the other never misses it.
+ */
+static void wait_for_callbacks(jvmtiEnv* jvmti_env) {
+    for(;;) {
+        jint in_flight = 0;
+        for(int i = 0; i < in_flight_stripes; ++i) {
+            in_flight += callbacks_in_flight[i].count;
+        }
+        if(in_flight == 0) return;
+
+        jvmti_env->RawMonitorEnter(window_lock);
+        jvmti_env->RawMonitorWait(window_lock, 1);
+        jvmti_env->RawMonitorExit(window_lock);
+    }
+}
+
+/* Counts a callback that took the given nanoseconds. */
+static void count_callback(thread_state* state,
+                           agent_callback kind,
+                           jlong nanos) {
+    int bucket = 63 - __builtin_clzll((unsigned long long)nanos | 1);
+    if(bucket >= overhead_buckets) bucket = overhead_buckets - 1;
+
+    statistics_shard* shard = (state != NULL ? &state->statistics
+                                             : &global_statistics);
+    if(state != NULL) {
+        ++shard->callback_calls[kind];
+        shard->callback_nanos[kind] += nanos;
+        ++shard->callback_histogram[kind][bucket];
+    }
+    else {
+        __sync_fetch_and_add(&shard->callback_calls[kind], 1);
+        __sync_fetch_and_add(&shard->callback_nanos[kind], nanos);
+        __sync_fetch_and_add(&shard->callback_histogram[kind][bucket], 1);
+    }
+}
+
+/*
+ * Times a callback from its start to the end of its scope when the overhead
+ * is measured. The object free callback may not use thread local storage,
+ * it passes false for with_state and counts into the global shard.
+ */
+struct callback_timer {
+    agent_callback kind;
+    bool with_state;
+    jvmtiEnv* jvmti_env;
+    jlong start;
+
+    callback_timer(agent_callback timed_kind,
+                   bool timed_with_state,
+                   jvmtiEnv* env)
+        : kind(timed_kind), with_state(timed_with_state), jvmti_env(env),
+          start(measure_overhead ? overhead_clock() : 0) {
+    }
+
+    ~callback_timer() {
+        if(start == 0) return;
+        jlong nanos = overhead_clock() - start;
+        count_callback(with_state ? current_thread_state(jvmti_env) : NULL,
+                       kind, nanos);
+    }
+};
+
+/* Enters the callbacks lock, counting the wait when overhead is measured. */
+static void enter_callbacks_lock(jvmtiEnv* jvmti_env) {
+    if(!measure_overhead) {
+        jvmti_env->RawMonitorEnter(lock);
+        return;
+    }
+
+    jlong start = overhead_clock();
+    jvmti_env->RawMonitorEnter(lock);
+    jlong nanos = overhead_clock() - start;
+
+    thread_state* state = current_thread_state(jvmti_env);
+    count_statistic(state, &statistics_shard::lock_entries, 1);
+    count_statistic(state, &statistics_shard::lock_wait_nanos, nanos);
+}
+
+static void add_estimate(estimate_sums* totals, const estimate_sums& sums) {
+    totals->objects += sums.objects;
+    totals->bytes += sums.bytes;
+    totals->objects_variance += sums.objects_variance;
+    totals->bytes_variance += sums.bytes_variance;
+}
+
+static void add_statistics(statistics_shard* totals,
+                           const statistics_shard& shard) {
+    totals->shared_objects_count += shard.shared_objects_count;
+    totals->gc_shared_objects_count += shard.gc_shared_objects_count;
+    totals->finalizer_shared_objects_count +=
+            shard.finalizer_shared_objects_count;
+    totals->total_objects_count += shard.total_objects_count;
+    totals->total_objects_memory += shard.total_objects_memory;
+    totals->sampled_objects_count += shard.sampled_objects_count;
+    totals->sampled_objects_memory += shard.sampled_objects_memory;
+    totals->shared_objects_memory += shard.shared_objects_memory;
+
+    for(int kind = 0; kind < SHARING_KINDS; ++kind) {
+        totals->sharing_kind_count[kind] += shard.sharing_kind_count[kind];
+        totals->sharing_kind_memory[kind] += shard.sharing_kind_memory[kind];
+    }
+    add_estimate(&totals->tracked_estimate, shard.tracked_estimate);
+    add_estimate(&totals->shared_estimate, shard.shared_estimate);
+
+    for(int kind = 0; kind < CALLBACK_KINDS; ++kind) {
+        totals->callback_calls[kind] += shard.callback_calls[kind];
+        totals->callback_nanos[kind] += shard.callback_nanos[kind];
+        for(int bucket = 0; bucket < overhead_buckets; ++bucket) {
+            totals->callback_histogram[kind][bucket] +=
+                    shard.callback_histogram[kind][bucket];
+        }
+    }
+    totals->lock_entries += shard.lock_entries;
+    totals->lock_wait_nanos += shard.lock_wait_nanos;
+}
+
+/*
+ * Returns the memory of the tracked objects, as far as the size accounting
+ * mode knows it, or -1 if it is not known yet.
+ */
+static jlong objects_memory(const statistics_shard& totals) {
+    if(sizes == SIZES_SAMPLED) {
+        if(totals.sampled_objects_count == 0) return -1;
+        return (jlong)(totals.total_objects_count *
+                       (totals.sampled_objects_memory /
+                        (double)totals.sampled_objects_count));
+    }
+    if(sizes == SIZES_HEAP) {
+        return (live_end_nanos != 0 ? live_objects_memory : -1);
+    }
+    return totals.total_objects_memory;
+}
+
+/* Says how objects_memory was found, for the summary. */
+static string objects_memory_method(const statistics_shard& totals) {
+    ostringstream method;
+    if(sizes == SIZES_SAMPLED)
+        method<< "estimated from " << totals.sampled_objects_count
+              << " sampled objects, 1 in " << size_sample_interval;
+    else if(sizes == SIZES_HEAP)
+        method<< "objects alive at VM death, from a heap walk";
+    else
+        method<< "exact";
+    return method.str();
+}
+
+/*
+ * Sums all shards. Threads keep counting meanwhile, their latest counts may
+ * be missed but nothing is counted twice.
+ */
+static statistics_shard sum_statistics(jvmtiEnv* jvmti_env) {
+    statistics_shard totals;
+    memset(&totals, 0, sizeof(totals));
+    add_statistics(&totals, global_statistics);
+
+    jvmti_env->RawMonitorEnter(statistics_lock);
+    add_statistics(&totals, retired_statistics);
+    for(statistics_shard* shard = statistics_shards; shard;
+        shard = shard->next) {
+        add_statistics(&totals, *shard);
+    }
+    jvmti_env->RawMonitorExit(statistics_lock);
+    return totals;
+}
+
+/*
+ * Returns the upper bound of the bucket holding the given percentile of a
+ * callback's durations, in nanoseconds, or 0 if it was never called.
+ */
+static jlong callback_percentile(const statistics_shard& totals,
+                                 int kind,
+                                 int percent) {
+    jlong calls = totals.callback_calls[kind];
+    if(calls == 0) return 0;
+
+    jlong rank = (calls*percent + 99)/100;
+    jlong seen = 0;
+    int bucket = 0;
+    for(; bucket < overhead_buckets - 1; ++bucket) {
+        seen += totals.callback_histogram[kind][bucket];
+        if(seen >= rank) break;
+    }
+    return (jlong)1 << (bucket + 1);
+}
+
+/* Bytes held by the thread states and class infos. */
+static jlong tracking_structures_memory(jvmtiEnv* jvmti_env) {
+    jlong bytes = 0;
+
+    jvmti_env->RawMonitorEnter(lock);
+    for(thread_state* state = thread_states; state; state = state->next) {
+        bytes += sizeof(thread_state) + state->object_info_records.capacity;
+    }
+    for(class_info* info = class_infos; info; info = info->next) {
+        bytes += sizeof(class_info) + strlen(info->signature) + 1;
+        for(field_info* field = info->fields; field; field = field->next) {
+            bytes += sizeof(field_info) + strlen(field->name) + 1;
+        }
+    }
+    bytes += field_sites_count*sizeof(field_site);
+    jvmti_env->RawMonitorExit(lock);
+    return bytes;
+}
+
+/* Outputs where the agent itself spent its time, and its memory. */
+static void output_overhead(const statistics_shard& totals) {
+    jlong live_nanos = live_end_nanos - live_start_nanos;
+    jlong field_events = totals.callback_calls[CALLBACK_FIELD_ACCESS] +
+                         totals.callback_calls[CALLBACK_FIELD_MODIFICATION] +
+                         totals.callback_calls[CALLBACK_RECORDER];
+
+    cout<< "\nAgent overhead (callback, calls, total ms, mean ns, "
+        << "p50 and p99 below ns):"
+        << endl;
+    for(int kind = 0; kind < CALLBACK_KINDS; ++kind) {
+        jlong calls = totals.callback_calls[kind];
+        if(calls == 0) continue;
+
+        jlong nanos = totals.callback_nanos[kind];
+        cout<< "  " << callback_names[kind] << ": " << calls << ", "
+            << nanos/1000000 << ", " << nanos/calls << ", "
+            << callback_percentile(totals, kind, 50) << ", "
+            << callback_percentile(totals, kind, 99)
+            << endl;
+    }
+
+    cout<< "Callbacks lock entered " << totals.lock_entries << " times, "
+        << totals.lock_wait_nanos/1000000 << " ms spent entering"
+        << endl;
+    if(live_nanos > 0) {
+        cout<< "Field events per second of the live phase: "
+            << (jlong)(field_events/(live_nanos/1e9))
+            << endl;
+    }
+    cout<< "Tracking structures in bytes: "
+        << info_pool::live_bytes() << " access info, "
+        << access_lists_memory << " access lists, "
+        << tracking_structures_memory(jvmti)
+        << " thread states, classes and fields"
+        << endl;
+}
+
+/* Half the width of the 95% confidence interval of an estimate. */
+static double confidence_error(double variance) {
+    return 1.96*sqrt(variance);
+}
+
+/*
+ * Estimates the share of the touched objects, or of their bytes, that is
+ * shared, and sets 'error' to half its 95% confidence interval. The share
+ * is a ratio of two estimates, its variance is linearized around it.
+ */
+static double estimated_share(const statistics_shard& totals,
+                              bool bytes,
+                              double* error) {
+    const estimate_sums& tracked = totals.tracked_estimate;
+    const estimate_sums& shared = totals.shared_estimate;
+    double total = (bytes ? tracked.bytes : tracked.objects);
+    *error = 0;
+    if(total <= 0) return 0;
+
+    double share = (bytes ? shared.bytes : shared.objects)/total;
+    double variance = (bytes ?
+            share*share*tracked.bytes_variance +
+                (1 - 2*share)*shared.bytes_variance :
+            share*share*tracked.objects_variance +
+                (1 - 2*share)*shared.objects_variance);
+    if(variance > 0) *error = confidence_error(variance/(total*total));
+    return share;
+}
+
+/* Outputs the counts of the sampled objects scaled up to all objects. */
+static void output_estimates(const statistics_shard& totals) {
+    const estimate_sums& tracked = totals.tracked_estimate;
+    const estimate_sums& shared = totals.shared_estimate;
+    double objects_share_error, bytes_share_error;
+    double objects_share = estimated_share(totals, false,
+                                           &objects_share_error);
+    double bytes_share = estimated_share(totals, true, &bytes_share_error);
+
+    cout<< "\nSampled tracking: " << sampled_allocations
+        << " allocations sampled, 1 every " << sample_interval
+        << " bytes on average, the counts above are of sampled objects"
+        << endl
+        << "Estimates for all objects (value +- 95% confidence):"
+        << endl
+        << "  objects touched: " << (jlong) tracked.objects << " +- "
+        << (jlong) confidence_error(tracked.objects_variance)
+        << endl
+        << "  bytes touched: " << (jlong) tracked.bytes << " +- "
+        << (jlong) confidence_error(tracked.bytes_variance)
+        << endl
+        << "  shared objects: " << (jlong) shared.objects << " +- "
+        << (jlong) confidence_error(shared.objects_variance)
+        << " (" << objects_share*100 << "% +- "
+        << objects_share_error*100 << "%)"
+        << endl
+        << "  shared bytes: " << (jlong) shared.bytes << " +- "
+        << (jlong) confidence_error(shared.bytes_variance)
+        << " (" << bytes_share*100 << "% +- "
+        << bytes_share_error*100 << "%)"
+        << endl;
+}
+
+/* Orders fields by their cross-thread touches, most first. */
+static bool touched_more(const field_info* a, const field_info* b) {
+    if(a->cross_thread_touches != b->cross_thread_touches)
+        return a->cross_thread_touches > b->cross_thread_touches;
+    return a->shared_bytes > b->shared_bytes;
+}
+
+/* Returns the fields other threads touched, most touched first. */
+static vector<field_info*> shared_fields() {
+    vector<field_info*> fields;
+    for(class_info* info = class_infos; info; info = info->next) {
+        for(field_info* field = info->fields; field; field = field->next) {
+            if(field->cross_thread_touches > 0) fields.push_back(field);
+        }
+    }
+    sort(fields.begin(), fields.end(), touched_more);
+    return fields;
+}
+
+/* Orders sites by their shared bytes, most first. */
+static bool shared_more_bytes(const site_info* a, const site_info* b) {
+    if(a->shared_bytes != b->shared_bytes)
+        return a->shared_bytes > b->shared_bytes;
+    return a->shared_objects > b->shared_objects;
+}
+
+/* Returns the sites with shared objects, most shared bytes first. */
+static vector<site_info*> shared_sites() {
+    vector<site_info*> sites;
+    for(jint id = 1; id <= sites_count; ++id) {
+        if(sites_by_ID[id]->shared_objects > 0)
+            sites.push_back(sites_by_ID[id]);
+    }
+    sort(sites.begin(), sites.end(), shared_more_bytes);
+    return sites;
+}
+
+/* Outputs the allocation sites whose objects are shared the most. */
+static void output_shared_sites() {
+    vector<site_info*> sites = shared_sites();
+    cout<< "\nAllocation sites: " << sites_count << " sites of "
+        << sampled_allocations << " sampled allocations, "
+        << sites.size() << " with shared objects"
+        << endl;
+    if(sites.empty()) return;
+
+    cout<< "Allocation sites by shared bytes (site: objects shared, bytes "
+        << "shared, frames):"
+        << endl;
+    for(size_t i = 0; i < sites.size() && i < summary_top_sites; ++i) {
+        cout<< "  #" << sites[i]->site_ID << ": "
+            << sites[i]->shared_objects << ", " << sites[i]->shared_bytes
+            << endl;
+        for(size_t f = 0; f < sites[i]->frame_names.size(); ++f) {
+            cout<< "      " << sites[i]->frame_names[f] << endl;
+        }
+    }
+    if(sites.size() > summary_top_sites) {
+        cout<< "  and " << sites.size() - summary_top_sites
+            << " more sites, all are in the object info file"
+            << endl;
+    }
+}
+
+/* Outputs the fields through which objects are shared the most. */
+static void output_shared_fields() {
+    vector<field_info*> fields = shared_fields();
+    if(fields.empty()) return;
+
+    cout<< "\nFields by cross-thread touches (field: touches, objects "
+        << "shared, bytes shared):"
+        << endl;
+    for(size_t i = 0; i < fields.size() && i < summary_top_fields; ++i) {
+        cout<< "  " << fields[i]->klass->signature << "." << fields[i]->name
+            << ": " << fields[i]->cross_thread_touches << ", "
+            << fields[i]->shared_objects << ", " << fields[i]->shared_bytes
+            << endl;
+    }
+    if(fields.size() > summary_top_fields) {
+        cout<< "  and " << fields.size() - summary_top_fields
+            << " more fields, all are in the object info file"
+            << endl;
+    }
+}
+
+/* output an execution summary */
+void output_result() {
+    statistics_shard totals = sum_statistics(jvmti);
+    jlong total_objects_count = totals.total_objects_count;
+    jlong shared_objects_count = totals.shared_objects_count;
+    jlong gc_shared_objects_count = totals.gc_shared_objects_count;
+    jlong finalizer_shared_objects_count =
+            totals.finalizer_shared_objects_count;
+    jlong total_objects_memory = objects_memory(totals);
+    jlong shared_objects_memory = totals.shared_objects_memory;
+
+
+    cout<< "\nTotal number of objects touched: "
+        << total_objects_count
+        << endl
+        << "\nNumber of local objects: "
+        << (total_objects_count-shared_objects_count)
+        << " ("
+        <<((total_objects_count-shared_objects_count)*100/
+           (double)total_objects_count)<<"%)"
+        << endl
+        << "Number of shared objects: "
+        << (shared_objects_count)
+        << " ("
+        << (shared_objects_count*100/(double)total_objects_count)<<"%)"
+        << endl
+        << "Number of objects marked shared due to garbage collection: "
+        << gc_shared_objects_count
+        << " (" <<(gc_shared_objects_count*100/(double)total_objects_count)<<"%)"
+        << endl
+        << "Number of objects marked shared due to finalization:"
+        << finalizer_shared_objects_count
+        << " (" <<(finalizer_shared_objects_count*100/(double)total_objects_count)<<"%)"
+        << endl
+        << "\nTotal touched objects memory occupied in bytes: "
+        << total_objects_memory
+        << " (" << objects_memory_method(totals) << ")"
+        << endl  
+        << "Shared memory of touched objects occupied in bytes: "
+        << shared_objects_memory
+        << " (" <<(shared_objects_memory*100/(double)total_objects_memory)<<"%)"
+        << endl
+        << "\nShared objects by writing threads (objects, bytes):"
+        << endl
+        << "  read only: " << totals.sharing_kind_count[0] << ", "
+        << totals.sharing_kind_memory[0]
+        << endl
+        << "  single writer: " << totals.sharing_kind_count[1] << ", "
+        << totals.sharing_kind_memory[1]
+        << endl
+        << "  multi writer: " << totals.sharing_kind_count[2] << ", "
+        << totals.sharing_kind_memory[2]
+        << endl
+        << "\nAccess info memory in bytes: "
+        << info_pool::live_bytes() << " live, "
+        << info_pool::peak_bytes() << " peak, "
+        << info_pool::reserved_bytes() << " reserved"
+        << endl
+        << "Access lists memory in bytes: "
+        << access_lists_memory << " live, "
+        << peak_access_lists_memory << " peak"
+        << endl;
+
+    if(tracking == TRACK_SAMPLED) output_estimates(totals);
+
+    cout<< "\nClass signatures resolved: " << class_infos_count
+        << endl
+        << "Classes with watched fields: " << watched_classes_count
+        << ", filtered out: " << filtered_classes_count
+        << endl
+        << "Fields watched: " << watched_fields_count
+        << endl;
+
+    if(engine == ENGINE_BYTECODE) {
+        cout<< "Classes instrumented: " << instrumented_classes_count
+            << ", methods instrumented: " << instrumented_methods_count
+            << endl;
+    }
+
+    if(duty_period_millis > 0) {
+        jlong live_nanos = live_end_nanos - live_start_nanos;
+        cout<< "\nField watches duty cycled: on for "
+            << duty_on_millis << " ms every " << duty_period_millis << " ms"
+            << endl
+            << "Sampled coverage: watched for " << watched_nanos/1000000
+            << " ms of " << live_nanos/1000000 << " ms ("
+            << (watched_nanos*100/(double)live_nanos) << "%)"
+            << endl;
+    }
+
+    output_shared_fields();
+    if(site_depth > 0) output_shared_sites();
+
+    if(measure_overhead) output_overhead(totals);
+
+     cout << "\nThread IDs and Names (During live phase): "<< endl;
+     list<thread_info>::const_iterator it;
+     for(it = thread_names.begin(); it!= thread_names.end(); ++it) {
+         cout<<(*it).thread_ID<<": "<<(*(*it).thread_name)<<endl;
+     }
+}
+
+/******************************************************************************/
+/* Asynchronous output                                                        */
+/******************************************************************************/
+
+/* Writes a list of batches and releases them. */
+static void write_batches(pending_batch* batches, jvmtiEnv* jvmti_env) {
+    if(batches == NULL) return;
+
+    jvmti_env->RawMonitorEnter(io_lock);
+    while(batches != NULL) {
+        pending_batch* batch = batches;
+        batches = batch->next;
+
+        profiling_io::write_buffer(&batch->records, batch->file);
+        profiling_io::free_buffer(&batch->records);
+        delete batch;
+    }
+    jvmti_env->RawMonitorExit(io_lock);
+}
+
+/*
+ * Hands a batch of records to the writer thread, taking over its memory and
+ * leaving it empty. When the writer is not running the batch is written
+ * right away. Only uses raw monitors, so it is safe in the object free
+ * callback.
+ */
+static void submit_batch(profiling_io::record_buffer* records,
+                         profiling_io::record_file file,
+                         jvmtiEnv* jvmti_env) {
+    if(records->length == 0) return;
+
+    jvmti_env->RawMonitorEnter(write_lock);
+    if(writer_running) {
+        pending_batch* batch = new pending_batch;
+        batch->records = *records;
+        batch->file = file;
+        batch->next = NULL;
+        profiling_io::init_buffer(records);
+
+        if(pending_batches_tail != NULL)
+            pending_batches_tail->next = batch;
+        else
+            pending_batches = batch;
+        pending_batches_tail = batch;
+
+        jvmti_env->RawMonitorNotify(write_lock);
+        jvmti_env->RawMonitorExit(write_lock);
+        return;
+    }
+    jvmti_env->RawMonitorExit(write_lock);
+
+    jvmti_env->RawMonitorEnter(io_lock);
+    profiling_io::write_buffer(records, file);
+    jvmti_env->RawMonitorExit(io_lock);
+}
+
+/*
+ * Body of the writer thread. Takes all queued batches at once and writes
+ * them outside of write_lock, so producers only wait for the queue. Once the
+ * agent is stopping and the queue is empty it marks itself stopped, after
+ * which producers write their batches themselves.
+ */
+void JNICALL writer_thread(jvmtiEnv* jvmti_env, JNIEnv* jni_env, void* arg) {
+    for(;;) {
+        jvmti_env->RawMonitorEnter(write_lock);
+        while(pending_batches == NULL && !agent_threads_stopping) {
+            jvmti_env->RawMonitorWait(write_lock, 0);
+        }
+
+        pending_batch* batches = pending_batches;
+        pending_batches = pending_batches_tail = NULL;
+
+        if(batches == NULL) {
+            writer_running = false;
+            jvmti_env->RawMonitorNotifyAll(write_lock);
+            jvmti_env->RawMonitorExit(write_lock);
+            break;
+        }
+        jvmti_env->RawMonitorExit(write_lock);
+
+        write_batches(batches, jvmti_env);
+    }
+}
+
+/******************************************************************************/
+/* Object Tags and information                                                */
+/******************************************************************************/
+
+/*
+ * Returns the value of an object's tag, if an error occurs while retrieving
+ * the tag, -1 is returned. A tag value of 0 indicated that the object was was
+ * not tagged before.
+ */
+static jlong get_tag(jobject object, jvmtiEnv* jvmti_env) {
+
+    jlong tag_value = -1; //holds current tag value of object initialized to -1.
+
+    /*
+     * According to documentation of field acces & modification:
+     * "Object with the field being accessed if the field is an instance field;
+     * NULL otherwise".
+     */
+
+    jvmti_env->GetTag(object, &tag_value);
+
+    return tag_value;
+}
+
+/*
+ * Whether sampled tracking drops the touch of an object. Only objects the VM
+ * sampled are tagged, and tags are only set at allocation, so an untagged
+ * object is dropped before the callbacks lock, in either sync mode.
+ */
+static bool sampled_out(jobject object, jvmtiEnv* jvmti_env) {
+    return tracking == TRACK_SAMPLED && object != NULL &&
+           get_tag(object, jvmti_env) == 0;
+}
+
+/*
+ * Create a unique id for each object, and create an initial access info
+ * structure for it. The structure comes from the calling thread's pool cache,
+ * or from the pool's shared cache if cache is NULL. 'write' tells whether the
+ * touch tagging the object wrote to it, site_tag is the tag of a sampled
+ * object or 0. Returns NULL if the pool has no memory left.
+ */
+static ThreadAccessInfo create_object_info(jobject object,
+                                           jint thread_ID,
+                                           bool write,
+                                           jlong site_tag,
+                                           thread_state* state,
+                                           jvmtiEnv* jvmti_env) {
+
+    /*
+     *  We need this mainly for thread objects, since we need a way to identify
+     * threads. For now I stupidly put tags for all objects types.
+     */
+    static jlong id_generator = 1;
+
+    //Set a unique identifier for the object and init its info.
+    ThreadAccessInfo access_info = static_cast<ThreadAccessInfo>(
+            info_pool::allocate(state != NULL ? &state->info_cache : NULL));
+    // Out of memory, the object is left untracked.
+    if(access_info == NULL) return NULL;
+
+    access_info->object_ID = __sync_fetch_and_add(&id_generator, 1);
+    access_info->state = (write ? STATE_LOCAL_WRITTEN : STATE_LOCAL);
+    access_info->site_ID = (unsigned short) (site_tag >> 2);
+    access_info->thread_ID = thread_ID;
+
+    // The size of a sampled object came with its allocation.
+    jlong sampled_size = site_tag >> SITE_TAG_SIZE_SHIFT;
+    if(tracking == TRACK_SAMPLED && state != NULL)
+        count_estimate(state, &statistics_shard::tracked_estimate,
+                       sampled_size);
+
+    /*
+     * Measuring the object is the costliest part of tagging it, unless sizes
+     * are exact it is left to the heap walk at VM death, or only done for
+     * every size_sample_interval-th object a thread tags.
+     */
+    if(sizes == SIZES_EXACT) {
+        jlong obj_size = sampled_size;
+        if(obj_size <= 0) jvmti_env->GetObjectSize(object, &obj_size);
+        count_statistic(state, &statistics_shard::total_objects_memory,
+                        obj_size);
+    }
+    else if(sizes == SIZES_SAMPLED) {
+        statistics_shard* shard = (state != NULL ? &state->statistics
+                                                 : &global_statistics);
+        if(shard->total_objects_count % size_sample_interval == 0) {
+            jlong obj_size = -1;
+            jvmti_env->GetObjectSize(object, &obj_size);
+            count_statistic(state, &statistics_shard::sampled_objects_memory,
+                            obj_size);
+            count_statistic(state, &statistics_shard::sampled_objects_count, 1);
+        }
+    }
+    count_statistic(state, &statistics_shard::total_objects_count, 1);
+
+    return access_info;
+}
+
+/*
+ * Returns the access info of an object, tagging the object first if it was
+ * not touched before. A newly tagged object is owned by the thread with ID
+ * owner_ID, written to if 'write' is set, and 'created' is set. An object
+ * tagged with its allocation site counts as not touched. Returns NULL if the
+ * tag cannot be read, if tracking is sampled and the object was not, or if
+ * no memory is left for a new record, the object is then not tagged.
+ */
+static ThreadAccessInfo get_object_info(jobject object,
+                                        jint owner_ID,
+                                        bool write,
+                                        thread_state* state,
+                                        bool* created,
+                                        jvmtiEnv* jvmti_env) {
+
+    *created = false;
+    jlong tag_value = get_tag(object, jvmti_env);
+
+    if(tag_value == -1) return NULL;
+
+    // Only sampled objects are tagged, a touch of any other ends here.
+    if(tag_value == 0 && tracking == TRACK_SAMPLED) return NULL;
+
+    // Class objects tagged with their class info are not tracked.
+    if(tag_value & CLASS_TAG) return NULL;
+    if(tag_value != 0 && !(tag_value & SITE_TAG))
+        return reinterpret_cast<ThreadAccessInfo>(tag_value);
+
+    /*
+     * In atomic mode two threads may find the same untagged object, so the
+     * tag is read again under the lock before a new record is made.
+     */
+    if(event_sync == SYNC_ATOMIC) {
+        enter_callbacks_lock(jvmti_env);
+        tag_value = get_tag(object, jvmti_env);
+    }
+
+    ThreadAccessInfo access_info = NULL;
+    if(tag_value != -1 && (tag_value & CLASS_TAG)) {
+        // Became a class info while we waited for the lock.
+    }
+    else if(tag_value == 0 || (tag_value != -1 && (tag_value & SITE_TAG))) {
+        access_info = create_object_info(object, owner_ID, write, tag_value,
+                                         state, jvmti_env);
+
+        // Make the reference to the info structure the tag of the object.
+        if(access_info != NULL) {
+            jvmtiError err = jvmti_env->SetTag(object,
+                                                reinterpret_cast<jlong>(
+                                                access_info));
+#ifdef DEBUG
+            if(err != JVMTI_ERROR_NONE )
+                cout<<"something went so wrong with tagging an object!"<<endl;
+#endif
+            *created = true;
+        }
+    }
+    else if(tag_value != -1) {
+        access_info = reinterpret_cast<ThreadAccessInfo>(tag_value);
+    }
+
+    if(event_sync == SYNC_ATOMIC) {
+        jvmti_env->RawMonitorExit(lock);
+    }
+    return access_info;
+}
+
+/*
+ * Returns the state of the calling thread, creating it the first time the
+ * thread starts or produces an event. Creating the state tags the thread,
+ * records its name, and checks whether it is the finalizer, so none of this
+ * is repeated per event. Returns NULL if the thread cannot be tagged. When
+ * tracking is sampled threads are not tagged, like any other unsampled
+ * object.
+ *
+ * Threads are objects, we need to tag them as well
+ * We cannot use a jthread for thread identification, thus we must tag
+ * threads. The reason is that jthreads move in memory, jthread is merely
+ * an address in memory, thus it cannot be used for identification.
+ */
+static thread_state* get_thread_state(jthread thread, jvmtiEnv* jvmti_env) {
+    thread_state* state = NULL;
+
+    // Passing NULL reads the current thread's storage, the cheapest lookup.
+    jvmti_env->GetThreadLocalStorage(NULL, reinterpret_cast<void**>(&state));
+    if(state != NULL) return state;
+
+    // Events from the recorder natives do not come with the thread.
+    if(thread == NULL) jvmti_env->GetCurrentThread(&thread);
+
+    if(tracking == TRACK_ALL) {
+        bool created;
+        ThreadAccessInfo thread_as_object_access_info =
+                get_object_info(thread, NO_THREAD, false, NULL, &created,
+                                jvmti_env);
+
+        // Not much we can do about it.
+        if(thread_as_object_access_info == NULL) return NULL;
+    }
+
+    static jint thread_counter = 0;
+    string name = get_thread_name(thread, jvmti_env);
+
+    state = new thread_state;
+    state->thread_ID = __sync_add_and_fetch(&thread_counter, 1);
+    state->is_finalizer = (name.compare("Finalizer") == 0);
+    info_pool::init_cache(&state->info_cache);
+    profiling_io::init_buffer(&state->object_info_records);
+    memset(&state->statistics, 0, sizeof(state->statistics));
+    jvmti_env->SetThreadLocalStorage(NULL, state);
+
+    jvmti_env->RawMonitorEnter(statistics_lock);
+    state->statistics.next = statistics_shards;
+    statistics_shards = &state->statistics;
+    jvmti_env->RawMonitorExit(statistics_lock);
+
+#ifdef DEBUG
+    cout<<"Starting thread: "<<name<<endl;
+#endif
+
+    thread_info thread_inf;
+    thread_inf.thread_ID = state->thread_ID;
+    thread_inf.thread_name = new string(name);
+
+    jvmti_env->RawMonitorEnter(lock);
+    state->next = thread_states;
+    thread_states = state;
+    thread_names.push_back(thread_inf);
+    jvmti_env->RawMonitorExit(lock);
+
+    return state;
+}
+
+/* Hands over the object info records a thread has batched so far. */
+static void flush_thread_state(thread_state* state, jvmtiEnv* jvmti_env) {
+    submit_batch(&state->object_info_records,
+                 profiling_io::OBJECT_INFO_RECORDS, jvmti_env);
+}
+
+/* Accounts for memory taken or released by access sequences. */
+static void add_access_lists_memory(jlong bytes) {
+    jlong live = __sync_add_and_fetch(&access_lists_memory, bytes);
+
+    jlong peak = peak_access_lists_memory;
+    while(live > peak &&
+          !__sync_bool_compare_and_swap(&peak_access_lists_memory,
+                                        peak, live)) {
+        peak = peak_access_lists_memory;
+    }
+}
+
+/* Makes the info of a class with the given signature, under the lock. */
+static class_info* create_class_info(const char* signature) {
+    class_info* info = new class_info;
+    info->class_ID = class_infos_count++;
+    info->signature = strdup(signature);
+    info->shared_count = 0;
+    info->fields = NULL;
+    info->next = class_infos;
+
+    // Snapshots walk the list without the lock.
+    __sync_synchronize();
+    class_infos = info;
+    return info;
+}
+
+/*
+ * Returns the info of a class, resolving its signature and tagging the class
+ * the first time. Classes already tagged as tracked objects cannot carry
+ * their info in the tag, they are looked up by signature instead. A caller
+ * that already resolved the signature passes it as known_signature.
+ */
+static class_info* intern_class_info(jclass klass,
+                                     const char* known_signature,
+                                     jvmtiEnv* jvmti_env) {
+    jlong tag_value = get_tag(klass, jvmti_env);
+    if(tag_value != -1 && (tag_value & CLASS_TAG))
+        return reinterpret_cast<class_info*>(tag_value & ~CLASS_TAG);
+
+    enter_callbacks_lock(jvmti_env);
+
+    class_info* info;
+    tag_value = get_tag(klass, jvmti_env);
+    if(tag_value != -1 && (tag_value & CLASS_TAG)) {
+        info = reinterpret_cast<class_info*>(tag_value & ~CLASS_TAG);
+    }
+    else {
+        char* klass_signature = NULL;
+        if(known_signature == NULL)
+            jvmti_env->GetClassSignature(klass, &klass_signature, NULL);
+        string signature(known_signature != NULL ? known_signature :
+                         klass_signature != NULL ? klass_signature : "?");
+        jvmti_env->Deallocate(reinterpret_cast<unsigned char*>(klass_signature));
+
+        if(tag_value == 0) {
+            info = create_class_info(signature.c_str());
+            jvmti_env->SetTag(klass,
+                              reinterpret_cast<jlong>(info) | CLASS_TAG);
+        }
+        else {
+            map<string, class_info*>::iterator it =
+                    untagged_class_infos.find(signature);
+            if(it == untagged_class_infos.end()) {
+                it = untagged_class_infos.insert(
+                        make_pair(signature,
+                                  create_class_info(signature.c_str()))).first;
+            }
+            info = it->second;
+        }
+    }
+
+    jvmti_env->RawMonitorExit(lock);
+    return info;
+}
+
+static class_info* get_class_info(jclass klass, jvmtiEnv* jvmti_env) {
+    return intern_class_info(klass, NULL, jvmti_env);
+}
+
+/* Finds a field of a class info by its ID, NULL if it is not there. */
+static field_info* find_class_field(class_info* info, jfieldID field) {
+    for(field_info* known = info->fields; known; known = known->next) {
+        if(known->field == field) return known;
+    }
+    return NULL;
+}
+
+/*
+ * Interns the watched fields of a class, naming and numbering them, before
+ * the fields are watched. Classes of the same signature that share their
+ * info add the fields the info does not have yet.
+ */
+static void add_field_infos(class_info* info,
+                            jclass klass,
+                            const vector<jfieldID>& fields,
+                            jvmtiEnv* jvmti_env) {
+    if(fields.empty()) return;
+
+    jvmti_env->RawMonitorEnter(lock);
+    for(size_t i = 0; i < fields.size(); ++i) {
+        if(find_class_field(info, fields[i]) != NULL) continue;
+
+        char* name = NULL;
+        jvmti_env->GetFieldName(klass, fields[i], &name, NULL, NULL);
+
+        field_info* field = new field_info;
+        field->field = fields[i];
+        field->field_ID = field_infos_count++;
+        field->klass = info;
+        field->name = strdup(name != NULL ? name : "?");
+        field->cross_thread_touches = 0;
+        field->shared_objects = 0;
+        field->shared_bytes = 0;
+        field->next = info->fields;
+        jvmti_env->Deallocate(reinterpret_cast<unsigned char*>(name));
+
+        // Events read the fields without the lock.
+        __sync_synchronize();
+        info->fields = field;
+    }
+    jvmti_env->RawMonitorExit(lock);
+}
+
+/* Hashes the frames of a stack by their methods and locations, FNV-1a. */
+static unsigned long long hash_frames(const jvmtiFrameInfo* frames,
+                                      jint depth) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for(jint i = 0; i < depth; ++i) {
+        hash = (hash ^ (unsigned long long) (size_t) frames[i].method) *
+               1099511628211ULL;
+        hash = (hash ^ (unsigned long long) frames[i].location) *
+               1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Finds the site of a bytecode in a chain, NULL if it is not there. */
+static field_site* find_field_site(field_site* chain,
+                                   jmethodID method,
+                                   jlocation location,
+                                   jfieldID field) {
+    for(field_site* site = chain; site != NULL; site = site->next) {
+        if(site->method == method && site->location == location &&
+           site->field == field)
+            return site;
+    }
+    return NULL;
+}
+
+/*
+ * Returns the info of a watched field, or NULL for events that do not name
+ * one, like those of the recorder natives. Events of a bytecode seen before
+ * find the field by a lookup in the field sites, without the lock or calling
+ * the VM. Natives touch fields through JNI at no bytecode, their events
+ * resolve the class each time.
+ */
+static field_info* find_field_info(jclass klass,
+                                   jfieldID field,
+                                   jmethodID method,
+                                   jlocation location,
+                                   jvmtiEnv* jvmti_env) {
+    if(klass == NULL || field == NULL) return NULL;
+    if(method == NULL || location < 0)
+        return find_class_field(get_class_info(klass, jvmti_env), field);
+
+    jvmtiFrameInfo frame;
+    frame.method = method;
+    frame.location = location;
+    unsigned long long hash = (hash_frames(&frame, 1) ^
+                               (unsigned long long) (size_t) field) *
+                              1099511628211ULL;
+    field_site* volatile* bucket =
+            &field_site_buckets[hash % field_site_buckets_count];
+
+    field_site* site = find_field_site(*bucket, method, location, field);
+    if(site != NULL) return site->info;
+
+    field_info* info =
+            find_class_field(get_class_info(klass, jvmti_env), field);
+
+    jvmti_env->RawMonitorEnter(lock);
+    if(find_field_site(*bucket, method, location, field) == NULL) {
+        site = new field_site;
+        site->method = method;
+        site->location = location;
+        site->field = field;
+        site->info = info;
+        site->next = *bucket;
+        ++field_sites_count;
+
+        __sync_synchronize();
+        *bucket = site;
+    }
+    jvmti_env->RawMonitorExit(lock);
+    return info;
+}
+
+/* Finds the site of a stack in a chain of sites, NULL if it is not there. */
+static site_info* find_site(site_info* chain,
+                            unsigned long long hash,
+                            const jvmtiFrameInfo* frames,
+                            jint depth) {
+    for(site_info* site = chain; site != NULL; site = site->next) {
+        if(site->hash == hash && site->depth == depth &&
+           memcmp(site->frames, frames, depth*sizeof(jvmtiFrameInfo)) == 0)
+            return site;
+    }
+    return NULL;
+}
+
+/*
+ * Returns the ID of the site of a stack, interning the stack the first time
+ * it is seen, or 0 once there are max_sites sites. Sites are complete before
+ * they are linked into their bucket, so only adding one takes sites_lock.
+ */
+static jint intern_site(const jvmtiFrameInfo* frames,
+                        jint depth,
+                        jvmtiEnv* jvmti_env) {
+    unsigned long long hash = hash_frames(frames, depth);
+    site_info* volatile* bucket = &site_buckets[hash % site_buckets_count];
+
+    site_info* site = find_site(*bucket, hash, frames, depth);
+    if(site != NULL) return site->site_ID;
+
+    jvmti_env->RawMonitorEnter(sites_lock);
+    site = find_site(*bucket, hash, frames, depth);
+    if(site == NULL && sites_count < max_sites) {
+        site = new site_info();
+        site->site_ID = sites_count + 1;
+        site->depth = depth;
+        site->hash = hash;
+        memcpy(site->frames, frames, depth*sizeof(jvmtiFrameInfo));
+        site->shared_objects = 0;
+        site->shared_bytes = 0;
+        site->next = *bucket;
+        sites_by_ID[site->site_ID] = site;
+
+        __sync_synchronize();
+        *bucket = site;
+        sites_count = site->site_ID;
+    }
+    jvmti_env->RawMonitorExit(sites_lock);
+
+    return (site != NULL ? site->site_ID : 0);
+}
+
+/*
+ * Names a frame by the signature of its class, its method, and its line, or
+ * its bytecode index when the method has no line numbers.
+ */
+static string frame_name(const jvmtiFrameInfo& frame,
+                         JNIEnv* jni_env,
+                         jvmtiEnv* jvmti_env) {
+    ostringstream name;
+    jclass klass = NULL;
+    char* signature = NULL;
+    if(jvmti_env->GetMethodDeclaringClass(frame.method, &klass) ==
+            JVMTI_ERROR_NONE &&
+       jvmti_env->GetClassSignature(klass, &signature, NULL) ==
+            JVMTI_ERROR_NONE) {
+        name<<signature;
+        jvmti_env->Deallocate(reinterpret_cast<unsigned char*>(signature));
+    }
+    else {
+        name<<"?";
+    }
+    if(klass != NULL) jni_env->DeleteLocalRef(klass);
+    name<<"."<<get_method_info(frame.method, jvmti_env);
+
+    jint entries = 0;
+    jvmtiLineNumberEntry* table = NULL;
+    if(jvmti_env->GetLineNumberTable(frame.method, &entries, &table) ==
+            JVMTI_ERROR_NONE) {
+        // Entries are not ordered, the closest start before the frame wins.
+        jlocation start = -1;
+        jint line = 0;
+        for(jint i = 0; i < entries; ++i) {
+            if(table[i].start_location <= frame.location &&
+               table[i].start_location > start) {
+                start = table[i].start_location;
+                line = table[i].line_number;
+            }
+        }
+        name<<":"<<line;
+        jvmti_env->Deallocate(reinterpret_cast<unsigned char*>(table));
+    }
+    else {
+        name<<"@"<<frame.location;
+    }
+    return name.str();
+}
+
+/*
+ * Names the frames of the sites whose objects became shared, while their
+ * methods can still be looked up.
+ */
+static void resolve_sites(JNIEnv* jni_env, jvmtiEnv* jvmti_env) {
+    for(jint id = 1; id <= sites_count; ++id) {
+        site_info* site = sites_by_ID[id];
+        if(site->shared_objects == 0 || !site->frame_names.empty()) continue;
+
+        for(jint f = 0; f < site->depth; ++f) {
+            site->frame_names.push_back(frame_name(site->frames[f], jni_env,
+                                                   jvmti_env));
+        }
+    }
+}
+
+/*
+ * Called by the one thread that moved an object from a local state to
+ * STATE_SHARING. Builds the access list from the entries of the owner and
+ * of the calling thread, which carry ACCESS_WRITE if the thread wrote to the
+ * object, publishes the object as shared, then records the object's class
+ * and size.
+ */
+static void make_shared(jobject object,
+                        ThreadAccessInfo object_access_info,
+                        jint owner_entry,
+                        jint thread_entry,
+                        thread_state* state,
+                        field_info* field,
+                        JNIEnv* jni_env,
+                        jvmtiEnv* jvmti_env) {
+#ifdef DEBUG
+    cout<<"object with id: "<<object_access_info->object_ID
+        << " is shared"<< endl;
+#endif
+    sequence_init(&object_access_info->accesses, owner_entry, thread_entry);
+    object_access_info->accesses_length = 2;
+
+    // The owner and the calling thread are different threads.
+    jint shared_state = STATE_SHARED_READ_ONLY +
+                        ((owner_entry & profiling_io::ACCESS_WRITE) != 0) +
+                        ((thread_entry & profiling_io::ACCESS_WRITE) != 0);
+
+    // The list must be visible before other threads see the object as shared.
+    __sync_synchronize();
+    object_access_info->state = shared_state;
+
+    /*
+     * We update the number of shared objects and the object status here
+     * just in case we lost objects while iterating over the heap
+     */
+    count_statistic(state, &statistics_shard::shared_objects_count, 1);
+
+    jlong obj_size = 0;
+    jvmti_env->GetObjectSize(object, &obj_size);
+    count_statistic(state, &statistics_shard::shared_objects_memory, obj_size);
+    count_sharing_kind(state, shared_state, 1, obj_size);
+    if(tracking == TRACK_SAMPLED)
+        count_estimate(state, &statistics_shard::shared_estimate, obj_size);
+
+    if(field != NULL) {
+        __sync_fetch_and_add(&field->cross_thread_touches, 1);
+        __sync_fetch_and_add(&field->shared_objects, 1);
+        __sync_fetch_and_add(&field->shared_bytes, obj_size);
+    }
+
+    if(object_access_info->site_ID != 0) {
+        site_info* site = sites_by_ID[object_access_info->site_ID];
+        __sync_fetch_and_add(&site->shared_objects, 1);
+        __sync_fetch_and_add(&site->shared_bytes, obj_size);
+    }
+
+    jclass obj_class = jni_env->GetObjectClass(object);
+    class_info* klass = get_class_info(obj_class, jvmti_env);
+    jni_env->DeleteLocalRef(obj_class);
+    __sync_fetch_and_add(&klass->shared_count, 1);
+
+    bool full = profiling_io::buffer_object_info(
+                    &state->object_info_records,
+                    object_access_info->object_ID,
+                    obj_size,
+                    klass->class_ID,
+                    object_access_info->site_ID,
+                    klass->signature);
+#ifdef DEBUG_SHARED
+    cout<<"Class: "<<klass->signature<<endl;
+#endif
+
+    if(full) {
+        flush_thread_state(state, jvmti_env);
+    }
+#ifdef DEBUG_SHARED
+     if(field_name != NULL) {
+        cout<<thread_ID<<*field_name<<endl;
+    }
+    if(method_name != NULL) {
+        cout<<thread_ID<<*method_name<<endl;
+    }
+#endif
+}
+
+/*
+ * Returns the shared state of an object once the given thread wrote to it.
+ * A single writer object stays one if its last write was the thread's. The
+ * sequence is walked back to its last write only, and the write about to be
+ * recorded ends the next walk, so the walks cost one step per entry.
+ */
+static jint written_state(const access_sequence* threads_seq,
+                          jint length,
+                          jint thread_ID,
+                          jint object_state) {
+    if(object_state != STATE_SHARED_SINGLE_WRITER)
+        return (object_state == STATE_SHARED_READ_ONLY ?
+                    STATE_SHARED_SINGLE_WRITER : object_state);
+
+    const jint* threads = sequence_data(threads_seq, length);
+    for(jint i = length - 1; i >= 0; --i) {
+        if(threads[i] & profiling_io::ACCESS_WRITE) {
+            return ((threads[i] & ~profiling_io::ACCESS_WRITE) == thread_ID ?
+                        STATE_SHARED_SINGLE_WRITER :
+                        STATE_SHARED_MULTI_WRITER);
+        }
+    }
+    return STATE_SHARED_SINGLE_WRITER;
+}
+
+/*
+ * Uses the tag of an object as a pointer to a structure that holds information
+ * about that object's thread locality. recieves recent information about
+ * an object, then either creates a record for the object or updates
+ * its existing record.
+ *
+ * The record is only changed through atomic operations on its state, so this
+ * is safe to call without holding the callbacks lock. A touch of an object
+ * that is local to the calling thread costs a single comparison. The field
+ * touched, if the event names one, is only looked up for touches of objects
+ * another thread touched last. 'write' tells a modification from an access.
+ */
+static void update_object(jobject object,
+                          jthread thread,
+                          jclass field_klass,
+                          jfieldID field,
+                          jmethodID method,
+                          jlocation location,
+                          bool write,
+                          JNIEnv* jni_env,
+                          jvmtiEnv* jvmti_env) {
+
+    /*
+     * We restict tracking object to the live phase only, better perfomance,
+     * less errors, and I think we this way track the more intersting results
+     * only.
+     */
+    if(!live_phase) return;
+
+    // No point of work if we have no object!
+    if(object == NULL) return;
+
+    thread_state* state = get_thread_state(thread, jvmti_env);
+    if(state == NULL) return;
+
+    jint thread_ID = state->thread_ID;
+
+   /*
+    *  If the object's tag was not set before, set it and create its initial
+    * info, owned by this thread.
+    */
+    bool created;
+    ThreadAccessInfo object_access_info =
+            get_object_info(object, thread_ID, write, state,
+                            &created, jvmti_env);
+
+    if(object_access_info == NULL || created) return;
+
+    jint thread_entry = (write ? thread_ID | profiling_io::ACCESS_WRITE
+                               : thread_ID);
+
+    // Retry until one of the transitions below succeeds.
+    for(;;) {
+        jint object_state = object_access_info->state;
+
+        if(object_state <= STATE_LOCAL_WRITTEN) {
+            jint owner_ID = object_access_info->thread_ID;
+            if(owner_ID == thread_ID) {
+                // Only the owner's first write changes the record.
+                if(write && object_state == STATE_LOCAL &&
+                   !__sync_bool_compare_and_swap(&object_access_info->state,
+                                                 STATE_LOCAL,
+                                                 STATE_LOCAL_WRITTEN))
+                    continue;
+                break;
+            }
+
+            /*
+             * If an object was touched only by finalizer, only increment
+             * the finalizer shared objects counter.
+             */
+            if(state->is_finalizer) {
+                count_statistic(state,
+                        &statistics_shard::finalizer_shared_objects_count, 1);
+                return;
+            }
+
+            /*
+             * This case occurs when a thread is touching  an object, its
+             * access info structure is created, then the thread is
+             * accessed by another thread as an object this time. In this case,
+             * the thread is local even the previous ID differs from the
+             * current ID.
+             */
+            if(owner_ID == NO_THREAD) {
+                __sync_bool_compare_and_swap(&object_access_info->thread_ID,
+                                             NO_THREAD, thread_ID);
+                continue;
+            }
+
+            if(__sync_bool_compare_and_swap(&object_access_info->state,
+                                            object_state, STATE_SHARING)) {
+                jint owner_entry = (object_state == STATE_LOCAL_WRITTEN ?
+                                    owner_ID | profiling_io::ACCESS_WRITE :
+                                    owner_ID);
+                make_shared(object, object_access_info, owner_entry,
+                            thread_entry, state,
+                            find_field_info(field_klass, field, method,
+                                            location, jvmti_env),
+                            jni_env, jvmti_env);
+                break;
+            }
+        }
+        else if(object_state >= STATE_SHARED_READ_ONLY &&
+                __sync_bool_compare_and_swap(&object_access_info->state,
+                                             object_state,
+                                             STATE_SHARED_LOCKED)) {
+            access_sequence* threads_seq = &object_access_info->accesses;
+            jint length = object_access_info->accesses_length;
+            jint back = sequence_back(threads_seq, length);
+            bool cross_thread = ((back & ~profiling_io::ACCESS_WRITE) !=
+                                 thread_ID);
+
+            jint shared_state = object_state;
+            if(write) {
+                shared_state = written_state(threads_seq, length, thread_ID,
+                                             object_state);
+            }
+
+            if(cross_thread) {
+                jlong bytes = sequence_append(threads_seq, length,
+                                              thread_entry);
+                if(bytes >= 0) {
+                    object_access_info->accesses_length = length + 1;
+                    if(bytes > 0) add_access_lists_memory(bytes);
+                }
+            }
+            else if(write) {
+                sequence_mark_back(threads_seq, length,
+                                   profiling_io::ACCESS_WRITE);
+            }
+
+            __sync_synchronize();
+            object_access_info->state = shared_state;
+
+            // Objects change kind at most twice, they are measured again.
+            if(shared_state != object_state) {
+                jlong obj_size = 0;
+                jvmti_env->GetObjectSize(object, &obj_size);
+                count_sharing_kind(state, object_state, -1, -obj_size);
+                count_sharing_kind(state, shared_state, 1, obj_size);
+            }
+
+            // Looked up once the record is unlocked for other threads.
+            if(cross_thread) {
+                field_info* info = find_field_info(field_klass, field,
+                                                   method, location,
+                                                   jvmti_env);
+                if(info != NULL)
+                    __sync_fetch_and_add(&info->cross_thread_touches, 1);
+            }
+            break;
+        }
+        // Otherwise another thread is changing the record, try again.
+    }
+#ifdef DEBUG
+     cout<< "Object with ID: " << object_access_info->object_ID
+         << " was touched by thread "
+         << get_thread_name(thread, jvmti_env) << endl;
+#endif
+}
+
+/*
+ * Do the last updates to object info, write them to disk, then free the space
+ * occupied by the info.
+ */
+static void record_object_info(jlong tag, jvmtiEnv* jvmti_env) {
+    ThreadAccessInfo object_access_info =
+                reinterpret_cast<ThreadAccessInfo> (tag);
+
+    if(object_access_info->state > STATE_LOCAL_WRITTEN) {
+        access_sequence* threads_seq = &object_access_info->accesses;
+        jint length = object_access_info->accesses_length;
+
+        profiling_io::record_buffer batch;
+        profiling_io::init_buffer(&batch);
+
+        jvmti_env->RawMonitorEnter(write_lock);
+        if(profiling_io::buffer_access_info(&access_records,
+                                            object_access_info->object_ID,
+                                            sequence_data(threads_seq, length),
+                                            length)) {
+            batch = access_records;
+            profiling_io::init_buffer(&access_records);
+        }
+        jvmti_env->RawMonitorExit(write_lock);
+
+        submit_batch(&batch, profiling_io::OBJECT_ACCESSES_RECORDS, jvmti_env);
+        profiling_io::free_buffer(&batch);
+        add_access_lists_memory(-sequence_free(threads_seq, length));
+    }
+    info_pool::recycle(object_access_info);
+}
+
+/*
+ * What the heap walk at the end of tracking collects. When the tracking
+ * state is released, every tag is cleared and local objects are collected
+ * too.
+ */
+struct heap_walk {
+    bool release;
+    vector<jlong> shared_tags;
+    vector<jlong> local_tags;
+    jlong tracked_memory;
+};
+
+/*
+ * Heap iteration callback adding up the memory of tracked objects and
+ * collecting the tags of shared objects, which are untagged so no later free
+ * event records them a second time.
+ */
+static jint JNICALL collect_shared_object(jlong class_tag,
+                                          jlong size,
+                                          jlong* tag_ptr,
+                                          jint length,
+                                          void* user_data) {
+    jlong tag = *tag_ptr;
+    heap_walk* walk = static_cast<heap_walk*>(user_data);
+
+    // Classes and sampled objects no thread touched are not tracked.
+    if(tag & (CLASS_TAG | SITE_TAG)) {
+        if(walk->release) *tag_ptr = 0;
+        return JVMTI_VISIT_OBJECTS;
+    }
+    walk->tracked_memory += size;
+
+    ThreadAccessInfo object_access_info =
+            reinterpret_cast<ThreadAccessInfo> (tag);
+    if(object_access_info->state > STATE_LOCAL_WRITTEN) {
+        walk->shared_tags.push_back(tag);
+        *tag_ptr = 0;
+    }
+    else if(walk->release) {
+        walk->local_tags.push_back(tag);
+        *tag_ptr = 0;
+    }
+    return JVMTI_VISIT_OBJECTS;
+}
+
+/*
+ * Records the shared objects that were never freed. Shared objects are not
+ * kept in a registry while the program runs, the heap is walked once for
+ * their tags instead. The heap callback may not call JVMTI, so the tags are
+ * collected first and recorded after the walk. With 'release' the infos of
+ * local objects are given back as well, and no object keeps a tag.
+ */
+static void record_live_shared_objects(bool release, jvmtiEnv* jvmti_env) {
+    heap_walk walk;
+    walk.release = release;
+    walk.tracked_memory = 0;
+    jvmtiHeapCallbacks callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.heap_iteration_callback = &collect_shared_object;
+
+    jvmtiError err = jvmti_env->IterateThroughHeap(JVMTI_HEAP_FILTER_UNTAGGED,
+                                                   NULL, &callbacks, &walk);
+    if(err != JVMTI_ERROR_NONE) {
+        cout<<"Could not walk the heap, shared objects still alive "
+            <<"are not recorded"<<endl;
+    }
+
+    live_objects_memory = walk.tracked_memory;
+
+    for(size_t i = 0; i < walk.shared_tags.size(); ++i) {
+        record_object_info(walk.shared_tags[i], jvmti_env);
+    }
+    for(size_t i = 0; i < walk.local_tags.size(); ++i) {
+        info_pool::recycle(reinterpret_cast<void*>(walk.local_tags[i]));
+    }
+}
+
+
+/******************************************************************************/
+/* Duty cycled field watches                                                  */
+/******************************************************************************/
+
+/* Installs or removes the access and modification watches of a field. */
+static void set_field_watches(jclass klass,
+                              jfieldID field,
+                              bool enable,
+                              jvmtiEnv* jvmti_env) {
+    if(enable) {
+        jvmti_env->SetFieldAccessWatch(klass, field);
+        jvmti_env->SetFieldModificationWatch(klass, field);
+    }
+    else {
+        jvmti_env->ClearFieldAccessWatch(klass, field);
+        jvmti_env->ClearFieldModificationWatch(klass, field);
+    }
+}
+
+/*
+ * Switches the watches of all recorded fields on or off, and accounts for
+ * the time they were on.
+ */
+static void switch_watches(bool enable, JNIEnv* jni_env, jvmtiEnv* jvmti_env) {
+    jvmti_env->RawMonitorEnter(watch_lock);
+
+    // Once tracking stops, watches are not switched back on.
+    if(enable != watches_enabled && !(enable && agent_threads_stopping)) {
+        for(size_t i = 0; i < watched_fields.size(); ++i) {
+            // The class may have been unloaded since it was recorded.
+            jobject klass = jni_env->NewLocalRef(watched_fields[i].klass);
+            if(klass == NULL) continue;
+
+            set_field_watches(static_cast<jclass>(klass),
+                              watched_fields[i].field, enable, jvmti_env);
+            jni_env->DeleteLocalRef(klass);
+        }
+
+        jlong now;
+        jvmti_env->GetTime(&now);
+        if(enable)
+            watch_window_start = now;
+        else
+            watched_nanos += now - watch_window_start;
+
+        watches_enabled = enable;
+    }
+    jvmti_env->RawMonitorExit(watch_lock);
+}
+
+/* Tells stop_tracking that an agent thread reading the state is done. */
+static void agent_thread_done(jvmtiEnv* jvmti_env) {
+    jvmti_env->RawMonitorEnter(watch_lock);
+    --agent_threads_running;
+    jvmti_env->RawMonitorNotifyAll(watch_lock);
+    jvmti_env->RawMonitorExit(watch_lock);
+}
+
+/*
+ * Waits for the given number of milliseconds, returns false if the agent is
+ * shutting down.
+ */
+static bool agent_thread_sleep(jrawMonitorID monitor,
+                               jlong millis,
+                               jvmtiEnv* jvmti_env) {
+    jvmti_env->RawMonitorEnter(monitor);
+    if(!agent_threads_stopping && millis > 0) {
+        jvmti_env->RawMonitorWait(monitor, millis);
+    }
+    jvmti_env->RawMonitorExit(monitor);
+    return !agent_threads_stopping;
+}
+
+/*
+ * Body of the agent thread that duty cycles the field watches. Watches start
+ * on, so each period begins with its watched window.
+ */
+void JNICALL duty_cycle_thread(jvmtiEnv* jvmti_env,
+                               JNIEnv* jni_env,
+                               void* arg) {
+
+    while(agent_thread_sleep(watch_lock, duty_on_millis, jvmti_env)) {
+        switch_watches(false, jni_env, jvmti_env);
+
+        if(!agent_thread_sleep(watch_lock,
+                               duty_period_millis - duty_on_millis,
+                               jvmti_env))
+            break;
+
+        switch_watches(true, jni_env, jvmti_env);
+    }
+    agent_thread_done(jvmti_env);
+}
+
+
+/******************************************************************************/
+/* Snapshots                                                                  */
+/******************************************************************************/
+
+/* Orders classes by their shared objects, most first. */
+static bool shared_more(const pair<jlong, class_info*>& a,
+                        const pair<jlong, class_info*>& b) {
+    return a.first > b.first;
+}
+
+/*
+ * Formats the current counters and the classes with the most shared objects
+ * as one line of JSON. Class infos are only freed once this thread finished,
+ * so the list is walked without the lock.
+ */
+static string format_snapshot(jvmtiEnv* jvmti_env) {
+    statistics_shard totals = sum_statistics(jvmti_env);
+    jlong now;
+    jvmti_env->GetTime(&now);
+
+    vector<pair<jlong, class_info*> > classes;
+    for(class_info* info = class_infos; info; info = info->next) {
+        jlong shared = info->shared_count;
+        if(shared > 0) classes.push_back(make_pair(shared, info));
+    }
+    size_t top = (classes.size() < (size_t)snapshot_top_classes ?
+                    classes.size() : snapshot_top_classes);
+    partial_sort(classes.begin(), classes.begin() + top, classes.end(),
+                 shared_more);
+
+    ostringstream line;
+    line<< "{\"uptime_ms\": " << (now - live_start_nanos)/1000000
+        << ", \"total_objects\": " << totals.total_objects_count
+        << ", \"total_bytes\": " << objects_memory(totals)
+        << ", \"shared_objects\": " << totals.shared_objects_count
+        << ", \"shared_bytes\": " << totals.shared_objects_memory
+        << ", \"gc_shared_objects\": " << totals.gc_shared_objects_count
+        << ", \"finalizer_shared_objects\": "
+        << totals.finalizer_shared_objects_count;
+    for(int kind = 0; kind < SHARING_KINDS; ++kind) {
+        line<< ", \"" << sharing_kind_names[kind] << "_objects\": "
+            << totals.sharing_kind_count[kind]
+            << ", \"" << sharing_kind_names[kind] << "_bytes\": "
+            << totals.sharing_kind_memory[kind];
+    }
+    if(tracking == TRACK_SAMPLED) {
+        const estimate_sums& tracked = totals.tracked_estimate;
+        const estimate_sums& shared = totals.shared_estimate;
+        line<< ", \"estimate\": {\"objects\": " << (jlong) tracked.objects
+            << ", \"objects_error\": "
+            << (jlong) confidence_error(tracked.objects_variance)
+            << ", \"bytes\": " << (jlong) tracked.bytes
+            << ", \"bytes_error\": "
+            << (jlong) confidence_error(tracked.bytes_variance)
+            << ", \"shared_objects\": " << (jlong) shared.objects
+            << ", \"shared_objects_error\": "
+            << (jlong) confidence_error(shared.objects_variance)
+            << ", \"shared_bytes\": " << (jlong) shared.bytes
+            << ", \"shared_bytes_error\": "
+            << (jlong) confidence_error(shared.bytes_variance)
+            << "}";
+    }
+    line<< ", \"top_classes\": [";
+
+    for(size_t i = 0; i < top; ++i) {
+        line<< (i == 0 ? "{\"class\": \"" : ", {\"class\": \"");
+        for(const char* c = classes[i].second->signature; *c; ++c) {
+            if(*c == '"' || *c == '\\') line<< '\\';
+            line<< *c;
+        }
+        line<< "\", \"shared\": " << classes[i].first << "}";
+    }
+    line<< "]";
+
+    if(measure_overhead) {
+        line<< ", \"overhead\": {";
+        for(int kind = 0; kind < CALLBACK_KINDS; ++kind) {
+            line<< "\"" << callback_names[kind] << "\": {\"calls\": "
+                << totals.callback_calls[kind] << ", \"nanos\": "
+                << totals.callback_nanos[kind] << "}, ";
+        }
+        line<< "\"lock_entries\": " << totals.lock_entries
+            << ", \"lock_wait_nanos\": " << totals.lock_wait_nanos
+            << ", \"access_info_bytes\": " << info_pool::live_bytes()
+            << ", \"access_lists_bytes\": " << access_lists_memory
+            << "}";
+    }
+    line<< "}\n";
+    return line.str();
+}
+
+/*
+ * Appends a snapshot to the snapshot file, or sends it to the Unix domain
+ * socket named by a 'unix:' target. Snapshots nobody listens for are
+ * dropped.
+ */
+static void write_snapshot(const string& snapshot) {
+    if(snapshot_target.compare(0, 5, "unix:") != 0) {
+        ofstream out(snapshot_target.c_str(), ios::out | ios::app);
+        out.write(snapshot.data(), snapshot.size());
+        return;
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, snapshot_target.c_str() + 5,
+            sizeof(address.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) return;
+
+    if(connect(fd, (struct sockaddr*) &address, sizeof(address)) == 0) {
+#ifdef MSG_NOSIGNAL
+        const int flags = MSG_NOSIGNAL;
+#else
+        const int flags = 0;
+#endif
+        size_t sent = 0;
+        while(sent < snapshot.size()) {
+            ssize_t count = send(fd, snapshot.data() + sent,
+                                 snapshot.size() - sent, flags);
+            if(count <= 0) break;
+            sent += count;
+        }
+    }
+    close(fd);
+}
+
+/* Body of the agent thread taking a snapshot every snapshot_millis. */
+void JNICALL snapshot_thread(jvmtiEnv* jvmti_env,
+                             JNIEnv* jni_env,
+                             void* arg) {
+
+    while(agent_thread_sleep(snapshot_lock, snapshot_millis, jvmti_env)) {
+        write_snapshot(format_snapshot(jvmti_env));
+    }
+    agent_thread_done(jvmti_env);
+}
+
+
+/******************************************************************************/
+/* Bytecode instrumentation                                                   */
+/******************************************************************************/
+
+/*
+ * Classes of the Java platform are never rewritten. They live in modules that
+ * cannot read the recorder class, and many of them load before it exists.
+ */
+static bool is_platform_class(const char* name) {
+    static const char* prefixes[] = {
+        "java/", "javax/", "jdk/", "sun/", "com/sun/", "org/xml/", "org/w3c/"
+    };
+    for(size_t i = 0; i < sizeof(prefixes)/sizeof(prefixes[0]); ++i) {
+        if(strncmp(name, prefixes[i], strlen(prefixes[i])) == 0) return true;
+    }
+    return false;
+}
+
+/*
+ * Shared by the recorder natives, handles a field access the same way the
+ * field watch callbacks do. While watches are duty cycled off the recorder
+ * returns at once.
+ */
+static void on_recorded_field(JNIEnv* jni_env, jobject object, bool write) {
+    if(!watches_enabled) return;
+    callback_guard guard;
+    if(guard.stopped) return;
+    callback_timer timer(CALLBACK_RECORDER, true, jvmti);
+    if(sampled_out(object, jvmti)) return;
+
+    if(event_sync == SYNC_MONITOR) enter_callbacks_lock(jvmti);
+    update_object(object, NULL, NULL, NULL, NULL, -1, write, jni_env,
+                  jvmti);
+    if(event_sync == SYNC_MONITOR) jvmti->RawMonitorExit(lock);
+}
+
+/* Native bound to the recorder's field read method. */
+void JNICALL recorder_field_read(JNIEnv* jni_env, jclass klass, jobject object) {
+    on_recorded_field(jni_env, object, false);
+}
+
+/* Native bound to the recorder's field write method. */
+void JNICALL recorder_field_write(JNIEnv* jni_env, jclass klass, jobject object) {
+    on_recorded_field(jni_env, object, true);
+}
+
+/*
+ * Defines the recorder class in the bootstrap loader, so classes of every
+ * loader can see it, and binds its natives. Returns false on failure.
+ */
+static bool define_recorder(JNIEnv* jni_env) {
+    vector<unsigned char> class_data;
+    class_rewriter::build_recorder_class(&class_data);
+
+    jclass recorder = jni_env->DefineClass(
+            class_rewriter::recorder_class_name, NULL,
+            reinterpret_cast<const jbyte*>(&class_data[0]), class_data.size());
+    if(recorder == NULL) {
+        jni_env->ExceptionClear();
+        return false;
+    }
+
+    JNINativeMethod natives[2];
+    natives[0].name = const_cast<char*>(class_rewriter::field_read_method);
+    natives[0].signature =
+            const_cast<char*>(class_rewriter::recorder_method_signature);
+    natives[0].fnPtr = reinterpret_cast<void*>(&recorder_field_read);
+    natives[1].name = const_cast<char*>(class_rewriter::field_write_method);
+    natives[1].signature =
+            const_cast<char*>(class_rewriter::recorder_method_signature);
+    natives[1].fnPtr = reinterpret_cast<void*>(&recorder_field_write);
+
+    jint err = jni_env->RegisterNatives(recorder, natives, 2);
+    jni_env->DeleteLocalRef(recorder);
+    if(err != JNI_OK) {
+        jni_env->ExceptionClear();
+        return false;
+    }
+    return true;
+}
+
+
+/******************************************************************************/
+/* Profiling windows                                                          */
+/******************************************************************************/
+
+/*
+ * Enables or disables the events posting allocations to cb_object_alloc.
+ * Objects the VM allocates itself are only posted when the VM does not
+ * sample allocations, as they are not a sample of the heap.
+ */
+static void switch_allocation_events(bool enable, jvmtiEnv* env) {
+    jvmtiEventMode mode = (enable ? JVMTI_ENABLE : JVMTI_DISABLE);
+    if(!enable || !allocations_sampled)
+        env->SetEventNotificationMode(mode, JVMTI_EVENT_VM_OBJECT_ALLOC, NULL);
+#ifdef JVMTI_VERSION_11
+    if(!enable || allocations_sampled)
+        env->SetEventNotificationMode(mode, JVMTI_EVENT_SAMPLED_OBJECT_ALLOC,
+                                      NULL);
+#endif
+    allocation_events = enable;
+}
 
-    //Set a unique identifier for the object and init its info.
-    ThreadAccessInfo access_info =
-            (ThreadAccessInfo) malloc(sizeof(struct thread_access_info));
-    access_info->object_ID = id_generator;
-    access_info->is_thread_local = true;
-    access_info->thread_ID = thread_ID;
+/*
+ * Stops tracking objects at VM death or when a profiling window closes. The
+ * agent threads are told to finish and waited for, as are the callbacks
+ * still running. Then the shared objects still alive are recorded, and the
+ * writer drains its queue, later batches are written directly. With
+ * 'release' the watches are cleared and no object keeps its tag, as the VM
+ * goes on running. tracking_stopped is set by the caller.
+ */
+static void stop_tracking(bool release, JNIEnv* jni_env, jvmtiEnv* jvmti_env) {
+    live_phase = false;
+    jvmti_env->GetTime(&live_end_nanos);
+
+    jvmti_env->RawMonitorEnter(watch_lock);
+    agent_threads_stopping = true;
+    jvmti_env->RawMonitorNotifyAll(watch_lock);
+    jvmti_env->RawMonitorExit(watch_lock);
+
+    if(release) switch_watches(false, jni_env, jvmti_env);
+    if(allocation_events) switch_allocation_events(false, jvmti_env);
+
+    jvmti_env->RawMonitorEnter(watch_lock);
+    if(watches_enabled)
+        watched_nanos += live_end_nanos - watch_window_start;
+    jvmti_env->RawMonitorExit(watch_lock);
+
+    jvmti_env->RawMonitorEnter(snapshot_lock);
+    jvmti_env->RawMonitorNotifyAll(snapshot_lock);
+    jvmti_env->RawMonitorExit(snapshot_lock);
+
+    jvmti_env->RawMonitorEnter(window_lock);
+    jvmti_env->RawMonitorNotifyAll(window_lock);
+    jvmti_env->RawMonitorExit(window_lock);
+
+    jvmti_env->RawMonitorEnter(watch_lock);
+    while(agent_threads_running > 0) {
+        jvmti_env->RawMonitorWait(watch_lock, 0);
+    }
+    jvmti_env->RawMonitorExit(watch_lock);
 
-    jlong obj_size = -1;
-    jvmti_env->GetObjectSize(object, &obj_size);
+    // Nothing is recorded or released while a callback may still use it.
+    wait_for_callbacks(jvmti_env);
 
-    total_objects_memory += obj_size;
-    ++total_objects_count;
+    // The heap can only be walked in the live phase, not on unload.
+    record_live_shared_objects(release, jvmti_env);
+    if(site_depth > 0) resolve_sites(jni_env, jvmti_env);
 
-    // new id for the next object with no tag.
-    ++id_generator;
+    jvmti_env->RawMonitorEnter(write_lock);
+    jvmti_env->RawMonitorNotifyAll(write_lock);
+    while(writer_running) {
+        jvmti_env->RawMonitorWait(write_lock, 0);
+    }
+    jvmti_env->RawMonitorExit(write_lock);
+}
 
-    return access_info;
+/*
+ * Writes the counters of the fields other threads touched to the object info
+ * file. The writer thread is done by now, so they are written directly.
+ */
+static void write_field_table(jvmtiEnv* jvmti_env) {
+    vector<field_info*> fields = shared_fields();
+    vector<profiling_io::field_record> records(fields.size());
+
+    for(size_t i = 0; i < fields.size(); ++i) {
+        records[i].field_ID = fields[i]->field_ID;
+        records[i].class_ID = fields[i]->klass->class_ID;
+        records[i].object_class = fields[i]->klass->signature;
+        records[i].field_name = fields[i]->name;
+        records[i].cross_thread_touches = fields[i]->cross_thread_touches;
+        records[i].shared_objects = fields[i]->shared_objects;
+        records[i].shared_bytes = fields[i]->shared_bytes;
+    }
+
+    jvmti_env->RawMonitorEnter(io_lock);
+    profiling_io::write_field_table(records);
+    jvmti_env->RawMonitorExit(io_lock);
 }
 
 /*
- * Uses the tag of an object as a pointer to a structure that holds information
- * about that object's thread locality. recieves recent information about
- * an object, then either creates a record for the object or updates
- * its existing record.
- * TODO right the procedural checks applied by this function
+ * Writes the frames of the sites whose objects became shared to the object
+ * info file, directly as well.
  */
-static void update_object(jobject object,
-                          jthread thread,
-                          JNIEnv* jni_env,
-                          jvmtiEnv* jvmti_env) {
+static void write_site_table(jvmtiEnv* jvmti_env) {
+    vector<site_info*> sites = shared_sites();
+    vector<profiling_io::site_record> records(sites.size());
 
-    /*
-     * We restict tracking object to the live phase only, better perfomance,
-     * less errors, and I think we this way track the more intersting results
-     * only.
-     */
-    jvmtiPhase currentPhase;
-    jvmti_env->GetPhase(&currentPhase);
-    if(currentPhase != JVMTI_PHASE_LIVE) return;
+    for(size_t i = 0; i < sites.size(); ++i) {
+        records[i].site_ID = sites[i]->site_ID;
+        records[i].frames = sites[i]->frame_names;
+    }
 
-    // No point of work if we have no object!
-    if(object == NULL) return;
+    jvmti_env->RawMonitorEnter(io_lock);
+    profiling_io::write_site_table(records);
+    jvmti_env->RawMonitorExit(io_lock);
+}
 
-    /*
-     * Threads are objects, we need to tag them as well
-     * We cannot use a jthread for thread identification, thus we must tag
-     * threads. The reason is that jthreads move in memory, jthread is merely
-     * an address in memory, thus it cannot be used for identification.
-     */
-    jlong thread_tag_value = get_tag(thread, jvmti_env);
-    jlong object_tag_value = get_tag(object, jvmti_env);
+/*
+ * Writes the records still batched and the summary, then closes the output
+ * files. Done once, on unload or when a profiling window closes.
+ */
+static void write_results(jvmtiEnv* jvmti_env) {
+    if(results_written) return;
 
-    // Not much we can do about it.
-    if(thread_tag_value == -1 || object_tag_value == -1){
-        return;
+    for(thread_state* state = thread_states; state; state = state->next) {
+        flush_thread_state(state, jvmti_env);
     }
+    submit_batch(&access_records, profiling_io::OBJECT_ACCESSES_RECORDS,
+                 jvmti_env);
+    profiling_io::free_buffer(&access_records);
+    write_field_table(jvmti_env);
+    if(site_depth > 0) write_site_table(jvmti_env);
+    output_result();
+    profiling_io::close_write();
 
-    // the following code assumes that we have a valid tag values
+    // No records refer to the class signatures any more.
+    while(class_infos != NULL) {
+        class_info* info = class_infos;
+        class_infos = info->next;
+        while(info->fields != NULL) {
+            field_info* field = info->fields;
+            info->fields = field->next;
+            free(field->name);
+            delete field;
+        }
+        free(info->signature);
+        delete info;
+    }
+    untagged_class_infos.clear();
+    for(int i = 0; i < field_site_buckets_count; ++i) {
+        while(field_site_buckets[i] != NULL) {
+            field_site* site = field_site_buckets[i];
+            field_site_buckets[i] = site->next;
+            delete site;
+        }
+    }
+    field_sites_count = 0;
 
-    ThreadAccessInfo thread_as_object_access_info, object_access_info;
-    // if a thread is not tagged, tag it and create an info structure for it.
-    if (thread_tag_value == 0) {
-        thread_as_object_access_info =
-                create_object_info(thread, NO_THREAD, jvmti_env);
+    // No objects refer to sites any more, allocations are not posted.
+    for(jint id = 1; id <= sites_count; ++id) {
+        delete sites_by_ID[id];
+        sites_by_ID[id] = NULL;
+    }
+    memset((void*) site_buckets, 0, sizeof(site_buckets));
+    sites_count = 0;
 
-        // Make the reference to the info structure the tag of the thread.
-        jvmtiError err = jvmti_env->SetTag(thread,
-                                            reinterpret_cast<jlong>(
-                                            thread_as_object_access_info));
-#ifdef DEBUG
-        if(err != JVMTI_ERROR_NONE )
-            cout<<"something went so wrong with tagging a thread!"<<endl;
-#endif
+    jvmti_env->RawMonitorEnter(window_lock);
+    results_written = true;
+    jvmti_env->RawMonitorNotifyAll(window_lock);
+    jvmti_env->RawMonitorExit(window_lock);
+}
 
-    }
-    else { // otherwise,retrieve its information
-        thread_as_object_access_info =
-                reinterpret_cast<ThreadAccessInfo>(thread_tag_value);
+/*
+ * Releases the state of every thread once a profiling window closed. Threads
+ * that already ended released their own.
+ */
+static void release_thread_states(JNIEnv* jni_env, jvmtiEnv* jvmti_env) {
+    jint thread_count = 0;
+    jthread* threads = NULL;
+
+    if(jvmti_env->GetAllThreads(&thread_count, &threads) == JVMTI_ERROR_NONE) {
+        for(jint i = 0; i < thread_count; ++i) {
+            jvmti_env->SetThreadLocalStorage(threads[i], NULL);
+            jni_env->DeleteLocalRef(threads[i]);
+        }
+        jvmti_env->Deallocate(reinterpret_cast<unsigned char*>(threads));
     }
 
-    // At this point, thread_as_object_access_info should be properly
-    // initialized.
+    jvmti_env->RawMonitorEnter(lock);
+    thread_state* states = thread_states;
+    thread_states = NULL;
+    jvmti_env->RawMonitorExit(lock);
 
-   /*
-    *  If the object's tag was not set before, set it and create its initial
-    * info.
-    */
-    if (object_tag_value == 0) {
-        // at this point we are sure that the thread is properly tagged
-        object_access_info = create_object_info(object,
-                thread_as_object_access_info->object_ID, jvmti_env);
+    jvmti_env->RawMonitorEnter(statistics_lock);
+    statistics_shards = NULL;
+    jvmti_env->RawMonitorExit(statistics_lock);
 
-      // Make the reference to the info structure the tag of the object.
-      jvmti_env->SetTag(object, reinterpret_cast<jlong>(object_access_info));
+    while(states != NULL) {
+        thread_state* state = states;
+        states = state->next;
+        profiling_io::free_buffer(&state->object_info_records);
+        info_pool::release_cache(&state->info_cache);
+        delete state;
     }
-    else {
-        object_access_info =
-                reinterpret_cast<ThreadAccessInfo>(object_tag_value);
+}
 
-        if(object_access_info->is_thread_local &&
-           object_access_info->thread_ID !=
-           thread_as_object_access_info->object_ID) {
+/*
+ * Closes the profiling window: no more events are taken, the results are
+ * written out and everything the agent tracked is released.
+ */
+static void close_profiling_window(JNIEnv* jni_env, jvmtiEnv* jvmti_env) {
+    if(!__sync_bool_compare_and_swap(&tracking_stopped, 0, 1)) return;
+
+    const jvmtiEvent events[] = {
+        JVMTI_EVENT_FIELD_ACCESS, JVMTI_EVENT_FIELD_MODIFICATION,
+        JVMTI_EVENT_METHOD_ENTRY, JVMTI_EVENT_CLASS_PREPARE,
+        JVMTI_EVENT_CLASS_FILE_LOAD_HOOK, JVMTI_EVENT_THREAD_START,
+        JVMTI_EVENT_THREAD_END
+    };
+    for(size_t i = 0; i < sizeof(events)/sizeof(events[0]); ++i) {
+        jvmti_env->SetEventNotificationMode(JVMTI_DISABLE, events[i], NULL);
+    }
 
-            /*
-             * If an object was touched only by finalizer, only increment
-             * the finalizer shared objects counter.
-             */
-            if(get_thread_name(thread, jvmti_env).compare("Finalizer") == 0) {
-                ++finalizer_shared_objects_count;
-                return;
-            }
+    stop_tracking(true, jni_env, jvmti_env);
 
-            /*
-             * This case occurs when a thread is touching  an object, its
-             * access info structure is created, then the thread is
-             * accessed by another thread as an object this time. In this case,
-             * the thread is local even the previous ID differs from the
-             * current ID.
-             */
-            if(object_access_info->thread_ID == NO_THREAD) {
-                object_access_info->thread_ID =
-                        thread_as_object_access_info->object_ID;
-                return;
-            }
-#ifdef DEBUG
-            cout<<"object with id: "<<object_access_info->object_ID
-                << " is shared"<< endl;
-#endif
-            list<jlong> *threads_seq = new list<jlong>;
-            threads_seq->push_back(object_access_info->thread_ID);
-            threads_seq->push_back(thread_as_object_access_info->object_ID);
-            object_access_info->accesses = threads_seq;
+    // No object carries a tag any more, so no more frees are reported.
+    jvmti_env->SetEventNotificationMode(JVMTI_DISABLE,
+                                        JVMTI_EVENT_OBJECT_FREE, NULL);
 
-            object_access_info->is_thread_local = false;
-            /*
-             * We update the number of shared objects and the object status here
-             * just in case we lost objects while iterating over the heap
-             */
-            ++shared_objects_count;
+    write_results(jvmti_env);
+    release_thread_states(jni_env, jvmti_env);
+    // No records are in use or cached any more.
+    info_pool::release_pool();
+    cout<<"\nProfiling window of "<<profile_millis/1000<<" s closed"<<endl;
+}
 
-            jlong obj_size = 0;
-            jvmti_env->GetObjectSize(object, &obj_size);
-            jclass obj_class = jni_env->GetObjectClass(object);
-            shared_objects_memory += obj_size;
-
-            char* klass_signature;
-            jvmtiError err =
-                    jvmti_env->GetClassSignature(
-                    obj_class, &klass_signature, NULL);
-            
-            if(err == JVMTI_ERROR_NONE) {
-                profiling_io::write_object_info(object_access_info->object_ID,
-                                            obj_size,
-                                            klass_signature);
-#ifdef DEBUG_SHARED
-                cout<<"Class: "klass_signature<<endl;
-#endif
-            }
-            else
-                profiling_io::write_object_info(object_access_info->object_ID,
-                                            obj_size,
-                                            "?");
-#ifdef DEBUG_SHARED
-             if(field_name != NULL) {
-                cout<<object_access_info->accesses->back()<<*field_name<<endl;
-            }
-            if(method_name != NULL) {
-                cout<<object_access_info->accesses->back()<<*method_name<<endl;
-            }
-#endif
+/* Body of the agent thread that closes the profiling window. */
+void JNICALL profile_window_thread(jvmtiEnv* jvmti_env,
+                                   JNIEnv* jni_env,
+                                   void* arg) {
 
-            // Keep a reference to the shared object.
-            shared_objects_tags.insert(object_tag_value);
-            jvmti_env->
-            Deallocate(reinterpret_cast<unsigned char*> (klass_signature));           
-        }
-        else if(!(object_access_info->is_thread_local)) {
-            list<jlong> *threads_seq = object_access_info->accesses;
-                if(threads_seq->back() != thread_as_object_access_info->object_ID)
-                    threads_seq->push_back(thread_as_object_access_info->object_ID);
-        }
-    }
-#ifdef DEBUG
-     cout<< "Object with ID: " << object_access_info->object_ID
-         << " was touched by thread "
-         << get_thread_name(thread, jvmti_env) << endl;
-#endif
+    if(agent_thread_sleep(window_lock, profile_millis, jvmti_env))
+        close_profiling_window(jni_env, jvmti_env);
 }
 
+void JNICALL cb_class_prepare(jvmtiEnv *jvmti_env,
+                              JNIEnv* jni_env,
+                              jthread thread,
+                              jclass klass);
+
 /*
- * Do the last updates to object info, write them to disk, then free the space
- * occupied by the info.
+ * An agent attached to a running VM missed the class prepare events of the
+ * classes already loaded, they are watched here by the same rules.
  */
-static void record_object_info(jlong tag) {
-    ThreadAccessInfo object_access_info =
-                reinterpret_cast<ThreadAccessInfo> (tag);
+static void watch_loaded_classes(JNIEnv* jni_env, jvmtiEnv* jvmti_env) {
+    jint class_count = 0;
+    jclass* classes = NULL;
+
+    if(jvmti_env->GetLoadedClasses(&class_count, &classes) != JVMTI_ERROR_NONE)
+        return;
 
-    if(!(object_access_info->is_thread_local)) {
-        list<jlong> *threads_seq = object_access_info->accesses;
-        profiling_io::write_access_info(
-            object_access_info->object_ID, threads_seq);
-        delete threads_seq;
-        if(program_running)
-            shared_objects_tags.erase(tag);
+    for(jint i = 0; i < class_count; ++i) {
+        jint status = 0;
+        jvmti_env->GetClassStatus(classes[i], &status);
+
+        if((status & JVMTI_CLASS_STATUS_PREPARED) &&
+           !(status & (JVMTI_CLASS_STATUS_ARRAY |
+                       JVMTI_CLASS_STATUS_PRIMITIVE))) {
+            cb_class_prepare(jvmti_env, jni_env, NULL, classes[i]);
+        }
+        jni_env->DeleteLocalRef(classes[i]);
     }
-    free(object_access_info);
+    jvmti_env->Deallocate(reinterpret_cast<unsigned char*>(classes));
 }
 
 
@@ -504,22 +3013,53 @@ static void record_object_info(jlong tag) {
  * Set field access and modifictaion watches on all fields of all classes loaded
  * by the JVM. This is needed to be able to recieve field access and
  * modification events, since we cannot do so unless the fields are being
- * watched for such events.
+ * watched for such events. When watches are duty cycled, the fields are also
+ * recorded and only watched if the current window is on.
  *
  * NOTES: We ignore static fields and synthetic fields. Synthetic fields are
  * generated by the compiler but not present in the original source code.
+ * Classes rejected by the include and exclude filters are not watched at all.
  */
 void JNICALL cb_class_prepare(  jvmtiEnv *jvmti_env,
                                 JNIEnv* jni_env,
                                 jthread thread,
                                 jclass klass) {
 
+    callback_guard guard;
+    if(guard.stopped) return;
+    callback_timer timer(CALLBACK_CLASS_PREPARE, true, jvmti_env);
     jint field_number;
     jfieldID *field_IDs;
 
+    // The bytecode engine instruments classes as they load instead.
+    if(engine == ENGINE_BYTECODE) {
+        get_class_info(klass, jvmti_env);
+        return;
+    }
+
+    /*
+     * Classes rejected by the filters are never watched, so they cost
+     * nothing at run time, they do not even get a class info.
+     */
+    char* signature = NULL;
+    jvmti_env->GetClassSignature(klass, &signature, NULL);
+    if(!is_class_watched(signature != NULL ? signature : "?")) {
+        jvmti_env->Deallocate(reinterpret_cast<unsigned char*>(signature));
+        __sync_fetch_and_add(&filtered_classes_count, 1);
+        return;
+    }
+    __sync_fetch_and_add(&watched_classes_count, 1);
+
+    // Resolved once, for the output.
+    class_info* info = intern_class_info(klass,
+                                         signature != NULL ? signature : "?",
+                                         jvmti_env);
+    jvmti_env->Deallocate(reinterpret_cast<unsigned char*>(signature));
+
     jvmti_env->GetClassFields(klass, &field_number, &field_IDs);
 
     if(field_IDs) {
+        vector<jfieldID> fields;
 
         for(int i = 0; i < field_number; i++) {
 
@@ -536,12 +3076,81 @@ void JNICALL cb_class_prepare(  jvmtiEnv *jvmti_env,
             if(access_flags & 0x0008) {
                 continue;
             }
-
-            jvmti_env->SetFieldAccessWatch(klass,field_IDs[i]);
-            jvmti_env->SetFieldModificationWatch(klass,field_IDs[i]);
+            fields.push_back(field_IDs[i]);
         }
         jvmti_env->Deallocate(reinterpret_cast<unsigned char*>(field_IDs));
+
+        // Events may come as soon as a field is watched.
+        add_field_infos(info, klass, fields, jvmti_env);
+        __sync_fetch_and_add(&watched_fields_count, fields.size());
+
+        for(size_t i = 0; i < fields.size(); i++) {
+            // Only switched watches need to be remembered.
+            if(duty_period_millis == 0 && profile_millis == 0) {
+                set_field_watches(klass, fields[i], true, jvmti_env);
+                continue;
+            }
+
+            // Remember the field so its watches can be switched later.
+            watched_field watched;
+            watched.klass = jni_env->NewWeakGlobalRef(klass);
+            watched.field = fields[i];
+
+            jvmti_env->RawMonitorEnter(watch_lock);
+            watched_fields.push_back(watched);
+            if(watches_enabled)
+                set_field_watches(klass, fields[i], true, jvmti_env);
+            jvmti_env->RawMonitorExit(watch_lock);
+        }
+    }
+}
+
+/*
+ * Rewrites classes for the bytecode engine as they load. Classes of the
+ * bootstrap loader and of the Java platform are left alone, as are classes
+ * rejected by the include and exclude filters.
+ */
+void JNICALL cb_class_file_load_hook(jvmtiEnv *jvmti_env,
+                                     JNIEnv* jni_env,
+                                     jclass class_being_redefined,
+                                     jobject loader,
+                                     const char* name,
+                                     jobject protection_domain,
+                                     jint class_data_len,
+                                     const unsigned char* class_data,
+                                     jint* new_class_data_len,
+                                     unsigned char** new_class_data) {
+
+    callback_guard guard;
+    if(guard.stopped) return;
+    callback_timer timer(CALLBACK_CLASS_FILE_LOAD_HOOK, true, jvmti_env);
+    if(!recorder_ready || loader == NULL || name == NULL) return;
+    if(class_being_redefined != NULL || is_platform_class(name)) return;
+
+    // The filters work on signatures, "Lcom/foo/Bar;".
+    string signature = "L" + string(name) + ";";
+    if(!is_class_watched(signature.c_str())) {
+        __sync_fetch_and_add(&filtered_classes_count, 1);
+        return;
     }
+    __sync_fetch_and_add(&watched_classes_count, 1);
+
+    vector<unsigned char> rewritten;
+    int methods;
+    if(!class_rewriter::rewrite_class(class_data, class_data_len,
+                                      &rewritten, &methods))
+        return;
+
+    // The VM takes ownership of the new class data.
+    unsigned char* data = NULL;
+    if(jvmti_env->Allocate(rewritten.size(), &data) != JVMTI_ERROR_NONE)
+        return;
+    memcpy(data, &rewritten[0], rewritten.size());
+
+    *new_class_data_len = rewritten.size();
+    *new_class_data = data;
+    __sync_fetch_and_add(&instrumented_classes_count, 1);
+    __sync_fetch_and_add(&instrumented_methods_count, methods);
 }
 
 /*
@@ -559,15 +3168,20 @@ void JNICALL cb_field_access( jvmtiEnv *jvmti_env,
 #ifdef DEBUG
      output_field_info(field, fieldklass, thread, jvmti_env);
 #endif
-     jvmti_env->RawMonitorEnter(lock);
+     callback_guard guard;
+     if(guard.stopped) return;
+     callback_timer timer(CALLBACK_FIELD_ACCESS, true, jvmti_env);
+     if(sampled_out(object, jvmti_env)) return;
+     if(event_sync == SYNC_MONITOR) enter_callbacks_lock(jvmti_env);
 
 //     if(field_name != NULL)
 //          delete field_name;
 //     field_name = new string;
 //     field_name->assign(get_field_name(field, fieldklass, jvmti_env));
 
-     update_object(object, thread, jni_env, jvmti_env);
-      jvmti_env->RawMonitorExit(lock);
+     update_object(object, thread, fieldklass, field, method, location,
+                   false, jni_env, jvmti_env);
+     if(event_sync == SYNC_MONITOR) jvmti_env->RawMonitorExit(lock);
 }
 
 /*
@@ -587,15 +3201,20 @@ void JNICALL cb_field_modification( jvmtiEnv *jvmti_env,
 #ifdef DEBUG
     output_field_info(field, fieldklass, thread, jvmti_env);
 #endif
-    jvmti_env->RawMonitorEnter(lock);
+    callback_guard guard;
+    if(guard.stopped) return;
+    callback_timer timer(CALLBACK_FIELD_MODIFICATION, true, jvmti_env);
+    if(sampled_out(object, jvmti_env)) return;
+    if(event_sync == SYNC_MONITOR) enter_callbacks_lock(jvmti_env);
 
 //     if(field_name != NULL)
 //          delete field_name;
 //    field_name = new string;
 //    field_name->assign(get_field_name(field, fieldklass, jvmti_env));
 
-    update_object(object, thread, jni_env, jvmti_env);
-    jvmti_env->RawMonitorExit(lock);
+    update_object(object, thread, fieldklass, field, method, location,
+                  true, jni_env, jvmti_env);
+    if(event_sync == SYNC_MONITOR) jvmti_env->RawMonitorExit(lock);
 }
 /*
  * Callback for method entry event.
@@ -613,15 +3232,21 @@ void JNICALL cb_method_entry(jvmtiEnv *jvmti_env,
      * TODO maybe it is safe to remove this check now, as we do it again
      * when trying to update an object
      */
-    jvmtiPhase currentPhase;
-    jvmti_env->GetPhase(&currentPhase);
-    if(currentPhase != JVMTI_PHASE_LIVE) return;
+    if(!live_phase) return;
 
+    /*
+     * Nothing below needs the lock yet, do not serialize threads on it.
+     * Sampled tracking does not track receivers either.
+     */
+    if(event_sync == SYNC_ATOMIC || tracking == TRACK_SAMPLED) return;
+    callback_guard guard;
+    if(guard.stopped) return;
+    callback_timer timer(CALLBACK_METHOD_ENTRY, true, jvmti_env);
 
 #ifdef DEBUG
     output_method_info(method, thread, jvmti_env);
 #endif
-    jvmti_env->RawMonitorEnter(lock);
+    enter_callbacks_lock(jvmti_env);
     /*
      * 'this' resides in slot 0 of the stack frame (at depth 0 also according to
      * my research!).
@@ -641,6 +3266,39 @@ void JNICALL cb_method_entry(jvmtiEnv *jvmti_env,
     jvmti_env->RawMonitorExit(lock);
 }
 
+/*
+ * A sampled allocation, or an object the VM allocated itself. The object
+ * is new, so no other thread can tag it, and it is tagged with the site of
+ * the allocating stack and its size. When tracking is sampled the object is
+ * tagged even without a site, the tag is what makes it tracked.
+ */
+void JNICALL cb_object_alloc(jvmtiEnv *jvmti_env,
+                             JNIEnv* jni_env,
+                             jthread thread,
+                             jobject object,
+                             jclass object_klass,
+                             jlong size) {
+    if(!live_phase) return;
+    callback_guard guard;
+    if(guard.stopped) return;
+    callback_timer timer(CALLBACK_OBJECT_ALLOC, false, jvmti_env);
+
+    __sync_fetch_and_add(&sampled_allocations, 1);
+
+    jint site_ID = 0;
+    jvmtiFrameInfo frames[max_site_depth];
+    jint depth = 0;
+    if(site_depth > 0 &&
+       jvmti_env->GetStackTrace(thread, 0, site_depth, frames, &depth) ==
+            JVMTI_ERROR_NONE && depth > 0)
+        site_ID = intern_site(frames, depth, jvmti_env);
+
+    if((site_ID != 0 || tracking == TRACK_SAMPLED) &&
+       get_tag(object, jvmti_env) == 0)
+        jvmti_env->SetTag(object, (size << SITE_TAG_SIZE_SHIFT) |
+                                  ((jlong) site_ID << 2) | SITE_TAG);
+}
+
 /*
  * Handle when an object is garbage collected. if it was touched by a thread
  * other than the garbage collector, mark it as gc-shared. We do so to
@@ -649,6 +3307,17 @@ void JNICALL cb_method_entry(jvmtiEnv *jvmti_env,
  *
  */
 void JNICALL cb_object_free(jvmtiEnv *jvmti_env, jlong tag) {
+    // Objects freed while tracking stops are not recorded.
+    callback_guard guard;
+    if(guard.stopped) return;
+    callback_timer timer(CALLBACK_OBJECT_FREE, false, jvmti_env);
+
+    /*
+     * An unloaded class, its info may still be referred to by records, or a
+     * sampled object no thread touched.
+     */
+    if(tag & (CLASS_TAG | SITE_TAG)) return;
+
     ThreadAccessInfo object_access_info =
             reinterpret_cast<ThreadAccessInfo> (tag);
     /*
@@ -659,10 +3328,10 @@ void JNICALL cb_object_free(jvmtiEnv *jvmti_env, jlong tag) {
      * these we do not count as shared due to gc, they are shared due to other
      * threads.
      */
-    if (object_access_info->is_thread_local) {
-        ++gc_shared_objects_count;
+    if (object_access_info->state <= STATE_LOCAL_WRITTEN) {
+        count_statistic(NULL, &statistics_shard::gc_shared_objects_count, 1);
     }
-    record_object_info(tag);
+    record_object_info(tag, jvmti_env);
 }
 
 /*
@@ -672,84 +3341,243 @@ void JNICALL cb_thread_start(jvmtiEnv *jvmti_env,
                          JNIEnv* jni_env,
                          jthread thread) {
 
-    jvmtiPhase currentPhase;
-    jvmti_env->GetPhase(&currentPhase);
-    if(currentPhase != JVMTI_PHASE_LIVE) return;
+    if(!live_phase) return;
+    callback_guard guard;
+    if(guard.stopped) return;
+    callback_timer timer(CALLBACK_THREAD_START, true, jvmti_env);
 
-    string name = get_thread_name(thread, jvmti_env);
+    // Tags the thread and records its name.
+    get_thread_state(thread, jvmti_env);
+}
 
-#ifdef DEBUG
-    cout<<"Starting thread: "<<name<<endl;
-#endif
+/*
+ * Flush the records a finishing thread still holds and release its state.
+ */
+void JNICALL cb_thread_end(jvmtiEnv *jvmti_env,
+                           JNIEnv* jni_env,
+                           jthread thread) {
+
+    // Once tracking stopped the states are released with the others.
+    callback_guard guard;
+    if(guard.stopped) return;
+    callback_timer timer(CALLBACK_THREAD_END, true, jvmti_env);
+    thread_state* state = NULL;
+    jvmti_env->GetThreadLocalStorage(thread, reinterpret_cast<void**>(&state));
+    if(state == NULL) return;
 
     jvmti_env->RawMonitorEnter(lock);
+    thread_state** link = &thread_states;
+    while(*link != state) {
+        link = &(*link)->next;
+    }
+    *link = state->next;
+    jvmti_env->RawMonitorExit(lock);
 
-    jlong tag = -1;
+    jvmti_env->RawMonitorEnter(statistics_lock);
+    statistics_shard** shard = &statistics_shards;
+    while(*shard != &state->statistics) {
+        shard = &(*shard)->next;
+    }
+    *shard = state->statistics.next;
+    add_statistics(&retired_statistics, state->statistics);
+    jvmti_env->RawMonitorExit(statistics_lock);
+
+    flush_thread_state(state, jvmti_env);
+    profiling_io::free_buffer(&state->object_info_records);
+    info_pool::release_cache(&state->info_cache);
+    delete state;
+    jvmti_env->SetThreadLocalStorage(thread, NULL);
+}
 
-    jvmti_env->GetTag(thread, &tag);
+/*
+ * The VM is entering the live phase, start tracking objects.
+ */
+void JNICALL cb_vm_init(jvmtiEnv *jvmti_env,
+                        JNIEnv* jni_env,
+                        jthread thread) {
+    jvmti_env->GetTime(&live_start_nanos);
+    watch_window_start = live_start_nanos;
+
+    if(engine == ENGINE_BYTECODE) {
+        recorder_ready = define_recorder(jni_env);
+        if(!recorder_ready)
+            cout<<"Could not define the recorder class, "
+                <<"no classes will be instrumented"<<endl;
+    }
 
-    if(tag == -1) {
-        jvmti_env->RawMonitorExit(lock);
-#ifdef DEBUG
-        cout<<"could not fetch thread\'s tag!"<<endl;
-#endif
+    // Started before any records are produced, so none are queued in vain.
+    writer_running = true;
+    if(!start_agent_thread("Thread Locality Writer", &writer_thread,
+                           jni_env, jvmti_env)) {
+        writer_running = false;
+        cout<<"Could not start the writer thread, "
+            <<"records are written synchronously"<<endl;
+    }
+    live_phase = true;
+
+    if(duty_period_millis > 0) {
+        agent_threads_running++;
+        if(!start_agent_thread("Thread Locality Duty Cycle",
+                               &duty_cycle_thread, jni_env, jvmti_env)) {
+            agent_thread_done(jvmti_env);
+            cout<<"Could not start the duty cycle thread, "
+                <<"fields stay watched"<<endl;
+        }
+    }
+
+    if(snapshot_millis > 0) {
+        agent_threads_running++;
+        if(!start_agent_thread("Thread Locality Snapshots", &snapshot_thread,
+                               jni_env, jvmti_env)) {
+            agent_thread_done(jvmti_env);
+            cout<<"Could not start the snapshot thread"<<endl;
+        }
+    }
+
+    if(profile_millis > 0 &&
+       !start_agent_thread("Thread Locality Window", &profile_window_thread,
+                           jni_env, jvmti_env)) {
+        cout<<"Could not start the profiling window thread, "
+            <<"profiling until the VM exits"<<endl;
+    }
+}
+
+/*
+ * The VM is leaving the live phase, stop tracking objects.
+ */
+void JNICALL cb_vm_death(jvmtiEnv *jvmti_env, JNIEnv* jni_env) {
+    if(__sync_bool_compare_and_swap(&tracking_stopped, 0, 1)) {
+        stop_tracking(false, jni_env, jvmti_env);
         return;
     }
 
-    ThreadAccessInfo access_info;
-    if(tag == 0) {
-       access_info = create_object_info(thread, NO_THREAD, jvmti_env);
-       jvmti_env->SetTag(thread, reinterpret_cast<jlong>(access_info));
+    // A profiling window is closing, let it finish writing the results.
+    jvmti_env->RawMonitorEnter(window_lock);
+    while(!results_written) {
+        jvmti_env->RawMonitorWait(window_lock, 0);
     }
-    else
-        access_info = reinterpret_cast<ThreadAccessInfo>(tag);
+    jvmti_env->RawMonitorExit(window_lock);
+}
 
-    thread_info thread_inf;
-    thread_inf.thread_ID =  access_info->object_ID;
-    thread_inf.thread_name = new string();
-    thread_inf.thread_name->assign(name);
+/*
+ * Adds the capabilities allocation sites and sampled tracking need, and
+ * sets allocations_sampled if the VM samples allocations every
+ * sample_interval bytes. VMs older than JVMTI 11 only post the objects the
+ * VM allocates itself. Returns false if no allocation is posted at all.
+ */
+static bool add_allocation_capabilities(jvmtiEnv* env) {
+    jvmtiCapabilities potential, capabilities;
+    memset(&potential, 0, sizeof(potential));
+    memset(&capabilities, 0, sizeof(capabilities));
+    env->GetPotentialCapabilities(&potential);
+
+    capabilities.can_get_line_numbers = potential.can_get_line_numbers;
+    capabilities.can_generate_vm_object_alloc_events =
+            potential.can_generate_vm_object_alloc_events;
+    bool sampled = false;
+#ifdef JVMTI_VERSION_11
+    capabilities.can_generate_sampled_object_alloc_events =
+            potential.can_generate_sampled_object_alloc_events;
+    sampled = potential.can_generate_sampled_object_alloc_events;
+#endif
+    if(env->AddCapabilities(&capabilities) != JVMTI_ERROR_NONE) return false;
 
-    thread_names.push_back(thread_inf);
-    jvmti_env->RawMonitorExit(lock);
+#ifdef JVMTI_VERSION_11
+    if(sampled && env->SetHeapSamplingInterval(sample_interval) !=
+            JVMTI_ERROR_NONE)
+        sampled = false;
+#endif
+    allocations_sampled = sampled;
+    return sampled || capabilities.can_generate_vm_object_alloc_events;
 }
 
 /*
  * Register capabilities and sets callbacks for class prepare, method entry,
- * field access and field modification.
+ * field access, field modification, object free, thread start/end and VM
+ * init/death, and for allocations when sites are captured or tracking is
+ * sampled. The bytecode
+ * engine needs neither field watches nor method
+ * entry events, and only asks for class file load hooks instead, so the
+ * VM is free to keep compiling code. A running VM only grants some
+ * capabilities, an attached agent goes without method entry events.
+ * Returns the error of adding the capabilities.
  */
-void init_jvmti_callbacks(jvmtiEnv* env) {
+jvmtiError init_jvmti_callbacks(jvmtiEnv* env) {
 
     jvmtiCapabilities capabilities = { 1 };
     jvmtiEventCallbacks callbacks = { 0 };
 
-    capabilities.can_generate_method_entry_events = 1;
-    capabilities.can_generate_field_access_events = 1;
-    capabilities.can_generate_field_modification_events = 1;
-    capabilities.can_access_local_variables = 1;
+    if(engine == ENGINE_WATCH) {
+        if(!attached) {
+            capabilities.can_generate_method_entry_events = 1;
+            capabilities.can_access_local_variables = 1;
+        }
+        capabilities.can_generate_field_access_events = 1;
+        capabilities.can_generate_field_modification_events = 1;
+    }
     capabilities.can_tag_objects = 1;
     capabilities.can_generate_object_free_events = 1;
 
-    env->AddCapabilities(&capabilities);
+    jvmtiError err = env->AddCapabilities(&capabilities);
+
+    if(site_depth > 0 || tracking == TRACK_SAMPLED) {
+        bool posted = add_allocation_capabilities(env);
+        if(tracking == TRACK_SAMPLED && !allocations_sampled) {
+            cout<<"Allocations are not sampled by this VM, all objects "
+                <<"are tracked"<<endl;
+            tracking = TRACK_ALL;
+        }
+        if(site_depth > 0 && !posted) {
+            cout<<"Allocation sites cannot be captured in this VM"<<endl;
+            site_depth = 0;
+        }
+        else if(site_depth > 0 && !allocations_sampled) {
+            cout<<"Allocations are not sampled by this VM, only objects "
+                <<"the VM allocates itself get a site"<<endl;
+        }
+        if(site_depth > 0 || tracking == TRACK_SAMPLED)
+            switch_allocation_events(true, env);
+    }
 
+    env->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_INIT, NULL);
+    env->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_DEATH, NULL);
     env->SetEventNotificationMode(JVMTI_ENABLE,
             JVMTI_EVENT_CLASS_PREPARE, NULL);
-    env->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_METHOD_ENTRY, NULL);
-    env->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_FIELD_ACCESS, NULL);
-    env->SetEventNotificationMode(JVMTI_ENABLE,
-            JVMTI_EVENT_FIELD_MODIFICATION, NULL);
+    if(engine == ENGINE_WATCH) {
+        if(!attached)
+            env->SetEventNotificationMode(JVMTI_ENABLE,
+                    JVMTI_EVENT_METHOD_ENTRY, NULL);
+        env->SetEventNotificationMode(JVMTI_ENABLE,
+                JVMTI_EVENT_FIELD_ACCESS, NULL);
+        env->SetEventNotificationMode(JVMTI_ENABLE,
+                JVMTI_EVENT_FIELD_MODIFICATION, NULL);
+    }
+    else {
+        env->SetEventNotificationMode(JVMTI_ENABLE,
+                JVMTI_EVENT_CLASS_FILE_LOAD_HOOK, NULL);
+    }
     env->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_OBJECT_FREE, NULL);
     env->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_THREAD_START, NULL);
+    env->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_THREAD_END, NULL);
     
+    callbacks.VMInit = &cb_vm_init;
+    callbacks.VMDeath = &cb_vm_death;
+    callbacks.ClassFileLoadHook = &cb_class_file_load_hook;
     callbacks.ClassPrepare = &cb_class_prepare;
     callbacks.MethodEntry = &cb_method_entry;
     callbacks.FieldAccess = &cb_field_access;
     callbacks.FieldModification = &cb_field_modification;
     callbacks.ObjectFree = &cb_object_free;
+    callbacks.VMObjectAlloc = &cb_object_alloc;
+#ifdef JVMTI_VERSION_11
+    callbacks.SampledObjectAlloc = &cb_object_alloc;
+#endif
     callbacks.ThreadStart = &cb_thread_start;
+    callbacks.ThreadEnd = &cb_thread_end;
     env->SetEventCallbacks(&callbacks, sizeof(callbacks));
+    return err;
 }
 
-
 /******************************************************************************/
 /* Agent loading and unloading                                                */
 /******************************************************************************/
@@ -769,56 +3597,245 @@ void output_user_runtime() {
     cout<<"\nRuntime: "<<hours<<"h "<<mins<<"m "<<secs<<"secs"<<endl;
 }
 
-void parse_options(char* options ) {
-    string *s_options, *object_info_file, *object_accesses_file;
+/*
+ * Applies a single 'key=value' agent option.
+ */
+void set_option(const string& key, const string& value) {
+    if(key.compare("sync") == 0) {
+        if(value.compare("atomic") == 0)
+            event_sync = SYNC_ATOMIC;
+        else if(value.compare("monitor") == 0)
+            event_sync = SYNC_MONITOR;
+        else
+            cout<<"Unknown sync mode: "<<value<<endl;
+    }
+    else if(key.compare("engine") == 0) {
+        if(value.compare("bytecode") == 0)
+            engine = ENGINE_BYTECODE;
+        else if(value.compare("watch") == 0)
+            engine = ENGINE_WATCH;
+        else
+            cout<<"Unknown engine: "<<value<<endl;
+    }
+    else if(key.compare("write_buffer") == 0) {
+        int size = atoi(value.c_str());
+        if(size >= 4096)
+            profiling_io::set_write_buffer_size(size);
+        else
+            cout<<"Invalid write buffer size, expected at least 4096 bytes: "
+                <<value<<endl;
+    }
+    else if(key.compare("format") == 0) {
+        if(value.compare("1") == 0 || value.compare("2") == 0)
+            profiling_io::set_output_format(atoi(value.c_str()));
+        else
+            cout<<"Unknown output format: "<<value<<endl;
+    }
+    else if(key.compare("include") == 0) {
+        add_class_patterns(value, &include_patterns);
+    }
+    else if(key.compare("exclude") == 0) {
+        add_class_patterns(value, &exclude_patterns);
+    }
+    else if(key.compare("duty_cycle") == 0) {
+        size_t slash = value.find('/');
+        duty_on_millis = atol(value.substr(0, slash).c_str());
+        duty_period_millis = (slash == string::npos ?
+                                0 : atol(value.substr(slash + 1).c_str()));
+
+        if(duty_on_millis <= 0 || duty_period_millis <= duty_on_millis) {
+            cout<<"Invalid duty cycle, expected <on ms>/<period ms>: "
+                <<value<<endl;
+            duty_on_millis = duty_period_millis = 0;
+        }
+    }
+    else if(key.compare("sizes") == 0) {
+        if(value.compare("exact") == 0)
+            sizes = SIZES_EXACT;
+        else if(value.compare("heap") == 0)
+            sizes = SIZES_HEAP;
+        else if(value.compare("sampled") == 0)
+            sizes = SIZES_SAMPLED;
+        else
+            cout<<"Unknown size accounting: "<<value<<endl;
+    }
+    else if(key.compare("size_sample") == 0) {
+        size_sample_interval = atol(value.c_str());
+        if(size_sample_interval <= 0) {
+            cout<<"Invalid size sample interval: "<<value<<endl;
+            size_sample_interval = 64;
+        }
+    }
+    else if(key.compare("duration") == 0) {
+        profile_millis = atol(value.c_str())*1000;
+        if(profile_millis <= 0) {
+            cout<<"Invalid profiling duration, expected seconds: "
+                <<value<<endl;
+            profile_millis = 0;
+        }
+    }
+    else if(key.compare("overhead") == 0) {
+        if(value.compare("on") == 0)
+            measure_overhead = true;
+        else if(value.compare("off") == 0)
+            measure_overhead = false;
+        else
+            cout<<"Unknown overhead setting, expected on or off: "
+                <<value<<endl;
+    }
+    else if(key.compare("sites") == 0) {
+        site_depth = atoi(value.c_str());
+        if(site_depth < 0 || site_depth > max_site_depth) {
+            cout<<"Invalid site depth, expected 0 to "<<max_site_depth
+                <<" frames: "<<value<<endl;
+            site_depth = 0;
+        }
+        profiling_io::set_object_sites(site_depth > 0);
+    }
+    else if(key.compare("sample_interval") == 0) {
+        sample_interval = atoi(value.c_str());
+        if(sample_interval < 0) {
+            cout<<"Invalid allocation sampling interval, expected bytes: "
+                <<value<<endl;
+            sample_interval = 64*1024;
+        }
+    }
+    else if(key.compare("tracking") == 0) {
+        if(value.compare("sampled") == 0)
+            tracking = TRACK_SAMPLED;
+        else if(value.compare("all") == 0)
+            tracking = TRACK_ALL;
+        else
+            cout<<"Unknown tracking mode: "<<value<<endl;
+    }
+    else if(key.compare("snapshot") == 0) {
+        snapshot_millis = atol(value.c_str());
+        if(snapshot_millis <= 0) {
+            cout<<"Invalid snapshot interval, expected milliseconds: "
+                <<value<<endl;
+            snapshot_millis = 0;
+        }
+    }
+    else if(key.compare("snapshot_to") == 0) {
+        snapshot_target = value;
+    }
+    else if(key.compare("snapshot_top") == 0) {
+        snapshot_top_classes = atoi(value.c_str());
+        if(snapshot_top_classes < 0) snapshot_top_classes = 0;
+    }
+    else {
+        cout<<"Unknown agent option: "<<key<<endl;
+    }
+}
 
+/*
+ * Agent options are a comma separated list. The first two plain entries name
+ * the object info and the object accesses files, entries of the form
+ * 'key=value' select optional behaviour, for example:
+ * -agentpath:libthread_locaity_info.so=ObjectInfo,ObjectAccesses,sync=atomic
+ */
+void parse_options(char* options ) {
+    string s_options, files[2];
+    int file_count = 0;
 
     if(options == NULL) return;
 
-    s_options = new string();
-    s_options->assign(options);
-    object_info_file = new string();
-    object_accesses_file = new string();
+    s_options.assign(options);
 
-    int comma = s_options->find(',');
+    size_t start = 0;
+    while(start <= s_options.length()) {
+        size_t comma = s_options.find(',', start);
+        if(comma == string::npos) comma = s_options.length();
 
-    object_info_file->assign(s_options->substr(0, comma));
-    object_accesses_file->assign(s_options->substr(comma+1,s_options->length()-1));
+        string entry = s_options.substr(start, comma - start);
+        size_t equals = entry.find('=');
 
+        if(equals != string::npos)
+            set_option(entry.substr(0, equals), entry.substr(equals + 1));
+        else if(!entry.empty() && file_count < 2)
+            files[file_count++] = entry;
 
-    profiling_io::change_profiling_files(object_info_file, object_accesses_file);
+        start = comma + 1;
+    }
+
+    if(file_count == 2) {
+        string *object_info_file = new string(files[0]);
+        string *object_accesses_file = new string(files[1]);
+        profiling_io::change_profiling_files(object_info_file,
+                                             object_accesses_file);
+    }
 }
 
 /*
- * Start the agent, open the output file and initialize callbacks.
+ * Start the agent, open the output file and initialize callbacks. Shared by
+ * loading at VM start and attaching to a running VM.
  */
-JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM *vm, char *options, void *reserved) {
+static jint start_agent(JavaVM *vm, char *options) {
+    agent_started = true;
     startTime = time(NULL);
+    info_pool::init_pool(sizeof(struct thread_access_info));
+    profiling_io::init_buffer(&access_records);
     parse_options(options);
+
+    // Classes already loaded cannot be rewritten without retransforming them.
+    if(attached && engine == ENGINE_BYTECODE) {
+        cout<<"The bytecode engine cannot be attached, watching fields"<<endl;
+        engine = ENGINE_WATCH;
+    }
     profiling_io::open_write();
 
     jvmtiEnv* env;
     vm->GetEnv(reinterpret_cast<void**>(&env), JVMTI_VERSION);
+    jvmti = env;
     env->CreateRawMonitor("Callbacks Lock", &lock);
-
-    init_jvmti_callbacks(env);
+    env->CreateRawMonitor("IO Lock", &io_lock);
+    env->CreateRawMonitor("Write Lock", &write_lock);
+    env->CreateRawMonitor("Watch Lock", &watch_lock);
+    env->CreateRawMonitor("Statistics Lock", &statistics_lock);
+    env->CreateRawMonitor("Snapshot Lock", &snapshot_lock);
+    env->CreateRawMonitor("Window Lock", &window_lock);
+    env->CreateRawMonitor("Sites Lock", &sites_lock);
+
+    if(init_jvmti_callbacks(env) != JVMTI_ERROR_NONE && attached) {
+        cout<<"Could not get the capabilities to watch fields in the "
+            <<"running VM"<<endl;
+        return JNI_ERR;
+    }
     
     return JNI_OK;
 }
 
+JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM *vm, char *options, void *reserved) {
+    return start_agent(vm, options);
+}
+
+/*
+ * Attach to a running VM. It is already in the live phase, so tracking
+ * starts right away, and the classes loaded so far are watched.
+ */
+JNIEXPORT jint JNICALL Agent_OnAttach(JavaVM *vm, char *options, void *reserved) {
+    if(agent_started) {
+        cout<<"The agent already profiled this VM, it can only profile one "
+            <<"window per VM"<<endl;
+        return JNI_ERR;
+    }
+    attached = true;
+    jint result = start_agent(vm, options);
+    if(result != JNI_OK) return result;
+
+    JNIEnv* jni_env;
+    vm->GetEnv(reinterpret_cast<void**>(&jni_env), JNI_VERSION_1_6);
+    cb_vm_init(jvmti, jni_env, NULL);
+    watch_loaded_classes(jni_env, jvmti);
+    return JNI_OK;
+}
+
 /*
  * Before unloading the agent, close the output file and print a summary of
- * profiling results.
+ * profiling results, unless a profiling window already did.
  */
 JNIEXPORT void JNICALL Agent_OnUnload(JavaVM *vm) {
-    program_running = false;
-    set<jlong>::iterator it;
-    for (it = shared_objects_tags.begin();
-            it != shared_objects_tags.end(); it++) {
-        record_object_info(*it);
-    }
-    output_result();
-    profiling_io::close_write();
+    write_results(jvmti);
 
     endTime = time(NULL);
     totalTime = difftime(endTime, startTime);